@@ -0,0 +1,393 @@
+// mdbbench.c
+// Per-call cost of the driver hot paths on the host: checksum, frame
+// build and parse, response dispatch, the outgoing message queue, logging
+// and transaction logging. The driver is compiled into this file so its
+// static helpers can be timed directly; the bus is an in-memory transport
+// that answers every read from a canned frame.
+//
+// Each case runs a batch of calls per sample and reports the median, p99,
+// mean and variance of the per-call time over all samples. -o saves the
+// results as a baseline, -b compares against one and fails when a median
+// got slower than the allowed regression.
+//
+// Build: cc -std=gnu11 -O2 -DMDB_HOST_BUILD -IMDB -IHost
+//        MDB/MdbLogSink.c MDB/MdbPack.c MDB/MdbSettle.c
+//        Host/MdbHostHal.c Host/MdbBench.c -o mdbbench
+// Usage: mdbbench [-n samples] [-o baseline] [-b baseline] [-x max regression %]
+
+#include "Mdb.c"
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+
+#define BENCH_SAMPLES     1000
+#define BENCH_MAX_CASES   16
+#define BENCH_REGRESSION  15     // Percent, median against baseline
+
+typedef struct {
+    uint16_t tx[MDB_MAX_MESSAGE_LENGTH + 1];
+    uint8_t txLength;
+    uint16_t rx[MDB_MAX_MESSAGE_LENGTH + 1];
+    uint8_t rxLength;
+    uint8_t rxIndex;
+} MemoryBus_t;
+
+typedef struct {
+    const char* name;
+    uint16_t batch;              // Calls per timed sample
+    void (*setup)(void);         // Untimed, before every sample
+    void (*run)(void);
+} BenchCase_t;
+
+typedef struct {
+    char name[32];
+    double median;
+    double p99;
+    double mean;
+    double variance;
+} BenchResult_t;
+
+static MemoryBus_t bus;
+static uint8_t payload[MDB_MAX_MESSAGE_LENGTH];
+static volatile uint8_t checksumSink;
+static uint32_t benchTransactionId;
+
+// Private function declarations
+static bool MemorySend(void* context, const uint16_t* words, uint8_t count);
+static bool MemoryReceive(void* context, uint16_t* word, uint32_t timeout);
+static bool MemoryUplinkSend(void* context, const uint8_t* data, uint16_t length);
+static void BusAnswer(const uint8_t* data, uint8_t length);
+static void NoSetup(void);
+static void SetupAck(void);
+static void SetupVendApproved(void);
+static void SetupLogEnabled(void);
+static void SetupLogDisabled(void);
+static void SetupTransaction(void);
+static void RunCallOverhead(void);
+static void RunChecksumShort(void);
+static void RunChecksumLong(void);
+static void RunFrameBuild(void);
+static void RunFrameParse(void);
+static void RunDispatch(void);
+static void RunDispatchDuplicate(void);
+static void RunQueue(void);
+static void RunLogMessage(void);
+static void RunLogTransaction(void);
+static uint64_t NowNs(void);
+static int CompareDouble(const void* a, const void* b);
+static void Measure(const BenchCase_t* bench, uint32_t samples, double* perCall, BenchResult_t* result);
+static int LoadBaseline(const char* path, BenchResult_t* baseline, int maxCount);
+static bool SaveBaseline(const char* path, const BenchResult_t* results, int count);
+
+static const BenchCase_t cases[] = {
+    { "call_overhead",      256, NoSetup,           RunCallOverhead },
+    { "checksum_4",         256, NoSetup,           RunChecksumShort },
+    { "checksum_35",        256, NoSetup,           RunChecksumLong },
+    { "frame_build",        256, NoSetup,           RunFrameBuild },
+    { "frame_parse",        256, SetupVendApproved, RunFrameParse },
+    { "dispatch",           256, NoSetup,           RunDispatch },
+    { "dispatch_duplicate", 256, NoSetup,           RunDispatchDuplicate },
+    { "queue_roundtrip",    256, SetupAck,          RunQueue },
+    { "log_enabled",         32, SetupLogEnabled,   RunLogMessage },
+    { "log_disabled",       256, SetupLogDisabled,  RunLogMessage },
+    { "log_transaction",     32, SetupTransaction,  RunLogTransaction }
+};
+
+#define BENCH_CASES ((int)(sizeof(cases) / sizeof(cases[0])))
+
+int main(int argc, char** argv) {
+    uint32_t samples = BENCH_SAMPLES;
+    const char* savePath = NULL;
+    const char* baselinePath = NULL;
+    double maxRegression = BENCH_REGRESSION;
+    int option;
+
+    while((option = getopt(argc, argv, "n:o:b:x:")) != -1) {
+        switch(option) {
+            case 'n': samples = (uint32_t)strtoul(optarg, NULL, 0); break;
+            case 'o': savePath = optarg; break;
+            case 'b': baselinePath = optarg; break;
+            case 'x': maxRegression = strtod(optarg, NULL); break;
+            default:
+                fprintf(stderr, "usage: %s [-n samples] [-o baseline] [-b baseline] [-x max regression %%]\n", argv[0]);
+                return 2;
+        }
+    }
+    if(samples < 100) {
+        samples = 100;
+    }
+
+    // Driver log output goes nowhere, results go to the real stdout
+    FILE* report = fdopen(dup(STDOUT_FILENO), "w");
+    if(report == NULL || freopen("/dev/null", "w", stdout) == NULL) {
+        perror("stdout");
+        return 2;
+    }
+
+    // HAL_GetTick is a plain read on target, not a system call
+    MdbHostClockSetVirtual(true, 0);
+    static const MDB_Transport_t transport = { MemorySend, MemoryReceive, &bus };
+    MDB_SetTransport(&transport);
+    static const MDB_SettleUplink_t uplink = { NULL, MemoryUplinkSend, NULL };
+    MDB_SettleInit();
+    MDB_SettleSetUplink(&uplink);
+    mdb->session.state = MDB_STATE_ENABLED;
+    for(uint8_t i = 0; i < sizeof(payload); i++) {
+        payload[i] = (uint8_t)(i * 37 + 11);
+    }
+
+    BenchResult_t results[BENCH_MAX_CASES];
+    BenchResult_t baseline[BENCH_MAX_CASES];
+    int baselineCount = 0;
+    double* perCall = malloc(samples * sizeof(double));
+    if(perCall == NULL) {
+        return 2;
+    }
+
+    if(baselinePath != NULL) {
+        baselineCount = LoadBaseline(baselinePath, baseline, BENCH_MAX_CASES);
+        if(baselineCount < 0) {
+            fprintf(stderr, "cannot read baseline %s\n", baselinePath);
+            return 2;
+        }
+    }
+
+    int regressions = 0;
+    fprintf(report, "%-20s %10s %10s %10s %12s", "case", "median ns", "p99 ns", "mean ns", "var ns^2");
+    fprintf(report, baselineCount > 0 ? " %9s %9s\n" : "\n", "median", "p99");
+    for(int i = 0; i < BENCH_CASES; i++) {
+        BenchResult_t* result = &results[i];
+        Measure(&cases[i], samples, perCall, result);
+        fprintf(report, "%-20s %10.1f %10.1f %10.1f %12.1f",
+                result->name, result->median, result->p99, result->mean, result->variance);
+
+        const BenchResult_t* base = NULL;
+        for(int j = 0; j < baselineCount; j++) {
+            if(strcmp(baseline[j].name, result->name) == 0) {
+                base = &baseline[j];
+            }
+        }
+        if(base != NULL && base->median > 0 && base->p99 > 0) {
+            double medianDelta = 100.0 * (result->median - base->median) / base->median;
+            double p99Delta = 100.0 * (result->p99 - base->p99) / base->p99;
+            bool regressed = medianDelta > maxRegression;
+            regressions += regressed;
+            fprintf(report, " %+8.1f%% %+8.1f%%%s", medianDelta, p99Delta, regressed ? "  REGRESSED" : "");
+        }
+        fprintf(report, "\n");
+    }
+
+    if(savePath != NULL && !SaveBaseline(savePath, results, BENCH_CASES)) {
+        fprintf(stderr, "cannot write baseline %s\n", savePath);
+        return 2;
+    }
+    fclose(report);
+    free(perCall);
+    return regressions > 0 ? 1 : 0;
+}
+
+static bool MemorySend(void* context, const uint16_t* words, uint8_t count) {
+    MemoryBus_t* memory = (MemoryBus_t*)context;
+    memcpy(memory->tx, words, count * sizeof(uint16_t));
+    memory->txLength = count;
+    return true;
+}
+
+// Answers every read from the canned frame, over and over
+static bool MemoryReceive(void* context, uint16_t* word, uint32_t timeout) {
+    MemoryBus_t* memory = (MemoryBus_t*)context;
+    (void)timeout;
+    if(memory->rxLength == 0) {
+        return false;
+    }
+    *word = memory->rx[memory->rxIndex];
+    memory->rxIndex = (uint8_t)((memory->rxIndex + 1) % memory->rxLength);
+    return true;
+}
+
+static bool MemoryUplinkSend(void* context, const uint8_t* data, uint16_t length) {
+    (void)context;
+    (void)data;
+    (void)length;
+    return true;
+}
+
+// A lone byte is sent as is, data gets its checksum with the mode bit
+static void BusAnswer(const uint8_t* data, uint8_t length) {
+    for(uint8_t i = 0; i < length; i++) {
+        bus.rx[i] = data[i];
+    }
+    if(length == 1) {
+        bus.rx[0] |= MDB_MODE_BIT;
+    } else {
+        bus.rx[length] = CalculateChecksum((uint8_t*)data, length) | MDB_MODE_BIT;
+        length++;
+    }
+    bus.rxLength = length;
+    bus.rxIndex = 0;
+}
+
+static void NoSetup(void) {
+}
+
+static void SetupAck(void) {
+    static const uint8_t ack = MDB_ACK;
+    BusAnswer(&ack, 1);
+}
+
+static void SetupVendApproved(void) {
+    static const uint8_t approved[] = { MDBRxCashlessVendApproved, 0x00, 0x96 };
+    BusAnswer(approved, sizeof(approved));
+}
+
+// The sink is drained outside the timed loop so no sample hits a full ring
+static void SetupLogEnabled(void) {
+    currentLogLevel = LOG_INFO;
+    MDB_LogSinkService();
+}
+
+static void SetupLogDisabled(void) {
+    currentLogLevel = LOG_WARNING;
+}
+
+// Settles whatever the last sample queued, so every record is enqueued
+static void SetupTransaction(void) {
+    while(MDB_SettlePending() > 0) {
+        MdbHostClockAdvanceTo(HAL_GetTick() + MDB_SETTLE_INTERVAL);
+        MDB_SettleService(true);
+    }
+    MDB_LogSinkService();
+}
+
+static void RunCallOverhead(void) {
+}
+
+static void RunChecksumShort(void) {
+    checksumSink = CalculateChecksum(payload, 4);
+}
+
+static void RunChecksumLong(void) {
+    checksumSink = CalculateChecksum(payload, MDB_MAX_MESSAGE_LENGTH - 1);
+}
+
+static void RunFrameBuild(void) {
+    uint8_t vendRequest[] = { MDB_CMD_VEND, MDB_VEND_REQUEST, 0x00, 0x96, 0x00, 0x07 };
+    SendCommand(vendRequest, sizeof(vendRequest));
+}
+
+static void RunFrameParse(void) {
+    uint8_t length;
+    WaitForResponse(mdb->rxBuffer, &length);
+}
+
+// JUST RESET after our own RESET: full dispatch, handler and cache update
+static void RunDispatch(void) {
+    uint8_t justReset[] = { MDBRxCashlessJustReset, MDBRxCashlessJustReset };
+    mdb->justResetExpected = true;
+    mdb->responseCache.valid = false;
+    MDB_ProcessMessage(justReset, sizeof(justReset));
+}
+
+static void RunDispatchDuplicate(void) {
+    uint8_t justReset[] = { MDBRxCashlessJustReset, MDBRxCashlessJustReset };
+    MDB_ProcessMessage(justReset, sizeof(justReset));
+}
+
+static void RunQueue(void) {
+    uint8_t readerEnable[] = { MDB_CMD_READER, MDB_READER_ENABLE };
+    MDB_QueueMessage(readerEnable, sizeof(readerEnable));
+    MDB_ProcessMessageQueue();
+}
+
+static void RunLogMessage(void) {
+    MDB_LogMessage(LOG_INFO, "Vend approved: item %u amount %u", 7u, 150u);
+}
+
+static void RunLogTransaction(void) {
+    MDB_TransactionLog_t transaction = {
+        .timestamp = HAL_GetTick(),
+        .type = TRANS_PAID_VEND,
+        .amount = 150,
+        .itemNumber = 7,
+        .success = true,
+        .error = MDB_ERR_NONE,
+        .transactionId = ++benchTransactionId
+    };
+    MDB_LogTransaction(&transaction);
+}
+
+static uint64_t NowNs(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+}
+
+static int CompareDouble(const void* a, const void* b) {
+    double x = *(const double*)a;
+    double y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+static void Measure(const BenchCase_t* bench, uint32_t samples, double* perCall, BenchResult_t* result) {
+    // Warm caches and branch predictors before the first sample counts
+    bench->setup();
+    for(uint16_t i = 0; i < bench->batch; i++) {
+        bench->run();
+    }
+
+    double sum = 0;
+    for(uint32_t s = 0; s < samples; s++) {
+        bench->setup();
+        uint64_t start = NowNs();
+        for(uint16_t i = 0; i < bench->batch; i++) {
+            bench->run();
+        }
+        perCall[s] = (double)(NowNs() - start) / bench->batch;
+        sum += perCall[s];
+    }
+
+    result->mean = sum / samples;
+    result->variance = 0;
+    for(uint32_t s = 0; s < samples; s++) {
+        double delta = perCall[s] - result->mean;
+        result->variance += delta * delta;
+    }
+    result->variance /= samples - 1;
+
+    qsort(perCall, samples, sizeof(double), CompareDouble);
+    result->median = perCall[samples / 2];
+    result->p99 = perCall[(samples * 99 + 99) / 100 - 1];
+    snprintf(result->name, sizeof(result->name), "%s", bench->name);
+}
+
+// Baseline: one "name median p99 mean variance" line per case, # comments
+static int LoadBaseline(const char* path, BenchResult_t* baseline, int maxCount) {
+    FILE* in = fopen(path, "r");
+    if(in == NULL) {
+        return -1;
+    }
+    char line[128];
+    int count = 0;
+    while(count < maxCount && fgets(line, sizeof(line), in) != NULL) {
+        BenchResult_t* entry = &baseline[count];
+        if(line[0] != '#' && sscanf(line, "%31s %lf %lf %lf %lf", entry->name, &entry->median,
+                                    &entry->p99, &entry->mean, &entry->variance) == 5) {
+            count++;
+        }
+    }
+    fclose(in);
+    return count;
+}
+
+static bool SaveBaseline(const char* path, const BenchResult_t* results, int count) {
+    FILE* out = fopen(path, "w");
+    if(out == NULL) {
+        return false;
+    }
+    fprintf(out, "# mdbbench baseline: name median_ns p99_ns mean_ns variance_ns2\n");
+    for(int i = 0; i < count; i++) {
+        fprintf(out, "%s %.2f %.2f %.2f %.2f\n", results[i].name, results[i].median,
+                results[i].p99, results[i].mean, results[i].variance);
+    }
+    return fclose(out) == 0;
+}
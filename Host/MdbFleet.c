@@ -0,0 +1,514 @@
+// mdbfleet.c
+// Runs a fleet of simulated vending machines at once, each a driver
+// instance talking to its own simulated cashless reader on its own
+// virtual clock. Machines advance in slices of simulated time on a
+// work-stealing thread pool: every worker runs slices from its own deque
+// and steals from the others once it runs dry, so busy machines do not
+// hold up idle ones. Results depend only on the seed, never on the
+// number of threads.
+//
+// Customers arrive at each machine at random (exponential gaps around
+// the mean interval), take a moment to choose, prefer a few popular
+// items and sometimes walk away without buying. The report gives the
+// vends completed per simulated second across the fleet, the spread of
+// request to approval latency, and how quickly machines recovered from
+// reader restarts.
+//
+// The settlement queue and log sink keep one copy of their state per
+// process, so the fleet runs without them: logging compiled out, the
+// sink replaced by stubs below.
+//
+// Build: cc -std=gnu11 -O2 -pthread -DMDB_HOST_BUILD -DMDB_LOG_LEVEL_MIN=0
+//        -DMDB_SETTLE_ENABLE=0 -IMDB -IHost MDB/Mdb.c MDB/MdbPack.c
+//        Host/MdbHostHal.c Host/MdbSimReader.c Host/MdbFleet.c -lm -o mdbfleet
+// Usage: mdbfleet [-m machines] [-j threads] [-t seconds] [-s seed]
+//                 [-c mean customer interval ms] [-l slice ms]
+//                 [-f nak,corrupt,drop,late,reset]
+//   -f  random fault rates per 10000 commands, as for mdbsim
+
+#include "MdbSimReader.h"
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <time.h>
+
+#define FLEET_MAX_THREADS   64
+#define LATENCY_BUCKETS     2000   // 1 ms each, the last one collects the rest
+#define ITEM_COUNT          24
+#define WALK_AWAY_CHANCE    10     // Percent of customers who buy nothing
+#define CHOOSE_TIME_MEAN    4000   // ms from card to selection
+
+typedef struct {
+    uint32_t arrivals;
+    uint32_t balked;             // Customer found the machine busy or offline
+    uint32_t walkAways;
+    uint32_t attempted;
+    uint32_t completed;
+    uint32_t abandoned;
+    uint32_t refused;            // The driver would not send the VEND REQUEST
+    uint32_t initFailures;
+    uint64_t revenue;
+} MachineStats_t;
+
+typedef struct {
+    MDB_Instance_t driver;
+    MDB_VendJournal_t journal[2];
+    MdbSimReader_t sim;
+    MdbHostClock_t clock;
+    MachineStats_t stats;
+    uint32_t rng;
+    bool online;
+    bool inVend;
+    bool choosing;
+    uint32_t served;
+    uint32_t nextArrival;
+    uint32_t selectAt;
+    uint32_t requestTick;
+    uint32_t customerFunds;
+} Machine_t;
+
+typedef struct {
+    pthread_mutex_t lock;
+    uint32_t* items;             // Machine indices, a ring of fleet size
+    uint32_t top;                // Thieves take from here
+    uint32_t bottom;             // The owner pushes and pops here
+} WorkDeque_t;
+
+typedef struct {
+    pthread_t thread;
+    uint32_t index;
+    uint32_t rng;
+    WorkDeque_t deque;
+    uint64_t slices;
+    uint64_t steals;
+    uint32_t latency[LATENCY_BUCKETS];
+} Worker_t;
+
+static Machine_t* machines;
+static uint32_t machineCount = 64;
+static Worker_t workers[FLEET_MAX_THREADS];
+static uint32_t workerCount = 4;
+static uint32_t duration = 3600;
+static uint32_t slice = 1000;
+static uint32_t customerInterval = 60000;
+static uint32_t remaining;       // Machines not yet at the end of the run
+
+// Item prices in cents, popular items first
+static const uint16_t itemPrice[ITEM_COUNT] = {
+    150, 150, 175, 125, 200, 150, 100, 225, 175, 250, 150, 125,
+    300, 175, 200, 100, 275, 150, 125, 350, 200, 175, 225, 250
+};
+
+// Private function declarations
+static void MachineInit(Machine_t* machine, uint32_t index, const MdbSimConfig_t* config);
+static void RunSlice(Worker_t* worker, Machine_t* machine, uint32_t until);
+static void RunCustomer(Worker_t* worker, Machine_t* machine);
+static void* WorkerMain(void* argument);
+static bool TakeWork(Worker_t* worker, uint32_t* machine);
+static void PushWork(WorkDeque_t* deque, uint32_t machine);
+static uint32_t NextRandom(uint32_t* state);
+static uint32_t ExponentialDelay(uint32_t* state, uint32_t mean);
+static uint32_t Percentile(const uint32_t* histogram, uint64_t count, double fraction);
+static void Report(const MdbSimConfig_t* config, double wall);
+
+// The fleet has no log output
+bool MDB_LogSinkWrite(const uint8_t* data, uint16_t length) {
+    (void)data;
+    (void)length;
+    return true;
+}
+
+uint16_t MDB_LogSinkFree(void) {
+    return UINT16_MAX;
+}
+
+void MDB_LogSinkService(void) {
+}
+
+int main(int argc, char** argv) {
+    MdbSimConfig_t config = {
+        .featureLevel = 3,
+        .scaleFactor = 1,
+        .miscOptions = MDB_READER_OPT_REFUNDS,
+        .responseDelay = 1,
+        .wordTime = MDB_WORD_TIME_US,
+        .approveDelay = 400,
+        .seed = 1
+    };
+    int option;
+
+    while((option = getopt(argc, argv, "m:j:t:s:c:l:f:")) != -1) {
+        switch(option) {
+            case 'm': machineCount = (uint32_t)strtoul(optarg, NULL, 0); break;
+            case 'j': workerCount = (uint32_t)strtoul(optarg, NULL, 0); break;
+            case 't': duration = (uint32_t)strtoul(optarg, NULL, 0); break;
+            case 's': config.seed = (uint32_t)strtoul(optarg, NULL, 0); break;
+            case 'c': customerInterval = (uint32_t)strtoul(optarg, NULL, 0); break;
+            case 'l': slice = (uint32_t)strtoul(optarg, NULL, 0); break;
+            case 'f': {
+                unsigned int rates[5] = {0};
+                sscanf(optarg, "%u,%u,%u,%u,%u", &rates[0], &rates[1], &rates[2], &rates[3], &rates[4]);
+                config.faults = (MdbSimFaults_t){ rates[0], rates[1], rates[2], rates[3], rates[4] };
+                break;
+            }
+            default:
+                fprintf(stderr, "usage: %s [-m machines] [-j threads] [-t seconds] [-s seed] "
+                                "[-c customer ms] [-l slice ms] [-f nak,corrupt,drop,late,reset]\n", argv[0]);
+                return 2;
+        }
+    }
+    if(machineCount == 0 || workerCount == 0 || workerCount > FLEET_MAX_THREADS ||
+       slice == 0 || customerInterval == 0) {
+        fprintf(stderr, "machines, slice and customer interval must be positive, threads 1-%d\n",
+                FLEET_MAX_THREADS);
+        return 2;
+    }
+    duration *= 1000;
+
+    machines = calloc(machineCount, sizeof(Machine_t));
+    if(machines == NULL) {
+        fprintf(stderr, "out of memory for %lu machines\n", (unsigned long)machineCount);
+        return 1;
+    }
+    for(uint32_t i = 0; i < machineCount; i++) {
+        MachineInit(&machines[i], i, &config);
+    }
+
+    // Deal the machines out round robin, the pool evens out the rest
+    for(uint32_t w = 0; w < workerCount; w++) {
+        workers[w].index = w;
+        workers[w].rng = config.seed * 747796405u + w + 1;
+        workers[w].deque.items = calloc(machineCount, sizeof(uint32_t));
+        pthread_mutex_init(&workers[w].deque.lock, NULL);
+    }
+    for(uint32_t i = 0; i < machineCount; i++) {
+        PushWork(&workers[i % workerCount].deque, i);
+    }
+    __atomic_store_n(&remaining, machineCount, __ATOMIC_RELEASE);
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for(uint32_t w = 0; w < workerCount; w++) {
+        pthread_create(&workers[w].thread, NULL, WorkerMain, &workers[w]);
+    }
+    for(uint32_t w = 0; w < workerCount; w++) {
+        pthread_join(workers[w].thread, NULL);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    Report(&config, (double)(end.tv_sec - start.tv_sec) + (double)(end.tv_nsec - start.tv_nsec) / 1e9);
+    return 0;
+}
+
+// Each machine gets its own reader seed and approval delay so the fleet
+// does not move in lockstep
+static void MachineInit(Machine_t* machine, uint32_t index, const MdbSimConfig_t* config) {
+    MdbSimConfig_t own = *config;
+    machine->rng = (config->seed ^ 0x9E3779B9u) + index * 2654435761u;
+    if(machine->rng == 0) {
+        machine->rng = 1;
+    }
+    own.seed = NextRandom(&machine->rng);
+    own.approveDelay = 150 + NextRandom(&machine->rng) % 700;
+
+    MDB_InstanceInit(&machine->driver, machine->journal);
+    MdbSimInit(&machine->sim, &own);
+    machine->clock.virtualClock = true;
+    machine->nextArrival = ExponentialDelay(&machine->rng, customerInterval);
+
+    MDB_SelectInstance(&machine->driver);
+    MDB_Transport_t transport = MdbSimTransport(&machine->sim);
+    MDB_SetTransport(&transport);
+    MDB_SelectInstance(NULL);
+}
+
+static void* WorkerMain(void* argument) {
+    Worker_t* worker = (Worker_t*)argument;
+    uint32_t index;
+
+    while(__atomic_load_n(&remaining, __ATOMIC_ACQUIRE) != 0) {
+        if(!TakeWork(worker, &index)) {
+            sched_yield();
+            continue;
+        }
+
+        Machine_t* machine = &machines[index];
+        MdbHostClockSelect(&machine->clock);
+        uint32_t now = HAL_GetTick();
+        uint32_t until = duration - now < slice ? duration : now + slice;
+        RunSlice(worker, machine, until);
+        worker->slices++;
+
+        if(until >= duration) {
+            __atomic_sub_fetch(&remaining, 1, __ATOMIC_ACQ_REL);
+        } else {
+            PushWork(&worker->deque, index);
+        }
+    }
+
+    MDB_SelectInstance(NULL);
+    MdbHostClockSelect(NULL);
+    return NULL;
+}
+
+// Newest work from our own deque, otherwise the oldest from a random victim
+static bool TakeWork(Worker_t* worker, uint32_t* machine) {
+    WorkDeque_t* own = &worker->deque;
+    pthread_mutex_lock(&own->lock);
+    if(own->bottom != own->top) {
+        own->bottom--;
+        *machine = own->items[own->bottom % machineCount];
+        pthread_mutex_unlock(&own->lock);
+        return true;
+    }
+    pthread_mutex_unlock(&own->lock);
+
+    uint32_t first = NextRandom(&worker->rng) % workerCount;
+    for(uint32_t i = 0; i < workerCount; i++) {
+        WorkDeque_t* victim = &workers[(first + i) % workerCount].deque;
+        if(victim == own) {
+            continue;
+        }
+        pthread_mutex_lock(&victim->lock);
+        if(victim->bottom != victim->top) {
+            *machine = victim->items[victim->top % machineCount];
+            victim->top++;
+            pthread_mutex_unlock(&victim->lock);
+            worker->steals++;
+            return true;
+        }
+        pthread_mutex_unlock(&victim->lock);
+    }
+    return false;
+}
+
+// A machine sits in at most one deque, so a ring of fleet size never fills
+static void PushWork(WorkDeque_t* deque, uint32_t machine) {
+    pthread_mutex_lock(&deque->lock);
+    deque->items[deque->bottom % machineCount] = machine;
+    deque->bottom++;
+    pthread_mutex_unlock(&deque->lock);
+}
+
+// Same loop as mdbsim, on this machine's clock until the slice ends
+static void RunSlice(Worker_t* worker, Machine_t* machine, uint32_t until) {
+    MDB_SelectInstance(&machine->driver);
+
+    while((int32_t)(HAL_GetTick() - until) < 0) {
+        if(!machine->online) {
+            machine->online = MDB_Initialize();
+            if(!machine->online) {
+                machine->stats.initFailures++;
+                HAL_Delay(MDB_POLL_INTERVAL);
+            }
+            continue;
+        }
+
+        MDB_Poll();
+        RunCustomer(worker, machine);
+
+        // Nothing can happen before the next poll slot, reader event or customer
+        uint32_t now = HAL_GetTick();
+        uint32_t next = MDB_NextPollTime();
+        uint32_t simNext = MdbSimNextEvent(&machine->sim, now);
+        if((int32_t)(simNext - next) < 0) {
+            next = simNext;
+        }
+        if((int32_t)(machine->nextArrival - next) < 0) {
+            next = machine->nextArrival;
+        }
+        if(machine->choosing && (int32_t)(machine->selectAt - next) < 0) {
+            next = machine->selectAt;
+        }
+        if((int32_t)(until - next) < 0) {
+            next = until;
+        }
+        MdbHostClockAdvanceTo((int32_t)(next - now) > 0 ? next : now + 1);
+    }
+}
+
+// Arrival, choice and purchase of one customer at a time
+static void RunCustomer(Worker_t* worker, Machine_t* machine) {
+    const MDB_Session_t* session = MDB_GetSession();
+    MachineStats_t* stats = &machine->stats;
+    uint32_t now = HAL_GetTick();
+
+    if((int32_t)(now - machine->nextArrival) >= 0) {
+        uint32_t sessions = machine->sim.stats.sessions;
+        machine->nextArrival = now + ExponentialDelay(&machine->rng, customerInterval);
+        machine->customerFunds = 100 + NextRandom(&machine->rng) % 19 * 50;
+        stats->arrivals++;
+        MdbSimPresentCard(&machine->sim, machine->customerFunds);
+        if(machine->sim.stats.sessions == sessions) {
+            stats->balked++;
+        }
+    }
+
+    if(machine->inVend) {
+        if(session->state == MDB_STATE_VEND && session->outcomeId == session->transactionId) {
+            uint32_t latency = now - machine->requestTick;
+            worker->latency[latency < LATENCY_BUCKETS ? latency : LATENCY_BUCKETS - 1]++;
+            MDB_VendSuccess(session->itemNumber);
+            stats->completed++;
+            stats->revenue += session->vendAmount;
+            machine->inVend = false;
+            MDB_SessionComplete();
+        } else if(session->state != MDB_STATE_VEND) {
+            stats->abandoned++;
+            machine->inVend = false;
+            if(session->state == MDB_STATE_SESSION_IDLE) {
+                MDB_SessionComplete();
+            }
+        }
+        return;
+    }
+
+    if(session->state == MDB_STATE_SESSION_IDLE && machine->served < machine->sim.stats.sessions) {
+        machine->served = machine->sim.stats.sessions;
+        machine->choosing = true;
+        machine->selectAt = now + ExponentialDelay(&machine->rng, CHOOSE_TIME_MEAN);
+        return;
+    }
+
+    if(!machine->choosing || (int32_t)(now - machine->selectAt) < 0) {
+        return;
+    }
+    machine->choosing = false;
+    if(session->state != MDB_STATE_SESSION_IDLE) {
+        return;
+    }
+
+    // Squaring a uniform draw skews the choice toward the first items
+    uint32_t draw = NextRandom(&machine->rng) % 1000;
+    uint16_t item = (uint16_t)(draw * draw * ITEM_COUNT / 1000000);
+    if(NextRandom(&machine->rng) % 100 < WALK_AWAY_CHANCE || itemPrice[item] > session->availableFunds) {
+        stats->walkAways++;
+        MDB_SessionComplete();
+        return;
+    }
+
+    stats->attempted++;
+    machine->requestTick = now;
+    machine->inVend = MDB_VendRequest((uint16_t)(item + 1), itemPrice[item]);
+    if(!machine->inVend) {
+        stats->refused++;
+    }
+}
+
+// xorshift32
+static uint32_t NextRandom(uint32_t* state) {
+    uint32_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *state = x;
+    return x;
+}
+
+static uint32_t ExponentialDelay(uint32_t* state, uint32_t mean) {
+    double uniform = ((double)(NextRandom(state) >> 8) + 1.0) / 16777217.0;
+    double delay = -log(uniform) * mean;
+    return delay < 1.0 ? 1 : delay > 0x3FFFFFFF ? 0x3FFFFFFF : (uint32_t)delay;
+}
+
+static uint32_t Percentile(const uint32_t* histogram, uint64_t count, double fraction) {
+    uint64_t target = (uint64_t)(fraction * (double)count);
+    uint64_t seen = 0;
+    for(uint32_t i = 0; i < LATENCY_BUCKETS; i++) {
+        seen += histogram[i];
+        if(seen > target) {
+            return i;
+        }
+    }
+    return LATENCY_BUCKETS - 1;
+}
+
+static void Report(const MdbSimConfig_t* config, double wall) {
+    static const char* const errorName[] = {
+        "none", "nak", "timeout", "checksum", "state", "parameter",
+        "communication", "sequence", "funds", "hardware"
+    };
+    MachineStats_t total = {0};
+    MdbSimStats_t bus = {0};
+    uint32_t latency[LATENCY_BUCKETS] = {0};
+    uint64_t latencyCount = 0;
+    uint32_t latencyMax = 0;
+    uint32_t pending = 0;
+    uint32_t offline = 0;
+    uint64_t errors[MDB_ERR_HARDWARE + 1] = {0};
+
+    for(uint32_t i = 0; i < machineCount; i++) {
+        const Machine_t* machine = &machines[i];
+        total.arrivals += machine->stats.arrivals;
+        total.balked += machine->stats.balked;
+        total.walkAways += machine->stats.walkAways;
+        total.attempted += machine->stats.attempted;
+        total.completed += machine->stats.completed;
+        total.abandoned += machine->stats.abandoned;
+        total.refused += machine->stats.refused;
+        total.initFailures += machine->stats.initFailures;
+        total.revenue += machine->stats.revenue;
+        bus.commands += machine->sim.stats.commands;
+        bus.polls += machine->sim.stats.polls;
+        bus.denials += machine->sim.stats.denials;
+        bus.resetInjected += machine->sim.stats.resetInjected;
+        bus.recoveries += machine->sim.stats.recoveries;
+        bus.recoveryTotal += machine->sim.stats.recoveryTotal;
+        if(machine->sim.stats.recoveryMax > bus.recoveryMax) {
+            bus.recoveryMax = machine->sim.stats.recoveryMax;
+        }
+        pending += machine->sim.faultTime != 0;
+        offline += !machine->online;
+
+        MDB_SelectInstance(&machines[i].driver);
+        for(int e = MDB_ERR_NAK; e <= MDB_ERR_HARDWARE; e++) {
+            errors[e] += MDB_GetErrorCount((MDB_Error_t)e);
+        }
+    }
+    MDB_SelectInstance(NULL);
+
+    for(uint32_t w = 0; w < workerCount; w++) {
+        for(uint32_t i = 0; i < LATENCY_BUCKETS; i++) {
+            latency[i] += workers[w].latency[i];
+            latencyCount += workers[w].latency[i];
+            if(workers[w].latency[i] != 0 && i > latencyMax) {
+                latencyMax = i;
+            }
+        }
+    }
+
+    double simulated = (double)duration / 1000.0;
+    printf("\n=== Fleet: %lu machines, %lu s, %lu threads, seed %lu ===\n",
+           (unsigned long)machineCount, (unsigned long)(duration / 1000),
+           (unsigned long)workerCount, (unsigned long)config->seed);
+    printf("customers arrived=%lu balked=%lu walked away=%lu\n",
+           (unsigned long)total.arrivals, (unsigned long)total.balked, (unsigned long)total.walkAways);
+    printf("vends     attempted=%lu completed=%lu abandoned=%lu refused=%lu denied=%lu revenue=%llu\n",
+           (unsigned long)total.attempted, (unsigned long)total.completed, (unsigned long)total.abandoned,
+           (unsigned long)total.refused, (unsigned long)bus.denials, (unsigned long long)total.revenue);
+    printf("rate      %.3f vends/s simulated, %.0f vends/s wall, %.0fx real time\n",
+           total.completed / simulated, total.completed / wall, simulated * machineCount / wall);
+    printf("latency   request to approval p50=%lu p90=%lu p99=%lu max=%lu%s ms\n",
+           (unsigned long)Percentile(latency, latencyCount, 0.50),
+           (unsigned long)Percentile(latency, latencyCount, 0.90),
+           (unsigned long)Percentile(latency, latencyCount, 0.99),
+           (unsigned long)latencyMax, latencyMax == LATENCY_BUCKETS - 1 ? "+" : "");
+    printf("recovery  restarts=%lu recovered=%lu mean=%lu ms max=%lu ms pending=%lu offline=%lu init failures=%lu\n",
+           (unsigned long)bus.resetInjected, (unsigned long)bus.recoveries,
+           (unsigned long)(bus.recoveries ? bus.recoveryTotal / bus.recoveries : 0),
+           (unsigned long)bus.recoveryMax, (unsigned long)pending, (unsigned long)offline,
+           (unsigned long)total.initFailures);
+    printf("bus       commands=%lu polls=%lu\n", (unsigned long)bus.commands, (unsigned long)bus.polls);
+    printf("errors   ");
+    for(int e = MDB_ERR_NAK; e <= MDB_ERR_HARDWARE; e++) {
+        printf(" %s=%llu", errorName[e], (unsigned long long)errors[e]);
+    }
+    printf("\npool     ");
+    for(uint32_t w = 0; w < workerCount; w++) {
+        printf(" %lu/%lu", (unsigned long)workers[w].slices, (unsigned long)workers[w].steals);
+    }
+    printf("  (slices/steals per worker)\nwall      %.3f s\n", wall);
+}
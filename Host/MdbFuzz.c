@@ -0,0 +1,582 @@
+// mdbfuzz.c
+// Coverage-guided fuzzing of framing, checksum and dispatch. Every input
+// is a bus conversation as the reader would send it: the driver is put in
+// the state named by the first byte, then polled until the input runs
+// out, with every word it reads coming from the input. Commands the
+// driver issues on its own (recovery, SETUP, VEND REQUEST) read their
+// answers from the same stream. After every poll the driver state is
+// checked; a violated invariant aborts so the fuzzer keeps the input.
+//
+// Input: byte 0 selects the start state
+//   bits 0-2  MDB_State_t
+//   bit 3     always-idle session
+//   bit 4     multivend session
+//   bit 5     JUST RESET expected
+//   bit 6     issue a VEND REQUEST whenever the session is idle
+//   bit 7     complete approved vends with VEND SUCCESS, queueing the
+//             next same-price request first in a multivend session
+// then two bytes per bus word: flags, data
+//   flags bit 0  mode bit (last word of a frame, or a lone ACK/NAK)
+//   flags bit 1  no answer: this read times out
+//
+// With -DMDB_COIN_ENABLE=1 the changer starts set up and accepting coins,
+// and the poll slots alternate, changer first, so the words of a slot
+// answer the changer and the reader in turn. An escrow request is
+// answered by paying the credit back. The coin_ seeds are written for
+// this build; without the changer they are just more reader input.
+//
+// The driver is compiled into this file so the harness can set up and
+// check its private state.
+//
+// libFuzzer: clang -g -O1 -fsanitize=fuzzer,address,undefined -DMDB_HOST_BUILD
+//            -DMDB_LOG_LEVEL_MIN=0 -IMDB -IHost MDB/MdbLogSink.c MDB/MdbPack.c
+//            MDB/MdbSettle.c Host/MdbHostHal.c Host/MdbFuzz.c -o mdbfuzz
+//            ./mdbfuzz Host/FuzzCorpus
+// Without libFuzzer add -DMDB_FUZZ_STANDALONE (any compiler, sanitizers
+// recommended): mdbfuzz [-w dir] [-r iterations] [file|dir ...]
+//   -w  write the seed corpus to dir
+//   -r  random mutations of the given inputs, for compilers without libFuzzer
+
+#include "Mdb.c"
+#include <stdlib.h>
+
+#define FUZZ_WORD_SIZE    2
+#define FUZZ_FLAG_MODE    0x01
+#define FUZZ_FLAG_SILENT  0x02
+#define FUZZ_MAX_POLLS    256
+
+typedef struct {
+    const uint8_t* data;
+    size_t size;
+    size_t offset;
+} FuzzInput_t;
+
+static FuzzInput_t input;
+
+// Frame being read, to spot a valid VEND APPROVED the driver must apply
+static uint8_t frame[MDB_MAX_MESSAGE_LENGTH];
+static uint8_t frameLength;
+static uint32_t approvalDue;
+
+// Private function declarations
+static bool FuzzSend(void* context, const uint16_t* words, uint8_t count);
+static bool FuzzReceive(void* context, uint16_t* word, uint32_t timeout);
+static void ResetDriver(uint8_t selector);
+static void CheckInvariants(void);
+
+int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size);
+
+int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size) {
+    static bool ready = false;
+    if(!ready) {
+        static const MDB_Transport_t transport = { FuzzSend, FuzzReceive, &input };
+        MdbHostClockSetVirtual(true, 0);
+        MDB_SetTransport(&transport);
+        MDB_SettleInit();
+        currentLogLevel = LOG_NONE;
+        ready = true;
+    }
+    if(size < 1) {
+        return 0;
+    }
+
+    input = (FuzzInput_t){ data, size, 1 };
+    frameLength = 0;
+    approvalDue = 0;
+    ResetDriver(data[0]);
+    bool vendWhenIdle = (data[0] & 0x40) != 0;
+    bool completeVends = (data[0] & 0x80) != 0;
+
+    for(int poll = 0; poll < FUZZ_MAX_POLLS && input.offset < input.size; poll++) {
+        MdbHostClockAdvanceTo(MDB_NextPollTime());
+        MDB_Poll();
+        CheckInvariants();
+
+        if(vendWhenIdle && mdb->session.state == MDB_STATE_SESSION_IDLE) {
+            MDB_VendRequest((uint16_t)(1 + poll % 24), 150);
+            CheckInvariants();
+        }
+        if(completeVends && mdb->session.state == MDB_STATE_VEND &&
+           mdb->session.outcomeId == mdb->session.transactionId) {
+            if(mdb->session.multivend) {
+                MDB_VendRequest((uint16_t)(1 + poll % 24), 150);
+            }
+            MDB_VendSuccess(mdb->session.itemNumber);
+            CheckInvariants();
+        }
+#if MDB_COIN_ENABLE
+        if(mdb->coin.escrowRequest && mdb->coin.credit > 0) {
+            uint32_t credit = mdb->coin.credit;
+            MDB_CoinTakeCredit(credit);
+            MDB_CoinPayout(credit);
+            CheckInvariants();
+        }
+#endif
+    }
+
+    // Keep the sink from filling across inputs
+    MDB_LogSinkService();
+    return 0;
+}
+
+static bool FuzzSend(void* context, const uint16_t* words, uint8_t count) {
+    (void)context;
+    (void)words;
+    (void)count;
+    return true;
+}
+
+static bool FuzzReceive(void* context, uint16_t* word, uint32_t timeout) {
+    FuzzInput_t* fuzz = (FuzzInput_t*)context;
+    if(fuzz->offset + FUZZ_WORD_SIZE > fuzz->size) {
+        fuzz->offset = fuzz->size;
+        HAL_Delay(timeout);
+        return false;
+    }
+
+    uint8_t flags = fuzz->data[fuzz->offset];
+    *word = fuzz->data[fuzz->offset + 1] | ((flags & FUZZ_FLAG_MODE) ? MDB_MODE_BIT : 0);
+    fuzz->offset += FUZZ_WORD_SIZE;
+    if(flags & FUZZ_FLAG_SILENT) {
+        frameLength = 0;
+        HAL_Delay(timeout);
+        return false;
+    }
+    
+    // A fresh approval for the open transaction must not be taken for a
+    // repeat. Only the reader's answers can carry one.
+    if(!ReaderAddressed()) {
+        frameLength = 0;
+        return true;
+    }
+    if(frameLength < MDB_MAX_MESSAGE_LENGTH) {
+        frame[frameLength] = (uint8_t)*word;
+    }
+    frameLength++;
+    if(*word & MDB_MODE_BIT) {
+        if(frameLength >= 4 && frameLength <= MDB_MAX_MESSAGE_LENGTH && frame[0] == MDBRxCashlessVendApproved &&
+           CalculateChecksum(frame, frameLength - 1) == frame[frameLength - 1] &&
+           mdb->session.state == MDB_STATE_VEND && mdb->session.outcomeId != mdb->session.transactionId) {
+            approvalDue = mdb->session.transactionId;
+        }
+        frameLength = 0;
+    }
+    return true;
+}
+
+// Every input starts from the same driver, whatever the last one left
+static void ResetDriver(uint8_t selector) {
+    memset(&mdb->config, 0, sizeof(mdb->config));
+    memset(&mdb->peripheral, 0, sizeof(mdb->peripheral));
+    memset(&mdb->session, 0, sizeof(mdb->session));
+    memset(&mdb->messageQueue, 0, sizeof(mdb->messageQueue));
+    memset(&mdb->responseCache, 0, sizeof(mdb->responseCache));
+    memset(&mdb->breaker, 0, sizeof(mdb->breaker));
+    MdbHostClockSetVirtual(true, 0);
+    mdb->lastPollTime = 0;
+    mdb->lastResponseTime = 0;
+    mdb->lastCommandLength = 0;
+    mdb->retryCount = 0;
+    mdb->rxError = MDB_ERR_NONE;
+    mdb->dumpActive = false;
+
+    mdb->config.featureLevel = 3;
+    mdb->config.scaleFactor = 1;
+    mdb->session.state = (MDB_State_t)((selector & 0x07) % (MDB_STATE_NEGATIVE_VEND + 1));
+    mdb->session.alwaysIdle = (selector & 0x08) != 0;
+    mdb->session.multivend = (selector & 0x10) != 0;
+    mdb->justResetExpected = (selector & 0x20) != 0;
+    if(mdb->session.state >= MDB_STATE_SESSION_IDLE) {
+        mdb->session.availableFunds = 500;
+    }
+    if(mdb->session.state >= MDB_STATE_VEND) {
+        mdb->session.transactionId = mdb->nextTransactionId++;
+        mdb->session.itemNumber = 7;
+        mdb->session.vendAmount = 150;
+    }
+
+#if MDB_COIN_ENABLE
+    static const uint8_t coinValue[] = {1, 2, 5, 20};
+    memset(&mdb->coin, 0, sizeof(mdb->coin));
+    memset(&mdb->coinIdentity, 0, sizeof(mdb->coinIdentity));
+    mdb->coin.state = MDB_COIN_ENABLED;
+    mdb->coin.featureLevel = 2;
+    mdb->coin.scaleFactor = 5;
+    mdb->coin.tubeRouting = 0x000F;
+    memcpy(mdb->coin.coinValue, coinValue, sizeof(coinValue));
+    memset(mdb->coin.tubeCount, 20, sizeof(coinValue));
+    mdb->coin.acceptedCoins = 0x000F;
+    mdb->coinTurn = false;
+#endif
+}
+
+#define FUZZ_CHECK(condition) \
+    do { if(!(condition)) { fprintf(stderr, "invariant failed: %s\n", #condition); abort(); } } while(0)
+
+static void CheckInvariants(void) {
+    FUZZ_CHECK(mdb->session.state <= MDB_STATE_NEGATIVE_VEND);
+    FUZZ_CHECK(mdb->session.pendingCount <= MDB_MULTIVEND_QUEUE);
+    FUZZ_CHECK(mdb->session.pendingHead < MDB_MULTIVEND_QUEUE);
+    FUZZ_CHECK(mdb->session.state == MDB_STATE_VEND || mdb->session.pendingCount == 0);
+    FUZZ_CHECK((int32_t)(mdb->session.transactionId - mdb->session.outcomeId) >= 0);
+    FUZZ_CHECK(mdb->messageQueue.count <= MDB_QUEUE_SIZE);
+    FUZZ_CHECK(mdb->messageQueue.head < MDB_QUEUE_SIZE && mdb->messageQueue.tail < MDB_QUEUE_SIZE);
+    FUZZ_CHECK(!mdb->responseCache.valid || mdb->responseCache.length <= MDB_MAX_MESSAGE_LENGTH);
+    FUZZ_CHECK(mdb->lastCommandLength < MDB_MAX_MESSAGE_LENGTH);
+    FUZZ_CHECK(mdb->transactionLogIndex < MDB_TRANSACTION_LOG_SIZE);
+    FUZZ_CHECK(mdb->errorLogIndex < MDB_ERROR_LOG_SIZE);
+    FUZZ_CHECK(mdb->breaker.state <= MDB_BREAKER_HALF_OPEN);
+    FUZZ_CHECK(mdb->retryCount <= 3);
+    FUZZ_CHECK(approvalDue == 0 || (int32_t)(mdb->session.outcomeId - approvalDue) >= 0);
+    approvalDue = 0;
+#if MDB_COIN_ENABLE
+    FUZZ_CHECK(mdb->coin.state <= MDB_COIN_PAYOUT);
+    FUZZ_CHECK(mdb->coin.state == MDB_COIN_PAYOUT ||
+               (mdb->coin.payoutPending == 0 && mdb->coin.payoutRequested == 0));
+#endif
+}
+
+#ifdef MDB_FUZZ_STANDALONE
+#include <dirent.h>
+#include <unistd.h>
+
+#define FUZZ_MAX_INPUT    4096
+#define FUZZ_MAX_SEEDS    256
+
+typedef struct {
+    uint8_t data[FUZZ_MAX_INPUT];
+    size_t size;
+} FuzzSeed_t;
+
+static FuzzSeed_t seeds[FUZZ_MAX_SEEDS];
+static int seedCount = 0;
+
+// Private function declarations
+static void AddFrame(FuzzSeed_t* seed, const uint8_t* data, uint8_t length);
+static void AddControl(FuzzSeed_t* seed, uint8_t control, bool silent);
+static void AddPeripheralId(FuzzSeed_t* seed);
+static bool WriteCorpus(const char* dir);
+static void LoadPath(const char* path);
+static void Mutate(FuzzSeed_t* out, uint32_t* rng);
+
+int main(int argc, char** argv) {
+    unsigned long iterations = 0;
+    int option;
+
+    while((option = getopt(argc, argv, "w:r:")) != -1) {
+        switch(option) {
+            case 'w':
+                if(!WriteCorpus(optarg)) {
+                    fprintf(stderr, "cannot write corpus to %s\n", optarg);
+                    return 2;
+                }
+                return 0;
+            case 'r': iterations = strtoul(optarg, NULL, 0); break;
+            default:
+                fprintf(stderr, "usage: %s [-w dir] [-r iterations] [file|dir ...]\n", argv[0]);
+                return 2;
+        }
+    }
+
+    for(int i = optind; i < argc; i++) {
+        LoadPath(argv[i]);
+    }
+    for(int i = 0; i < seedCount; i++) {
+        LLVMFuzzerTestOneInput(seeds[i].data, seeds[i].size);
+    }
+    printf("%d inputs replayed\n", seedCount);
+
+    if(iterations > 0 && seedCount > 0) {
+        static FuzzSeed_t mutant;
+        uint32_t rng = 1;
+        for(unsigned long n = 0; n < iterations; n++) {
+            mutant = seeds[n % seedCount];
+            Mutate(&mutant, &rng);
+            LLVMFuzzerTestOneInput(mutant.data, mutant.size);
+        }
+        printf("%lu mutations run\n", iterations);
+    }
+    return 0;
+}
+
+// Data words, then the checksum with the mode bit
+static void AddFrame(FuzzSeed_t* seed, const uint8_t* data, uint8_t length) {
+    uint8_t sum = 0;
+    for(uint8_t i = 0; i < length && seed->size + 2 * FUZZ_WORD_SIZE <= FUZZ_MAX_INPUT; i++) {
+        seed->data[seed->size++] = 0;
+        seed->data[seed->size++] = data[i];
+        sum += data[i];
+    }
+    seed->data[seed->size++] = FUZZ_FLAG_MODE;
+    seed->data[seed->size++] = sum;
+}
+
+static void AddControl(FuzzSeed_t* seed, uint8_t control, bool silent) {
+    seed->data[seed->size++] = silent ? FUZZ_FLAG_SILENT : FUZZ_FLAG_MODE;
+    seed->data[seed->size++] = control;
+}
+
+static void AddPeripheralId(FuzzSeed_t* seed) {
+    uint8_t id[34] = {MDBRxCashlessPeripheralId};
+    memcpy(&id[1], "ABC", 3);
+    memcpy(&id[4], "000000000042", 12);
+    memcpy(&id[16], "CASHLESS-SIM", 12);
+    id[28] = 0x01;
+    id[33] = MDB_FEATURE_ALWAYS_IDLE;
+    AddFrame(seed, id, sizeof(id));
+}
+
+// Well-formed cashless conversations, one per file
+static bool WriteCorpus(const char* dir) {
+    static const uint8_t justReset[] = {MDBRxCashlessJustReset};
+    static const uint8_t config[] = {MDBRxCashlessReaderConfig, 3, 0x18, 0x40, 1, 2, 5, 0x03};
+    static const uint8_t begin[] = {MDBRxCashlessBeginSession, 0x01, 0xF4, 0};
+    static const uint8_t approved[] = {MDBRxCashlessVendApproved, 0x00, 0x96};
+    static const uint8_t denied[] = {MDBRxCashlessVendDenied};
+    static const uint8_t endSession[] = {MDBRxCashlessEndSession};
+    static const uint8_t coinDeposit[] = {0x51, 21, 0x42, 20, 0x22};
+    static const uint8_t coinReject[] = {0x73, 20};
+    static const uint8_t coinEscrow[] = {0x52, 21, MDBRxCoinEscrowRequest};
+    static const uint8_t coinEscrowLarge[] = {0x53, 21, MDBRxCoinEscrowRequest};
+    static const uint8_t coinBusy[] = {MDBRxCoinPayoutBusy};
+    static const uint8_t coinJustReset[] = {MDBRxCoinJustReset};
+    static const uint8_t coinSetup2[] = {2, 0x18, 0x40, 5, 2, 0x00, 0x0F, 1, 2, 5, 20};
+    static const uint8_t coinSetup3[] = {3, 0x18, 0x40, 5, 2, 0x00, 0x0F, 1, 2, 5, 20};
+    static const uint8_t coinTubes[] = {0x00, 0x00, 20, 20, 19, 20};
+    static const uint8_t coinPaid[] = {0, 0, 0, 1};
+    static const struct {
+        const char* name;
+        uint8_t selector;
+    } names[] = {
+        {"ack", MDB_STATE_ENABLED},
+        {"just_reset_expected", MDB_STATE_ENABLED | 0x20},
+        {"recovery", MDB_STATE_ENABLED},
+        {"begin_session", MDB_STATE_ENABLED},
+        {"vend_approved", MDB_STATE_VEND},
+        {"vend_denied", MDB_STATE_VEND},
+        {"end_session", MDB_STATE_SESSION_IDLE},
+        {"peripheral_id", MDB_STATE_ENABLED},
+        {"purchase", MDB_STATE_ENABLED | 0x40},
+        {"multivend", MDB_STATE_SESSION_IDLE | 0x10 | 0x40},
+        {"always_idle", MDB_STATE_SESSION_IDLE | 0x08 | 0x40},
+        {"checksum_ret", MDB_STATE_VEND},
+        {"nak_retry", MDB_STATE_SESSION_IDLE | 0x40},
+        {"silence", MDB_STATE_ENABLED},
+        {"multivend_same_price", MDB_STATE_SESSION_IDLE | 0x10 | 0x40 | 0x80},
+        {"coin_deposit", MDB_STATE_ENABLED},
+        {"coin_escrow", MDB_STATE_ENABLED},
+        {"coin_payout_busy", MDB_STATE_ENABLED},
+        {"coin_just_reset", MDB_STATE_ENABLED},
+        {"coin_setup", MDB_STATE_ENABLED}
+    };
+
+    for(unsigned i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+        FuzzSeed_t* seed = &seeds[0];
+        seed->size = 0;
+        seed->data[seed->size++] = names[i].selector;
+
+        switch(i) {
+            case 0: AddControl(seed, MDB_ACK, false); AddControl(seed, MDB_ACK, false); break;
+            case 1: AddFrame(seed, justReset, sizeof(justReset)); break;
+            case 2:
+                // Unexpected JUST RESET, then RESET, SETUP, ID, features,
+                // enable and the JUST RESET owed for our own RESET
+                AddFrame(seed, justReset, sizeof(justReset));
+                AddControl(seed, MDB_ACK, false);
+                AddFrame(seed, config, sizeof(config));
+                AddPeripheralId(seed);
+                AddControl(seed, MDB_ACK, false);
+                AddControl(seed, MDB_ACK, false);
+                AddFrame(seed, justReset, sizeof(justReset));
+                AddControl(seed, MDB_ACK, false);
+                break;
+            case 3: AddFrame(seed, begin, sizeof(begin)); break;
+            case 4: AddFrame(seed, approved, sizeof(approved)); break;
+            case 5: AddFrame(seed, denied, sizeof(denied)); break;
+            case 6: AddFrame(seed, endSession, sizeof(endSession)); break;
+            case 7: AddPeripheralId(seed); break;
+            case 8:
+            case 9:
+            case 10:
+                // Session, VEND REQUEST ACKed, approval on a later POLL
+                if(i == 8) {
+                    AddFrame(seed, begin, sizeof(begin));
+                }
+                AddControl(seed, MDB_ACK, false);
+                AddControl(seed, MDB_ACK, false);
+                AddFrame(seed, approved, sizeof(approved));
+                AddControl(seed, MDB_ACK, false);
+                AddFrame(seed, endSession, sizeof(endSession));
+                break;
+            case 11: {
+                // Corrupt answer, then the repeat after RET
+                uint8_t bad[] = {MDBRxCashlessVendApproved, 0x00, 0x96};
+                AddFrame(seed, bad, sizeof(bad));
+                seed->data[seed->size - 1] ^= 0x5A;
+                AddFrame(seed, approved, sizeof(approved));
+                break;
+            }
+            case 12:
+                AddControl(seed, MDB_ACK, false);
+                AddControl(seed, MDB_NAK, false);
+                AddControl(seed, MDB_ACK, false);
+                break;
+            case 13:
+                AddControl(seed, 0, true);
+                AddControl(seed, 0, true);
+                AddControl(seed, MDB_ACK, false);
+                break;
+            case 14:
+                // Two 150 vends: the second approval is byte for byte the
+                // first, after VEND SUCCESS and the queued VEND REQUEST
+                AddControl(seed, MDB_ACK, false);
+                AddControl(seed, MDB_ACK, false);
+                AddFrame(seed, approved, sizeof(approved));
+                AddControl(seed, MDB_ACK, false);
+                AddControl(seed, MDB_ACK, false);
+                AddFrame(seed, approved, sizeof(approved));
+                AddControl(seed, MDB_ACK, false);
+                AddControl(seed, MDB_ACK, false);
+                AddFrame(seed, endSession, sizeof(endSession));
+                break;
+            // Changer seeds, each pair of lines is a changer slot then a
+            // reader slot
+            case 15:
+                AddFrame(seed, coinDeposit, sizeof(coinDeposit));
+                AddControl(seed, MDB_ACK, false);
+                AddFrame(seed, coinReject, sizeof(coinReject));
+                AddControl(seed, MDB_ACK, false);
+                break;
+            case 16:
+            case 17:
+                // Escrow pays the 25 back with one DISPENSE, TUBE STATUS
+                // once the payout is done
+                AddFrame(seed, coinEscrow, sizeof(coinEscrow));
+                AddControl(seed, MDB_ACK, false);
+                AddControl(seed, MDB_ACK, false);
+                AddControl(seed, MDB_ACK, false);
+                AddControl(seed, MDB_ACK, false);
+                if(i == 17) {
+                    AddFrame(seed, coinBusy, sizeof(coinBusy));
+                    AddControl(seed, MDB_ACK, false);
+                }
+                AddControl(seed, MDB_ACK, false);
+                AddFrame(seed, coinTubes, sizeof(coinTubes));
+                AddControl(seed, MDB_ACK, false);
+                break;
+            case 18:
+                // Level 2 setup: SETUP, TUBE STATUS, COIN TYPE
+                AddFrame(seed, coinJustReset, sizeof(coinJustReset));
+                AddFrame(seed, coinSetup2, sizeof(coinSetup2));
+                AddFrame(seed, coinTubes, sizeof(coinTubes));
+                AddControl(seed, MDB_ACK, false);
+                AddControl(seed, MDB_ACK, false);
+                AddControl(seed, MDB_ACK, false);
+                AddControl(seed, MDB_ACK, false);
+                break;
+            case 19: {
+                // Level 3 setup with alternative payout, then an escrow of
+                // 100 paid by value: PAYOUT, busy, VALUE POLL, STATUS
+                uint8_t id[33] = {0};
+                memcpy(&id[0], "ABC", 3);
+                memcpy(&id[3], "000000000007", 12);
+                memcpy(&id[15], "CHANGER-SIM ", 12);
+                id[28] = 0x01;
+                id[32] = MDB_COIN_FEATURE_ALT_PAYOUT;
+                AddFrame(seed, coinJustReset, sizeof(coinJustReset));
+                AddFrame(seed, coinSetup3, sizeof(coinSetup3));
+                AddFrame(seed, coinTubes, sizeof(coinTubes));
+                AddFrame(seed, id, sizeof(id));
+                AddControl(seed, MDB_ACK, false);
+                AddControl(seed, MDB_ACK, false);
+                AddControl(seed, MDB_ACK, false);
+                AddFrame(seed, coinEscrowLarge, sizeof(coinEscrowLarge));
+                AddControl(seed, MDB_ACK, false);
+                AddControl(seed, MDB_ACK, false);
+                AddControl(seed, MDB_ACK, false);
+                AddControl(seed, MDB_ACK, false);
+                AddFrame(seed, coinBusy, sizeof(coinBusy));
+                AddControl(seed, MDB_ACK, false);
+                AddControl(seed, MDB_ACK, false);
+                AddControl(seed, MDB_ACK, false);
+                AddFrame(seed, coinPaid, sizeof(coinPaid));
+                AddControl(seed, MDB_ACK, false);
+                AddControl(seed, MDB_ACK, false);
+                AddFrame(seed, coinTubes, sizeof(coinTubes));
+                AddControl(seed, MDB_ACK, false);
+                break;
+            }
+        }
+
+        char path[512];
+        snprintf(path, sizeof(path), "%s/%s.bin", dir, names[i].name);
+        FILE* out = fopen(path, "wb");
+        if(out == NULL || fwrite(seed->data, 1, seed->size, out) != seed->size) {
+            return false;
+        }
+        fclose(out);
+    }
+    return true;
+}
+
+static void LoadPath(const char* path) {
+    DIR* dir = opendir(path);
+    if(dir != NULL) {
+        struct dirent* entry;
+        while((entry = readdir(dir)) != NULL) {
+            if(entry->d_name[0] != '.') {
+                char child[512];
+                snprintf(child, sizeof(child), "%s/%s", path, entry->d_name);
+                LoadPath(child);
+            }
+        }
+        closedir(dir);
+        return;
+    }
+
+    FILE* in = fopen(path, "rb");
+    if(in == NULL || seedCount >= FUZZ_MAX_SEEDS) {
+        if(in != NULL) {
+            fclose(in);
+        }
+        return;
+    }
+    seeds[seedCount].size = fread(seeds[seedCount].data, 1, FUZZ_MAX_INPUT, in);
+    seedCount++;
+    fclose(in);
+}
+
+// Byte flips, truncation and spliced-in words, a crude stand-in for libFuzzer
+static void Mutate(FuzzSeed_t* out, uint32_t* rng) {
+    int edits = 1 + (int)(*rng % 4);
+    for(int i = 0; i < edits; i++) {
+        *rng ^= *rng << 13;
+        *rng ^= *rng >> 17;
+        *rng ^= *rng << 5;
+        size_t at = out->size > 0 ? *rng % out->size : 0;
+        switch((*rng >> 24) % 4) {
+            case 0:
+                if(out->size > 0) {
+                    out->data[at] ^= (uint8_t)(1u << ((*rng >> 8) & 7));
+                }
+                break;
+            case 1:
+                if(out->size > 0) {
+                    out->data[at] = (uint8_t)(*rng >> 16);
+                }
+                break;
+            case 2:
+                out->size = at + 1 < out->size ? at + 1 : out->size;
+                break;
+            case 3:
+                if(out->size + FUZZ_WORD_SIZE <= FUZZ_MAX_INPUT) {
+                    memmove(&out->data[at + FUZZ_WORD_SIZE], &out->data[at], out->size - at);
+                    out->data[at] = (uint8_t)(*rng >> 8) & (FUZZ_FLAG_MODE | FUZZ_FLAG_SILENT);
+                    out->data[at + 1] = (uint8_t)(*rng >> 16);
+                    out->size += FUZZ_WORD_SIZE;
+                }
+                break;
+        }
+    }
+}
+#endif
@@ -0,0 +1,85 @@
+// mdbhosthal.c
+// Host implementation of the HAL services the driver uses outside the bus
+// transport: a millisecond tick, a delay and a fixed device UID, plus a
+// microsecond clock for host tools that time individual frames.
+//
+// The tick comes from the monotonic clock, or from a virtual counter. In
+// virtual mode HAL_Delay jumps the counter forward instead of sleeping and
+// a harness with nothing to do jumps straight to its next deadline, so a
+// simulated day passes in seconds and every run with the same inputs sees
+// the same timestamps. Simulations running several machines on worker
+// threads give each machine its own clock and select it per thread.
+
+#include "MdbHostHal.h"
+#include <stdlib.h>
+#include <time.h>
+
+// Private variables
+static uint64_t startUs = 0;
+static MdbHostClock_t defaultClock = { 0 };
+static _Thread_local MdbHostClock_t* currentClock = &defaultClock;
+
+static uint64_t MonotonicUs(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000u + (uint64_t)now.tv_nsec / 1000u;
+}
+
+uint32_t HAL_GetTick(void) {
+    return (uint32_t)(MdbHostMicros() / 1000u);
+}
+
+void HAL_Delay(uint32_t delay) {
+    if(currentClock->virtualClock) {
+        currentClock->virtualUs += (uint64_t)delay * 1000u;
+        return;
+    }
+    struct timespec interval = { .tv_sec = delay / 1000, .tv_nsec = (long)(delay % 1000) * 1000000L };
+    nanosleep(&interval, NULL);
+}
+
+// MDB_HOST_UID in the environment gives each simulated unit its own jitter
+uint32_t HAL_GetUIDw0(void) {
+    const char* uid = getenv("MDB_HOST_UID");
+    return uid != NULL ? (uint32_t)strtoul(uid, NULL, 0) : 0x20240001u;
+}
+
+// Microseconds since the first call, or virtual time
+uint64_t MdbHostMicros(void) {
+    if(currentClock->virtualClock) {
+        return currentClock->virtualUs;
+    }
+    if(startUs == 0) {
+        startUs = MonotonicUs();
+    }
+    return MonotonicUs() - startUs;
+}
+
+void MdbHostClockSetVirtual(bool enable, uint32_t start) {
+    currentClock->virtualClock = enable;
+    currentClock->virtualUs = (uint64_t)start * 1000u;
+}
+
+bool MdbHostClockIsVirtual(void) {
+    return currentClock->virtualClock;
+}
+
+// Moves virtual time forward to tick, never backwards
+void MdbHostClockAdvanceTo(uint32_t tick) {
+    int32_t ahead = (int32_t)(tick - HAL_GetTick());
+    if(currentClock->virtualClock && ahead > 0) {
+        currentClock->virtualUs += (uint64_t)ahead * 1000u - currentClock->virtualUs % 1000u;
+    }
+}
+
+// Time spent on the wire, which only the simulated bus accounts for
+void MdbHostClockAdvanceMicros(uint32_t micros) {
+    if(currentClock->virtualClock) {
+        currentClock->virtualUs += micros;
+    }
+}
+
+// Later clock calls from this thread use selected, NULL is the default
+void MdbHostClockSelect(MdbHostClock_t* selected) {
+    currentClock = selected != NULL ? selected : &defaultClock;
+}
@@ -0,0 +1,60 @@
+// mdbhosthal.h
+// Minimal stand-in for stm32f7xx_hal.h so MDB.h can be shared with host
+// tools. Selected by compiling with -DMDB_HOST_BUILD.
+#ifndef __MdbHostHal_h
+#define __MdbHostHal_h
+
+#include <stdint.h>
+#include <stdbool.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#else
+#include <time.h>
+#endif
+
+typedef enum {
+    HAL_OK      = 0x00,
+    HAL_ERROR   = 0x01,
+    HAL_BUSY    = 0x02,
+    HAL_TIMEOUT = 0x03
+} HAL_StatusTypeDef;
+
+typedef struct {
+    void* instance;
+} UART_HandleTypeDef;
+
+uint32_t HAL_GetTick(void);
+void HAL_Delay(uint32_t delay);
+uint32_t HAL_GetUIDw0(void);
+HAL_StatusTypeDef HAL_UART_Transmit(UART_HandleTypeDef* huart, uint8_t* data, uint16_t size, uint32_t timeout);
+HAL_StatusTypeDef HAL_UART_Receive(UART_HandleTypeDef* huart, uint8_t* data, uint16_t size, uint32_t timeout);
+
+#define __DSB()                  __sync_synchronize()
+
+// Virtual time: HAL_GetTick reads a counter that only HAL_Delay and the
+// advance calls move, so waits cost nothing and runs are reproducible
+typedef struct {
+    bool virtualClock;
+    uint64_t virtualUs;
+} MdbHostClock_t;
+
+void MdbHostClockSelect(MdbHostClock_t* clock);
+void MdbHostClockSetVirtual(bool enable, uint32_t start);
+bool MdbHostClockIsVirtual(void);
+void MdbHostClockAdvanceTo(uint32_t tick);
+void MdbHostClockAdvanceMicros(uint32_t micros);
+uint64_t MdbHostMicros(void);
+
+// Stand-in for the DWT cycle counter: the TSC on x86, nanoseconds elsewhere.
+// Always real time, virtual time would make every profiled path free.
+static inline uint32_t MdbHostCycles(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    return (uint32_t)__rdtsc();
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint32_t)((uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec);
+#endif
+}
+
+#endif
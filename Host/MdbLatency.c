@@ -0,0 +1,370 @@
+// mdblatency.c
+// End-to-end vend latency against the simulated reader: from the
+// selection (MDB_VendRequest) to VEND APPROVED handled, when the motor may
+// run. The driver is built with MDB_STAGE_TRACE so every frame is
+// timestamped as it passes through, and each vend is split into stages:
+//
+//   request     MDB_VendRequest to VEND REQUEST handed to the transport
+//   request tx  VEND REQUEST on the wire
+//   reader      the reader's approval time, from the simulator setting
+//   poll wait   approval ready until the POLL that collects it goes out
+//   poll tx     that POLL on the wire
+//   response    POLL sent to first word of VEND APPROVED
+//   rx          rest of the VEND APPROVED frame
+//   dispatch    checksum, ACK and dispatch to the handler
+//   handler     VEND APPROVED handler
+//
+// The run is repeated for each scheduler mode: "deadline" sleeps until
+// the next poll slot or reader event, "tick N" runs the main loop on a
+// fixed N ms period the way a cooperative scheduler task would. Times
+// come from the virtual clock, with bus words taking their wire time.
+//
+// Build: cc -std=gnu11 -O2 -DMDB_HOST_BUILD -DMDB_LOG_LEVEL_MIN=2 -DMDB_STAGE_TRACE=1
+//        -IMDB -IHost MDB/Mdb.c MDB/MdbLogSink.c MDB/MdbPack.c MDB/MdbSettle.c
+//        Host/MdbHostHal.c Host/MdbSimReader.c Host/MdbLatency.c -o mdblatency
+//        (add -DMDB_POLL_INTERVAL=ms to measure another poll interval)
+// Usage: mdblatency [-s seed] [-n vends] [-d approve ms] [-p tick ms,...]
+
+#include "MdbSimReader.h"
+#include <stdlib.h>
+#include <unistd.h>
+
+#define MAX_VENDS         10000
+#define MAX_TICKS         8
+#define ITEM_PRICE        150
+#define THINK_TIME_MAX    1000   // ms from session start to the selection
+#define HISTOGRAM_BUCKET  10000  // us
+#define HISTOGRAM_BUCKETS 100    // The last one also counts everything beyond
+#define HISTOGRAM_WIDTH   50     // Characters for the fullest bucket
+
+#if !MDB_STAGE_TRACE
+#error "mdblatency needs the driver built with -DMDB_STAGE_TRACE=1"
+#endif
+
+typedef enum {
+    STAGE_REQUEST,
+    STAGE_REQUEST_TX,
+    STAGE_READER,
+    STAGE_POLL_WAIT,
+    STAGE_POLL_TX,
+    STAGE_RESPONSE,
+    STAGE_RX,
+    STAGE_DISPATCH,
+    STAGE_HANDLER,
+    STAGE_TOTAL,
+    STAGE_COUNT
+} LatencyStage_t;
+
+// Timestamps of the frame currently on its way through the driver
+typedef struct {
+    uint64_t txStart;
+    uint64_t txDone;
+    uint64_t rxFirst;
+    uint64_t rxComplete;
+    uint64_t dispatch;
+} FrameTimes_t;
+
+typedef struct {
+    bool active;
+    uint64_t selected;          // MDB_VendRequest called
+    uint64_t requestTxStart;
+    uint64_t requestTxDone;
+    FrameTimes_t approval;      // Frame that carried VEND APPROVED
+    uint64_t handled;
+} VendTrace_t;
+
+static const char* const stageName[STAGE_COUNT] = {
+    "request", "request tx", "reader", "poll wait", "poll tx",
+    "response", "rx", "dispatch", "handler", "total"
+};
+
+static FrameTimes_t frame;
+static VendTrace_t trace;
+static uint32_t samples[STAGE_COUNT][MAX_VENDS];
+static uint32_t sampleCount;
+static uint32_t approveDelay = 50;
+static uint32_t rng;
+
+// Private function declarations
+static void RunScenario(uint32_t seed, uint32_t vends, uint32_t tick);
+static void RunApp(const MdbSimReader_t* sim, uint32_t* selectAt);
+static void RecordVend(void);
+static uint32_t NextRandom(void);
+static int CompareSample(const void* a, const void* b);
+static void Report(const char* mode, uint32_t attempts);
+
+int main(int argc, char** argv) {
+    uint32_t seed = 1;
+    uint32_t vends = 1000;
+    uint32_t ticks[MAX_TICKS] = {1, 10, 50, 100};
+    uint8_t tickCount = 4;
+    int option;
+
+    while((option = getopt(argc, argv, "s:n:d:p:")) != -1) {
+        switch(option) {
+            case 's': seed = (uint32_t)strtoul(optarg, NULL, 0); break;
+            case 'n': vends = (uint32_t)strtoul(optarg, NULL, 0); break;
+            case 'd': approveDelay = (uint32_t)strtoul(optarg, NULL, 0); break;
+            case 'p': {
+                char* next = optarg;
+                tickCount = 0;
+                while(*next != '\0' && tickCount < MAX_TICKS) {
+                    uint32_t tick = (uint32_t)strtoul(next, &next, 0);
+                    if(tick > 0) {
+                        ticks[tickCount++] = tick;
+                    }
+                    next += (*next == ',');
+                }
+                break;
+            }
+            default:
+                fprintf(stderr, "usage: %s [-s seed] [-n vends] [-d approve ms] [-p tick ms,...]\n", argv[0]);
+                return 2;
+        }
+    }
+    if(vends == 0 || vends > MAX_VENDS) {
+        vends = MAX_VENDS;
+    }
+
+    printf("poll interval %u ms, reader approval %lu ms, word time %u us, %lu vends per mode\n",
+           MDB_POLL_INTERVAL, (unsigned long)approveDelay, MDB_WORD_TIME_US, (unsigned long)vends);
+
+    MdbHostClockSetVirtual(true, 0);
+    RunScenario(seed, vends, 0);
+    for(uint8_t i = 0; i < tickCount; i++) {
+        RunScenario(seed, vends, ticks[i]);
+    }
+    return 0;
+}
+
+void MDB_StageHook(MDB_Stage_t stage, uint8_t code) {
+    uint64_t now = MdbHostMicros();
+    if(!trace.active) {
+        return;
+    }
+
+    switch(stage) {
+        case MDB_STAGE_TX_START:
+            memset(&frame, 0, sizeof(frame));
+            frame.txStart = now;
+            if(code == MDB_CMD_VEND && trace.requestTxStart == 0) {
+                trace.requestTxStart = now;
+            }
+            break;
+        case MDB_STAGE_TX_DONE:
+            frame.txDone = now;
+            if(code == MDB_CMD_VEND && trace.requestTxDone == 0) {
+                trace.requestTxDone = now;
+            }
+            break;
+        case MDB_STAGE_RX_FIRST:
+            frame.rxFirst = now;
+            break;
+        case MDB_STAGE_RX_COMPLETE:
+            frame.rxComplete = now;
+            break;
+        case MDB_STAGE_DISPATCH:
+            frame.dispatch = now;
+            break;
+        case MDB_STAGE_HANDLED:
+            if(code == MDBRxCashlessVendApproved) {
+                trace.approval = frame;
+                trace.handled = now;
+                RecordVend();
+            }
+            break;
+    }
+}
+
+// tick 0 runs in deadline mode
+static void RunScenario(uint32_t seed, uint32_t vends, uint32_t tick) {
+    static MdbSimReader_t sim;
+    MdbSimConfig_t config = {
+        .featureLevel = 3,
+        .scaleFactor = 1,
+        .miscOptions = MDB_READER_OPT_REFUNDS,
+        .responseDelay = 1,
+        .wordTime = MDB_WORD_TIME_US,
+        .approveDelay = approveDelay,
+        .cardInterval = 2000,
+        .cardFunds = 500,
+        .seed = seed
+    };
+    uint32_t attempts = 0;
+    uint32_t selectAt = 0;
+    uint32_t start = HAL_GetTick();
+
+    rng = seed ? seed : 1;
+    sampleCount = 0;
+    memset(&trace, 0, sizeof(trace));
+    MdbSimInit(&sim, &config);
+    MDB_Transport_t transport = MdbSimTransport(&sim);
+    MDB_SetTransport(&transport);
+    while(!MDB_Initialize()) {
+        HAL_Delay(MDB_POLL_INTERVAL);
+    }
+
+    // Give up on a mode that cannot finish in a simulated day
+    while(sampleCount < vends && HAL_GetTick() - start < 86400000u) {
+        MDB_Poll();
+        bool wasActive = trace.active;
+        RunApp(&sim, &selectAt);
+        attempts += !wasActive && trace.active;
+
+        uint32_t now = HAL_GetTick();
+        uint32_t next;
+        if(tick == 0) {
+            next = MDB_NextPollTime();
+            uint32_t simNext = MdbSimNextEvent(&sim, now);
+            if((int32_t)(simNext - next) < 0) {
+                next = simNext;
+            }
+            if(selectAt != 0 && (int32_t)(selectAt - next) < 0) {
+                next = selectAt;
+            }
+        } else {
+            next = now - now % tick + tick;
+        }
+        MdbHostClockAdvanceTo((int32_t)(next - now) > 0 ? next : now + 1);
+    }
+
+    char mode[24];
+    if(tick == 0) {
+        snprintf(mode, sizeof(mode), "deadline");
+    } else {
+        snprintf(mode, sizeof(mode), "tick %lu ms", (unsigned long)tick);
+    }
+    Report(mode, attempts);
+}
+
+// A customer per session: a random think time, one selection, dispense
+static void RunApp(const MdbSimReader_t* sim, uint32_t* selectAt) {
+    static uint32_t served = 0;
+    const MDB_Session_t* session = MDB_GetSession();
+    uint32_t now = HAL_GetTick();
+
+    if(trace.active) {
+        if(session->state == MDB_STATE_VEND && session->outcomeId == session->transactionId) {
+            MDB_VendSuccess(session->itemNumber);
+            MDB_SessionComplete();
+            trace.active = false;
+        } else if(session->state != MDB_STATE_VEND) {
+            trace.active = false;
+            if(session->state == MDB_STATE_SESSION_IDLE) {
+                MDB_SessionComplete();
+            }
+        }
+        return;
+    }
+
+    // A completed session stays idle until the reader ends it
+    if(session->state != MDB_STATE_SESSION_IDLE || served == sim->stats.sessions) {
+        *selectAt = 0;
+        return;
+    }
+    if(*selectAt == 0) {
+        *selectAt = now + 1 + NextRandom() % THINK_TIME_MAX;
+        return;
+    }
+    if((int32_t)(now - *selectAt) < 0) {
+        return;
+    }
+
+    *selectAt = 0;
+    served = sim->stats.sessions;
+    memset(&trace, 0, sizeof(trace));
+    trace.active = true;
+    trace.selected = MdbHostMicros();
+    if(!MDB_VendRequest((uint16_t)(1 + NextRandom() % 24), ITEM_PRICE)) {
+        trace.active = false;
+    }
+}
+
+static void RecordVend(void) {
+    const FrameTimes_t* approval = &trace.approval;
+    if(sampleCount >= MAX_VENDS || trace.requestTxDone == 0 || approval->txDone == 0) {
+        return;
+    }
+
+    // The reader answers a POLL with an approval that is due, so anything
+    // beyond its own delay was spent waiting for the next poll slot
+    uint64_t waited = approval->txStart - trace.requestTxDone;
+    uint64_t reader = (uint64_t)approveDelay * 1000u;
+    if(reader > waited) {
+        reader = waited;
+    }
+
+    uint64_t stage[STAGE_COUNT] = {
+        [STAGE_REQUEST]    = trace.requestTxStart - trace.selected,
+        [STAGE_REQUEST_TX] = trace.requestTxDone - trace.requestTxStart,
+        [STAGE_READER]     = reader,
+        [STAGE_POLL_WAIT]  = waited - reader,
+        [STAGE_POLL_TX]    = approval->txDone - approval->txStart,
+        [STAGE_RESPONSE]   = approval->rxFirst - approval->txDone,
+        [STAGE_RX]         = approval->rxComplete - approval->rxFirst,
+        [STAGE_DISPATCH]   = approval->dispatch - approval->rxComplete,
+        [STAGE_HANDLER]    = trace.handled - approval->dispatch,
+        [STAGE_TOTAL]      = trace.handled - trace.selected
+    };
+    for(int i = 0; i < STAGE_COUNT; i++) {
+        samples[i][sampleCount] = (uint32_t)stage[i];
+    }
+    sampleCount++;
+}
+
+static uint32_t NextRandom(void) {
+    rng ^= rng << 13;
+    rng ^= rng >> 17;
+    rng ^= rng << 5;
+    return rng;
+}
+
+static int CompareSample(const void* a, const void* b) {
+    uint32_t x = *(const uint32_t*)a;
+    uint32_t y = *(const uint32_t*)b;
+    return (x > y) - (x < y);
+}
+
+static void Report(const char* mode, uint32_t attempts) {
+    printf("\n=== %s: %lu approved of %lu selections ===\n",
+           mode, (unsigned long)sampleCount, (unsigned long)attempts);
+    if(sampleCount == 0) {
+        return;
+    }
+
+    printf("%-12s %10s %10s %10s %10s\n", "stage", "mean us", "median us", "p99 us", "max us");
+    for(int i = 0; i < STAGE_COUNT; i++) {
+        uint64_t sum = 0;
+        for(uint32_t n = 0; n < sampleCount; n++) {
+            sum += samples[i][n];
+        }
+        qsort(samples[i], sampleCount, sizeof(uint32_t), CompareSample);
+        printf("%-12s %10lu %10lu %10lu %10lu\n", stageName[i], (unsigned long)(sum / sampleCount),
+               (unsigned long)samples[i][sampleCount / 2],
+               (unsigned long)samples[i][(sampleCount * 99 + 99) / 100 - 1],
+               (unsigned long)samples[i][sampleCount - 1]);
+    }
+
+    // Total latency, sorted above, in fixed-width buckets
+    const uint32_t* total = samples[STAGE_TOTAL];
+    uint32_t first = total[0] / HISTOGRAM_BUCKET;
+    uint32_t last = total[sampleCount - 1] / HISTOGRAM_BUCKET;
+    uint32_t counts[HISTOGRAM_BUCKETS] = {0};
+    uint32_t peak = 0;
+    if(last - first >= HISTOGRAM_BUCKETS) {
+        last = first + HISTOGRAM_BUCKETS - 1;
+    }
+    for(uint32_t n = 0; n < sampleCount; n++) {
+        uint32_t bucket = total[n] / HISTOGRAM_BUCKET;
+        uint32_t* count = &counts[(bucket > last ? last : bucket) - first];
+        (*count)++;
+        peak = *count > peak ? *count : peak;
+    }
+    for(uint32_t bucket = first; bucket <= last; bucket++) {
+        uint32_t count = counts[bucket - first];
+        bool overflow = bucket == last && total[sampleCount - 1] / HISTOGRAM_BUCKET > last;
+        printf("%6lu%s ms %6lu |%.*s\n", (unsigned long)(bucket * HISTOGRAM_BUCKET / 1000),
+               overflow ? "+" : " ", (unsigned long)count, (int)((count * HISTOGRAM_WIDTH + peak - 1) / peak),
+               "##################################################");
+    }
+}
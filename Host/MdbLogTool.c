@@ -0,0 +1,437 @@
+// mdblogtool.c
+// Host-side decoder and analyzer for binary MDB log dumps.
+//
+// Dumps are memory mapped and split into fixed size chunks that worker
+// threads claim from a shared counter, so multi-gigabyte fleet dumps are
+// processed on all cores. Record layouts come straight from MDB.h; any
+// drift between target and host fails the _Static_asserts there.
+//
+// Build: cc -std=gnu11 -O2 -pthread -DMDB_HOST_BUILD -IMDB -IHost Host/MdbLogTool.c -o mdblogtool
+// Usage: mdblogtool [-d] [-j threads] [-t top items] <dump file>...
+//   -d  print every record as formatted text, in file order
+
+#include "MDB.h"
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define CHUNK_RECORDS       65536
+#define MAX_THREADS         256
+#define APPROVAL_BUCKETS    65536 // 1ms resolution, last bucket is overflow
+#define ITEM_COUNT          65536
+#define TEXT_LINE_LENGTH    160
+
+typedef struct {
+    const uint8_t* records;
+    uint16_t section;
+    uint32_t recordSize;
+    uint32_t count;
+    char* text;          // Decode mode output
+    size_t textLength;
+} Chunk_t;
+
+typedef struct {
+    uint64_t records;
+    uint64_t errorCount[MDB_ERR_HARDWARE + 2]; // Last slot counts unknown codes
+    uint64_t transactions;
+    uint64_t failedTransactions;
+    uint64_t itemCount[ITEM_COUNT];
+    uint64_t itemAmount[ITEM_COUNT];
+    uint64_t messageCount[MDB_MSG_COUNT];
+    uint64_t approvalMs[APPROVAL_BUCKETS];
+    uint64_t approvals;
+} Stats_t;
+
+typedef struct {
+    Chunk_t* chunks;
+    size_t first;
+    size_t last;
+    atomic_size_t next;
+    bool decode;
+} Work_t;
+
+#define MDB_LOG_CATALOG_FORMAT(id, argc, format) format,
+static const char* const logFormat[MDB_MSG_COUNT] = { MDB_LOG_CATALOG(MDB_LOG_CATALOG_FORMAT) };
+
+static const char* const levelName[] = { "NONE", "ERROR", "WARN", "INFO", "DEBUG" };
+
+static const char* const errorName[] = {
+    "NONE", "NAK", "TIMEOUT", "CHECKSUM", "STATE", "PARAMETER",
+    "COMMUNICATION", "SEQUENCE", "FUNDS", "HARDWARE", "UNKNOWN"
+};
+_Static_assert(sizeof(errorName) / sizeof(errorName[0]) == MDB_ERR_HARDWARE + 2,
+               "Error name table out of sync with MDB_Error_t");
+
+static Chunk_t* chunks = NULL;
+static size_t chunkCount = 0;
+static size_t chunkCapacity = 0;
+static Stats_t* threadStats[MAX_THREADS];
+
+static void AddChunk(const uint8_t* records, uint16_t section, uint32_t recordSize, uint32_t count) {
+    if(chunkCount == chunkCapacity) {
+        size_t capacity = chunkCapacity ? chunkCapacity * 2 : 1024;
+        Chunk_t* grown = realloc(chunks, capacity * sizeof(Chunk_t));
+        if(grown == NULL) {
+            fprintf(stderr, "Out of memory\n");
+            exit(1);
+        }
+        chunks = grown;
+        chunkCapacity = capacity;
+    }
+    chunks[chunkCount++] = (Chunk_t){ .records = records, .section = section,
+                                      .recordSize = recordSize, .count = count };
+}
+
+// Section headers are walked sequentially, records are only indexed
+static bool IndexFile(const char* path, const uint8_t* data, size_t size) {
+    size_t offset = 0;
+
+    while(offset + sizeof(MDB_LogFileHeader_t) <= size) {
+        MDB_LogFileHeader_t header;
+        memcpy(&header, data + offset, sizeof(header));
+
+        if(header.magic != MDB_LOG_FILE_MAGIC || header.version != MDB_LOG_FILE_VERSION) {
+            fprintf(stderr, "%s: bad section header at offset %zu\n", path, offset);
+            return false;
+        }
+        offset += sizeof(header);
+
+        size_t bytes = (size_t)header.recordSize * header.recordCount;
+        if(bytes > size - offset) {
+            fprintf(stderr, "%s: truncated section at offset %zu\n", path, offset - sizeof(header));
+            return false;
+        }
+
+        uint32_t expected = header.section == MDB_LOG_SECTION_DEFERRED ? sizeof(MDB_DeferredLogRecord_t) :
+                            header.section == MDB_LOG_SECTION_TRANSACTION ? sizeof(MDB_TransactionLog_t) :
+                            header.section == MDB_LOG_SECTION_ERROR ? sizeof(MDB_ErrorLog_t) : 0;
+        if(expected == 0 || header.recordSize != expected) {
+            fprintf(stderr, "%s: skipping section %u (record size %u)\n", path,
+                    (unsigned int)header.section, (unsigned int)header.recordSize);
+        } else {
+            for(uint32_t i = 0; i < header.recordCount; i += CHUNK_RECORDS) {
+                uint32_t count = header.recordCount - i < CHUNK_RECORDS ? header.recordCount - i : CHUNK_RECORDS;
+                AddChunk(data + offset + (size_t)i * header.recordSize, header.section,
+                         header.recordSize, count);
+            }
+        }
+        offset += bytes;
+    }
+
+    return true;
+}
+
+static int FormatDeferred(char* line, const MDB_DeferredLogRecord_t* record) {
+    const char* level = record->level <= LOG_DEBUG ? levelName[record->level] : "?";
+    int length = snprintf(line, TEXT_LINE_LENGTH, "[%10u] %-5s ", (unsigned int)record->timestamp, level);
+
+    if(record->id < MDB_MSG_COUNT) {
+        length += snprintf(line + length, TEXT_LINE_LENGTH - length, logFormat[record->id],
+                           (unsigned int)record->args[0], (unsigned int)record->args[1],
+                           (unsigned int)record->args[2]);
+    } else {
+        length += snprintf(line + length, TEXT_LINE_LENGTH - length, "Unknown message id %u",
+                           (unsigned int)record->id);
+    }
+    return length;
+}
+
+static void ProcessChunk(Chunk_t* chunk, Stats_t* stats, bool decode) {
+    char line[TEXT_LINE_LENGTH * 2];
+    size_t capacity = decode ? (size_t)chunk->count * 64 : 0;
+    uint32_t requestTime = 0;
+    bool requestPending = false;
+
+    if(decode) {
+        chunk->text = malloc(capacity);
+        chunk->textLength = 0;
+        if(chunk->text == NULL) {
+            fprintf(stderr, "Out of memory decoding section %u\n", chunk->section);
+            exit(1);
+        }
+    }
+
+    for(uint32_t i = 0; i < chunk->count; i++) {
+        const uint8_t* raw = chunk->records + (size_t)i * chunk->recordSize;
+        int length = 0;
+        stats->records++;
+
+        if(chunk->section == MDB_LOG_SECTION_DEFERRED) {
+            MDB_DeferredLogRecord_t record;
+            memcpy(&record, raw, sizeof(record));
+            if(record.id < MDB_MSG_COUNT) {
+                stats->messageCount[record.id]++;
+            }
+
+            // Time to approval, paired within a chunk; at most one pair per
+            // chunk boundary is lost
+            if(record.id == MDB_MSG_VEND_REQUEST) {
+                requestTime = record.timestamp;
+                requestPending = true;
+            } else if(record.id == MDB_MSG_VEND_APPROVED && requestPending) {
+                uint32_t elapsed = record.timestamp - requestTime;
+                stats->approvalMs[elapsed < APPROVAL_BUCKETS ? elapsed : APPROVAL_BUCKETS - 1]++;
+                stats->approvals++;
+                requestPending = false;
+            }
+
+            if(decode) {
+                length = FormatDeferred(line, &record);
+            }
+        } else if(chunk->section == MDB_LOG_SECTION_TRANSACTION) {
+            MDB_TransactionLog_t record;
+            memcpy(&record, raw, sizeof(record));
+            stats->transactions++;
+            if(!record.success) {
+                stats->failedTransactions++;
+            } else if(record.type != TRANS_REVALUE) {
+                stats->itemCount[record.itemNumber]++;
+                stats->itemAmount[record.itemNumber] += record.amount;
+            }
+
+            if(decode) {
+                length = snprintf(line, sizeof(line),
+                                  "[%10u] TRANS id=%u type=%d amount=%u item=%u success=%d error=%s",
+                                  (unsigned int)record.timestamp, (unsigned int)record.transactionId,
+                                  (int)record.type,
+                                  (unsigned int)record.amount, (unsigned int)record.itemNumber,
+                                  (int)record.success,
+                                  errorName[record.error <= MDB_ERR_HARDWARE ? record.error : MDB_ERR_HARDWARE + 1]);
+            }
+        } else {
+            MDB_ErrorLog_t record;
+            memcpy(&record, raw, sizeof(record));
+            stats->errorCount[record.error <= MDB_ERR_HARDWARE ? record.error : MDB_ERR_HARDWARE + 1]++;
+
+            if(decode) {
+                length = snprintf(line, sizeof(line),
+                                  "[%10u] ERROR %s state=%d cmd=0x%02X resp=0x%02X",
+                                  (unsigned int)record.timestamp,
+                                  errorName[record.error <= MDB_ERR_HARDWARE ? record.error : MDB_ERR_HARDWARE + 1],
+                                  (int)record.state, record.lastCommand, record.lastResponse);
+            }
+        }
+
+        if(decode) {
+            if(length >= (int)sizeof(line)) {
+                length = sizeof(line) - 1;
+            }
+            if(chunk->textLength + length + 1 > capacity) {
+                capacity = capacity * 2 + length + 1;
+                char* grown = realloc(chunk->text, capacity);
+                if(grown == NULL) {
+                    fprintf(stderr, "Out of memory decoding section %u\n", chunk->section);
+                    exit(1);
+                }
+                chunk->text = grown;
+            }
+            memcpy(chunk->text + chunk->textLength, line, length);
+            chunk->textLength += length;
+            chunk->text[chunk->textLength++] = '\n';
+        }
+    }
+}
+
+static void* Worker(void* arg) {
+    Work_t* work = ((Work_t**)arg)[0];
+    Stats_t* stats = ((Stats_t**)arg)[1];
+
+    for(;;) {
+        size_t index = atomic_fetch_add(&work->next, 1);
+        if(index >= work->last) {
+            break;
+        }
+        ProcessChunk(&work->chunks[index], stats, work->decode);
+    }
+    return NULL;
+}
+
+// Runs chunks [first, last) on all threads
+static void RunBatch(Work_t* work, unsigned int threads) {
+    pthread_t thread[MAX_THREADS];
+    void* args[MAX_THREADS][2];
+
+    atomic_store(&work->next, work->first);
+    for(unsigned int t = 0; t < threads; t++) {
+        args[t][0] = work;
+        args[t][1] = threadStats[t];
+        pthread_create(&thread[t], NULL, Worker, args[t]);
+    }
+    for(unsigned int t = 0; t < threads; t++) {
+        pthread_join(thread[t], NULL);
+    }
+}
+
+static void MergeStats(Stats_t* total, unsigned int threads) {
+    for(unsigned int t = 0; t < threads; t++) {
+        Stats_t* stats = threadStats[t];
+        total->records += stats->records;
+        total->transactions += stats->transactions;
+        total->failedTransactions += stats->failedTransactions;
+        total->approvals += stats->approvals;
+        for(int i = 0; i < MDB_ERR_HARDWARE + 2; i++) {
+            total->errorCount[i] += stats->errorCount[i];
+        }
+        for(int i = 0; i < MDB_MSG_COUNT; i++) {
+            total->messageCount[i] += stats->messageCount[i];
+        }
+        for(int i = 0; i < ITEM_COUNT; i++) {
+            total->itemCount[i] += stats->itemCount[i];
+            total->itemAmount[i] += stats->itemAmount[i];
+        }
+        for(int i = 0; i < APPROVAL_BUCKETS; i++) {
+            total->approvalMs[i] += stats->approvalMs[i];
+        }
+    }
+}
+
+static uint32_t Percentile(const Stats_t* stats, double fraction) {
+    uint64_t rank = (uint64_t)(fraction * (double)(stats->approvals - 1)) + 1;
+    uint64_t seen = 0;
+    for(uint32_t i = 0; i < APPROVAL_BUCKETS; i++) {
+        seen += stats->approvalMs[i];
+        if(seen >= rank) {
+            return i;
+        }
+    }
+    return APPROVAL_BUCKETS - 1;
+}
+
+static void PrintReport(const Stats_t* stats, int topItems) {
+    printf("Records: %llu\n", (unsigned long long)stats->records);
+
+    uint64_t totalErrors = 0;
+    for(int i = 0; i < MDB_ERR_HARDWARE + 2; i++) {
+        totalErrors += stats->errorCount[i];
+    }
+    printf("\n=== Error Histogram (%llu) ===\n", (unsigned long long)totalErrors);
+    for(int i = 0; i < MDB_ERR_HARDWARE + 2; i++) {
+        if(stats->errorCount[i] > 0) {
+            printf("%-14s %12llu  %5.1f%%\n", errorName[i], (unsigned long long)stats->errorCount[i],
+                   100.0 * (double)stats->errorCount[i] / (double)totalErrors);
+        }
+    }
+
+    printf("\n=== Sales (%llu transactions, %llu failed) ===\n",
+           (unsigned long long)stats->transactions, (unsigned long long)stats->failedTransactions);
+    bool* shown = calloc(ITEM_COUNT, sizeof(bool));
+    for(int n = 0; n < topItems && shown != NULL; n++) {
+        int best = -1;
+        for(int i = 0; i < ITEM_COUNT; i++) {
+            if(!shown[i] && stats->itemCount[i] > 0 &&
+               (best < 0 || stats->itemCount[i] > stats->itemCount[best])) {
+                best = i;
+            }
+        }
+        if(best < 0) {
+            break;
+        }
+        shown[best] = true;
+        printf("item %5d %12llu vends %16llu total\n", best,
+               (unsigned long long)stats->itemCount[best], (unsigned long long)stats->itemAmount[best]);
+    }
+    free(shown);
+
+    printf("\n=== Time To Approval (%llu vends) ===\n", (unsigned long long)stats->approvals);
+    if(stats->approvals > 0) {
+        printf("p50 %u ms  p90 %u ms  p99 %u ms  p99.9 %u ms  max %u ms\n",
+               Percentile(stats, 0.50), Percentile(stats, 0.90), Percentile(stats, 0.99),
+               Percentile(stats, 0.999), Percentile(stats, 1.0));
+    }
+}
+
+int main(int argc, char** argv) {
+    unsigned int threads = (unsigned int)sysconf(_SC_NPROCESSORS_ONLN);
+    bool decode = false;
+    int topItems = 20;
+    int opt;
+
+    while((opt = getopt(argc, argv, "dj:t:")) != -1) {
+        switch(opt) {
+            case 'd': decode = true; break;
+            case 'j': threads = (unsigned int)atoi(optarg); break;
+            case 't': topItems = atoi(optarg); break;
+            default:
+                fprintf(stderr, "Usage: %s [-d] [-j threads] [-t top items] <dump file>...\n", argv[0]);
+                return 2;
+        }
+    }
+    if(optind >= argc) {
+        fprintf(stderr, "Usage: %s [-d] [-j threads] [-t top items] <dump file>...\n", argv[0]);
+        return 2;
+    }
+    if(threads < 1) {
+        threads = 1;
+    }
+    if(threads > MAX_THREADS) {
+        threads = MAX_THREADS;
+    }
+
+    for(int f = optind; f < argc; f++) {
+        int fd = open(argv[f], O_RDONLY);
+        struct stat st;
+        if(fd < 0 || fstat(fd, &st) != 0) {
+            perror(argv[f]);
+            return 1;
+        }
+        if(st.st_size == 0) {
+            close(fd);
+            continue;
+        }
+        const uint8_t* data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if(data == MAP_FAILED) {
+            perror(argv[f]);
+            return 1;
+        }
+        madvise((void*)data, (size_t)st.st_size, MADV_SEQUENTIAL);
+        if(!IndexFile(argv[f], data, (size_t)st.st_size)) {
+            return 1;
+        }
+    }
+
+    for(unsigned int t = 0; t < threads; t++) {
+        threadStats[t] = calloc(1, sizeof(Stats_t));
+        if(threadStats[t] == NULL) {
+            fprintf(stderr, "Out of memory\n");
+            return 1;
+        }
+    }
+
+    Work_t work = { .chunks = chunks, .decode = decode };
+    if(decode) {
+        // Bounded batches keep formatted text in memory short lived while
+        // output stays in file order
+        size_t batch = (size_t)threads * 4;
+        for(size_t first = 0; first < chunkCount; first += batch) {
+            work.first = first;
+            work.last = first + batch < chunkCount ? first + batch : chunkCount;
+            RunBatch(&work, threads);
+            for(size_t i = work.first; i < work.last; i++) {
+                if(chunks[i].text != NULL) {
+                    fwrite(chunks[i].text, 1, chunks[i].textLength, stdout);
+                    free(chunks[i].text);
+                    chunks[i].text = NULL;
+                }
+            }
+        }
+    } else {
+        work.first = 0;
+        work.last = chunkCount;
+        RunBatch(&work, threads);
+    }
+
+    Stats_t* total = calloc(1, sizeof(Stats_t));
+    if(total == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+    MergeStats(total, threads);
+    PrintReport(total, topItems);
+
+    return 0;
+}
@@ -0,0 +1,471 @@
+// mdbreplay.c
+// Feeds a bus trace captured with MDB_BUS_TRACE back through the driver,
+// so a field incident can be rerun on the host and dispatch cost can be
+// measured against real traffic.
+//
+// Replay follows the trace rather than driving the bus: commands the VMC
+// sent are applied with the driver call that sends them (MDB_Reset,
+// MDB_EnableReader, MDB_VendRequest, ...), and that call reads its answer
+// from the trace. Other frames from the peripheral, POLL answers mostly,
+// go straight to MDB_ProcessMessage. Frames the driver sends that differ
+// from the trace are counted as divergences. Traffic with other devices on
+// the bus, a coin changer, is read past. Virtual time follows the trace
+// timestamps.
+//
+// Build: cc -std=gnu11 -O2 -DMDB_HOST_BUILD -DMDB_LOG_LEVEL_MIN=0 -IMDB -IHost
+//        MDB/MdbLogSink.c MDB/MdbPack.c MDB/MdbSettle.c
+//        Host/MdbHostHal.c Host/MdbReplay.c -o mdbreplay
+// Usage: mdbreplay [-x speed] [-n passes] [-p] trace
+//   -x  1 replays in real time, 10 ten times faster, 0 as fast as possible (default)
+//   -n  replay the whole trace this many times, for steadier timing
+//   -p  print every frame as it is replayed
+
+#include "Mdb.c"
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+
+typedef struct {
+    uint64_t micros;             // Since the start of the trace
+    uint8_t flags;               // MDB_TRACE_RX, MDB_TRACE_MODE
+    uint8_t count;
+    uint8_t data[MDB_MAX_MESSAGE_LENGTH];
+    bool gap;                    // Frames were lost to overflow before this one
+} TraceFrame_t;
+
+typedef struct {
+    uint32_t commands;           // VMC frames applied through a driver call
+    uint32_t dispatched;         // Peripheral frames given to MDB_ProcessMessage
+    uint32_t rejected;           // ... that the driver refused
+    uint32_t refused;            // Driver calls that failed on replay
+    uint32_t corrupt;            // Peripheral frames with a bad checksum
+    uint32_t timeouts;
+    uint32_t otherDevice;        // Peripheral frames from devices other than the reader
+    uint32_t divergences;
+    uint32_t starved;            // Driver read past the traced answer
+    uint64_t dispatchNs;
+    uint64_t dispatchMaxNs;
+} ReplayStats_t;
+
+typedef struct {
+    const TraceFrame_t* frames;
+    uint32_t count;
+    uint32_t next;               // Cursor, shared by the engine and transport
+    const TraceFrame_t* reading; // Answer the driver is part way through
+    uint8_t word;
+    bool truncated;              // The traced answer stopped short, time out
+    const TraceFrame_t* expected;  // Frame the current driver call should send
+    bool otherDevice;            // Last VMC command was not addressed to the reader
+    uint64_t wallStart;
+    double speed;
+    bool print;
+    ReplayStats_t stats;
+} Replay_t;
+
+// Private function declarations
+static TraceFrame_t* LoadTrace(const char* path, uint32_t* count, uint32_t* dropped);
+static void ReplayPass(Replay_t* replay);
+static const TraceFrame_t* Take(Replay_t* replay);
+static bool ApplyCommand(Replay_t* replay, const TraceFrame_t* frame);
+static void Dispatch(Replay_t* replay, const TraceFrame_t* frame);
+static bool ReplaySend(void* context, const uint16_t* words, uint8_t count);
+static bool ReplayReceive(void* context, uint16_t* word, uint32_t timeout);
+static void PrintFrame(const TraceFrame_t* frame);
+static uint64_t NowNs(void);
+
+int main(int argc, char** argv) {
+    double speed = 0;
+    uint32_t passes = 1;
+    bool print = false;
+    int option;
+
+    while((option = getopt(argc, argv, "x:n:p")) != -1) {
+        switch(option) {
+            case 'x': speed = strtod(optarg, NULL); break;
+            case 'n': passes = (uint32_t)strtoul(optarg, NULL, 0); break;
+            case 'p': print = true; break;
+            default:
+                fprintf(stderr, "usage: %s [-x speed] [-n passes] [-p] trace\n", argv[0]);
+                return 2;
+        }
+    }
+    if(optind != argc - 1 || passes == 0) {
+        fprintf(stderr, "usage: %s [-x speed] [-n passes] [-p] trace\n", argv[0]);
+        return 2;
+    }
+
+    uint32_t count, dropped;
+    TraceFrame_t* frames = LoadTrace(argv[optind], &count, &dropped);
+    if(frames == NULL) {
+        return 1;
+    }
+
+    static MDB_Instance_t instance;
+    static MDB_VendJournal_t journal[2];
+    Replay_t replay = { .frames = frames, .count = count, .speed = speed };
+    MDB_Transport_t transport = { ReplaySend, ReplayReceive, &replay };
+
+    currentLogLevel = LOG_NONE;
+    uint64_t start = NowNs();
+    for(uint32_t pass = 0; pass < passes; pass++) {
+        MDB_InstanceInit(&instance, journal);
+        MDB_SelectInstance(&instance);
+        MDB_SetTransport(&transport);
+        MdbHostClockSetVirtual(true, 0);
+        replay.next = 0;
+        replay.reading = NULL;
+        replay.truncated = false;
+        replay.otherDevice = false;
+        replay.print = print && pass == 0;
+        ReplayPass(&replay);
+    }
+    double wall = (double)(NowNs() - start) / 1e9;
+
+    const ReplayStats_t* stats = &replay.stats;
+    double traced = count ? (double)frames[count - 1].micros / 1e6 : 0;
+    printf("\n=== Replay: %lu frames, %.3f s traced, %lu lost, %lu pass%s ===\n",
+           (unsigned long)count, traced, (unsigned long)dropped, (unsigned long)passes, passes == 1 ? "" : "es");
+    printf("frames    commands=%lu dispatched=%lu rejected=%lu corrupt=%lu timeouts=%lu other=%lu\n",
+           (unsigned long)(stats->commands / passes), (unsigned long)(stats->dispatched / passes),
+           (unsigned long)(stats->rejected / passes), (unsigned long)(stats->corrupt / passes),
+           (unsigned long)(stats->timeouts / passes), (unsigned long)(stats->otherDevice / passes));
+    printf("fidelity  divergences=%lu refused=%lu starved=%lu\n",
+           (unsigned long)(stats->divergences / passes), (unsigned long)(stats->refused / passes),
+           (unsigned long)(stats->starved / passes));
+    printf("dispatch  mean=%.0f ns max=%lu ns\n",
+           stats->dispatched ? (double)stats->dispatchNs / stats->dispatched : 0.0,
+           (unsigned long)stats->dispatchMaxNs);
+    printf("rate      %.0f frames/s, %.0fx real time\n", count * passes / wall, traced * passes / wall);
+    printf("state     %d, errors", (int)MDB_GetSession()->state);
+    for(int i = MDB_ERR_NAK; i <= MDB_ERR_HARDWARE; i++) {
+        printf(" %lu", (unsigned long)MDB_GetErrorCount((MDB_Error_t)i));
+    }
+    printf("\nwall      %.3f s\n", wall);
+
+    MDB_SelectInstance(NULL);
+    free(frames);
+    return 0;
+}
+
+// Reads every chunk of the file into one frame array with times relative
+// to the first frame
+static TraceFrame_t* LoadTrace(const char* path, uint32_t* count, uint32_t* dropped) {
+    FILE* file = fopen(path, "rb");
+    if(file == NULL) {
+        perror(path);
+        return NULL;
+    }
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    uint8_t* raw = malloc(size > 0 ? (size_t)size : 1);
+    if(raw == NULL || fread(raw, 1, (size_t)size, file) != (size_t)size) {
+        fprintf(stderr, "%s: read failed\n", path);
+        fclose(file);
+        free(raw);
+        return NULL;
+    }
+    fclose(file);
+
+    // No record is shorter than three bytes
+    TraceFrame_t* frames = calloc((size_t)size / 3 + 1, sizeof(TraceFrame_t));
+    uint32_t offset = 0;
+    uint64_t base = 0;
+    uint64_t time = 0;
+    bool first = true;
+    *count = 0;
+    *dropped = 0;
+
+    while(offset + sizeof(MDB_TraceFileHeader_t) <= (uint32_t)size) {
+        MDB_TraceFileHeader_t header;
+        memcpy(&header, raw + offset, sizeof(header));
+        if(header.magic != MDB_TRACE_FILE_MAGIC || header.version != MDB_TRACE_FILE_VERSION ||
+           header.length > (uint32_t)size - offset - sizeof(header)) {
+            fprintf(stderr, "%s: bad chunk at offset %lu\n", path, (unsigned long)offset);
+            free(raw);
+            free(frames);
+            return NULL;
+        }
+        offset += sizeof(header);
+        *dropped += header.dropped;
+
+        // Chunk start times are absolute, a wrapped us counter moves on by
+        // the 32-bit difference
+        if(first) {
+            base = header.startMicros;
+            time = 0;
+            first = false;
+        } else {
+            time += (uint32_t)(header.startMicros - (uint32_t)(base + time));
+        }
+
+        uint32_t end = offset + header.length;
+        bool firstRecord = true;
+        while(offset < end) {
+            TraceFrame_t* frame = &frames[*count];
+            uint8_t head = raw[offset++];
+            uint32_t delta = 0;
+            uint8_t shift = 0;
+            uint8_t byte;
+            do {
+                byte = offset < end ? raw[offset++] : 0;
+                delta |= (uint32_t)(byte & 0x7F) << shift;
+                shift += 7;
+            } while((byte & 0x80) && shift < 35);
+
+            frame->flags = head & (MDB_TRACE_RX | MDB_TRACE_MODE);
+            frame->count = head & MDB_TRACE_LENGTH_MASK;
+            if(frame->count > MDB_MAX_MESSAGE_LENGTH || offset + frame->count > end) {
+                fprintf(stderr, "%s: bad record at offset %lu\n", path, (unsigned long)offset);
+                free(raw);
+                free(frames);
+                return NULL;
+            }
+            memcpy(frame->data, raw + offset, frame->count);
+            offset += frame->count;
+            if(!firstRecord) {
+                time += delta;
+            }
+            frame->micros = time;
+            frame->gap = firstRecord && header.dropped != 0;
+            firstRecord = false;
+            (*count)++;
+        }
+    }
+
+    free(raw);
+    return frames;
+}
+
+static void ReplayPass(Replay_t* replay) {
+    replay->wallStart = NowNs();
+
+    while(replay->next < replay->count) {
+        const TraceFrame_t* frame = Take(replay);
+        if(!(frame->flags & MDB_TRACE_RX)) {
+            // The address is the top five bits of the mode byte
+            if(frame->flags & MDB_TRACE_MODE) {
+                replay->otherDevice = (frame->data[0] & 0xF8) != MDB_CMD_RESET;
+            }
+            if(ApplyCommand(replay, frame)) {
+                replay->stats.commands++;
+            }
+        } else if(replay->otherDevice) {
+            replay->stats.otherDevice++;
+        } else if(frame->count == 0) {
+            replay->stats.timeouts++;
+        } else if(frame->count > 1) {
+            Dispatch(replay, frame);
+        }
+    }
+}
+
+// Moves the cursor on by one frame. Virtual time always follows the
+// trace, wall time only when the replay is paced.
+static const TraceFrame_t* Take(Replay_t* replay) {
+    const TraceFrame_t* frame = &replay->frames[replay->next++];
+    uint64_t now = MdbHostMicros();
+    if(frame->micros > now) {
+        MdbHostClockAdvanceMicros((uint32_t)(frame->micros - now));
+    }
+    if(replay->speed > 0) {
+        uint64_t due = replay->wallStart + (uint64_t)((double)frame->micros * 1000.0 / replay->speed);
+        uint64_t wall = NowNs();
+        if(due > wall) {
+            struct timespec pause = { (time_t)((due - wall) / 1000000000u), (long)((due - wall) % 1000000000u) };
+            nanosleep(&pause, NULL);
+        }
+    }
+    if(replay->print) {
+        PrintFrame(frame);
+    }
+    return frame;
+}
+
+// Reruns a VMC command with the driver call that sends it. Returns false
+// for frames the driver sends on its own, which are only read past.
+static bool ApplyCommand(Replay_t* replay, const TraceFrame_t* frame) {
+    const uint8_t* data = frame->data;
+    bool applied;
+
+    if(!(frame->flags & MDB_TRACE_MODE) || frame->count < 2) {
+        return false;
+    }
+
+    replay->expected = frame;
+    switch(data[0]) {
+        case MDB_CMD_RESET:
+            applied = MDB_Reset();
+            break;
+
+        // The configuration answer is read here, as SetupReader does
+        case MDB_CMD_SETUP: {
+            if(data[1] != 0x00 || frame->count < 3) {
+                replay->expected = NULL;
+                return false;
+            }
+            replay->expected = NULL;
+            applied = replay->next < replay->count && (replay->frames[replay->next].flags & MDB_TRACE_RX);
+            if(applied) {
+                const TraceFrame_t* answer = Take(replay);
+                applied = ParseConfiguration((uint8_t*)answer->data, answer->count);
+            }
+            if(applied) {
+                MDB_SetState(MDB_STATE_DISABLED);
+            }
+            break;
+        }
+
+        case MDB_CMD_READER:
+            if(data[1] == MDB_READER_ENABLE) {
+                applied = MDB_EnableReader();
+            } else if(data[1] == MDB_READER_DISABLE) {
+                applied = MDB_DisableReader();
+            } else {
+                replay->expected = NULL;
+                return false;
+            }
+            break;
+
+        case MDB_CMD_VEND:
+            if(data[1] == MDB_VEND_REQUEST && frame->count >= 7) {
+                uint8_t scale = mdb->config.scaleFactor ? mdb->config.scaleFactor : 1;
+                applied = MDB_VendRequest((uint16_t)((data[4] << 8) | data[5]),
+                                          (uint32_t)((data[2] << 8) | data[3]) * scale);
+            } else if(data[1] == MDB_VEND_SUCCESS && frame->count >= 5) {
+                applied = MDB_VendSuccess((uint16_t)((data[2] << 8) | data[3]));
+            } else if(data[1] == MDB_VEND_FAILURE) {
+                applied = MDB_VendFailure();
+            } else if(data[1] == MDB_VEND_SESSION_COMPLETE) {
+                applied = MDB_SessionComplete();
+            } else {
+                replay->expected = NULL;
+                return false;
+            }
+            break;
+
+        case MDB_CMD_EXPANSION:
+            if(data[1] != MDB_EXP_FEATURE_ENABLE || frame->count < 7) {
+                replay->expected = NULL;
+                return false;
+            }
+            applied = MDB_EnableOptionalFeatures(((uint32_t)data[2] << 24) | ((uint32_t)data[3] << 16) |
+                                                 ((uint32_t)data[4] << 8) | data[5]);
+            break;
+
+        default:
+            replay->expected = NULL;
+            return false;
+    }
+
+    // The call never reached the bus, the trace has moved on without it
+    if(replay->expected != NULL) {
+        replay->stats.divergences++;
+        replay->expected = NULL;
+    }
+    if(!applied) {
+        replay->stats.refused++;
+    }
+    return true;
+}
+
+// A peripheral frame outside any driver call, as MDB_Poll hands it over
+static void Dispatch(Replay_t* replay, const TraceFrame_t* frame) {
+    uint8_t msg[MDB_MAX_MESSAGE_LENGTH];
+    memcpy(msg, frame->data, frame->count);
+    if(!(frame->flags & MDB_TRACE_MODE) || CalculateChecksum(msg, frame->count - 1) != msg[frame->count - 1]) {
+        replay->stats.corrupt++;
+        return;
+    }
+
+    uint64_t start = NowNs();
+    bool accepted = MDB_ProcessMessage(msg, frame->count);
+    uint64_t elapsed = NowNs() - start;
+    replay->stats.dispatched++;
+    replay->stats.dispatchNs += elapsed;
+    if(elapsed > replay->stats.dispatchMaxNs) {
+        replay->stats.dispatchMaxNs = elapsed;
+    }
+    if(!accepted) {
+        replay->stats.rejected++;
+    }
+}
+
+// The command a driver call sends is checked against the traced one;
+// its ACKs and RETs are not, the trace has them as frames of their own
+static bool ReplaySend(void* context, const uint16_t* words, uint8_t count) {
+    Replay_t* replay = (Replay_t*)context;
+    const TraceFrame_t* expected = replay->expected;
+
+    if(expected != NULL && (words[0] & MDB_MODE_BIT)) {
+        bool same = count == expected->count;
+        for(uint8_t i = 0; same && i < count; i++) {
+            same = (uint8_t)words[i] == expected->data[i];
+        }
+        if(!same) {
+            replay->stats.divergences++;
+        }
+        replay->expected = NULL;
+    }
+    return true;
+}
+
+// Answers come from the trace frame at the cursor, word by word; the
+// driver's own ACK that follows an answer is stepped over
+static bool ReplayReceive(void* context, uint16_t* word, uint32_t timeout) {
+    Replay_t* replay = (Replay_t*)context;
+    (void)timeout;
+
+    if(replay->truncated) {
+        replay->truncated = false;
+        return false;
+    }
+    if(replay->reading == NULL) {
+        while(replay->next < replay->count &&
+              !(replay->frames[replay->next].flags & (MDB_TRACE_RX | MDB_TRACE_MODE))) {
+            Take(replay);
+        }
+        if(replay->next >= replay->count || !(replay->frames[replay->next].flags & MDB_TRACE_RX)) {
+            replay->stats.starved++;
+            return false;
+        }
+        replay->reading = Take(replay);
+        replay->word = 0;
+        if(replay->reading->count == 0) {
+            replay->reading = NULL;
+            return false;
+        }
+    }
+
+    const TraceFrame_t* frame = replay->reading;
+    *word = frame->data[replay->word++];
+    if(replay->word == frame->count) {
+        if(frame->flags & MDB_TRACE_MODE) {
+            *word |= MDB_MODE_BIT;
+        } else {
+            replay->truncated = true;
+        }
+        replay->reading = NULL;
+    }
+    return true;
+}
+
+static void PrintFrame(const TraceFrame_t* frame) {
+    printf("%s%12.6f %s", frame->gap ? "-- frames lost --\n" : "", (double)frame->micros / 1e6,
+           (frame->flags & MDB_TRACE_RX) ? "PER" : "VMC");
+    if(frame->count == 0) {
+        printf(" timeout");
+    }
+    for(uint8_t i = 0; i < frame->count; i++) {
+        bool mode = (frame->flags & MDB_TRACE_MODE) &&
+                    i == ((frame->flags & MDB_TRACE_RX) ? frame->count - 1 : 0);
+        printf(" %s%02X", mode ? "*" : "", frame->data[i]);
+    }
+    printf("\n");
+}
+
+static uint64_t NowNs(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+}
@@ -0,0 +1,271 @@
+// mdbsim.c
+// Runs the driver against the simulated cashless reader and reports how
+// it coped: vends completed, errors seen, and how long recovery from
+// reader restarts took.
+//
+// Build: cc -std=gnu11 -O2 -DMDB_HOST_BUILD -DMDB_LOG_LEVEL_MIN=2 -IMDB -IHost
+//        MDB/Mdb.c MDB/MdbLogSink.c MDB/MdbPack.c MDB/MdbSettle.c
+//        Host/MdbHostHal.c Host/MdbSimReader.c Host/MdbSim.c -o mdbsim
+// Usage: mdbsim [-s seed] [-t seconds] [-c card interval ms] [-a] [-w]
+//               [-f nak,corrupt,drop,late,reset] [-r restart interval ms]
+//               [-T trace file] [-d response delay ms] [-g inter-byte gap us] [-k]
+//   -a  reader offers always-idle mode
+//   -w  run on the wall clock instead of virtual time
+//   -f  random fault rates per 10000 commands
+//   -r  scripted reader restarts, alternating JUST RESET and 3 s silence
+//   -T  write the bus trace for mdbreplay, needs -DMDB_BUS_TRACE=1
+//   -d  -g  reader answer timing, reported with -DMDB_TIMING_MONITOR=1
+//   -k  exit 1 if a vend was lost: refused by the driver, or abandoned
+//       without a denial. Faults that only NAK must lose none:
+//       mdbsim -t 36000 -f 300,0,0,0,0 -k
+
+#include "MdbSimReader.h"
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+
+#define MAX_SCRIPT_STEPS  4096
+#define ITEM_PRICE        150
+
+typedef struct {
+    uint32_t attempted;
+    uint32_t completed;
+    uint32_t abandoned;
+    uint32_t refused;            // VEND REQUEST calls that failed
+    uint32_t initFailures;
+} AppStats_t;
+
+static MdbSimStep_t script[MAX_SCRIPT_STEPS];
+static FILE* traceFile;
+
+// Private function declarations
+static uint16_t BuildRestartScript(uint32_t interval, uint32_t duration);
+static void RunVendApp(MdbSimReader_t* sim, AppStats_t* app);
+static void Report(const MdbSimReader_t* sim, const AppStats_t* app, uint32_t duration);
+static void SaveTrace(bool force);
+
+int main(int argc, char** argv) {
+    MdbSimConfig_t config = {
+        .featureLevel = 3,
+        .scaleFactor = 1,
+        .miscOptions = MDB_READER_OPT_REFUNDS | MDB_READER_OPT_MULTIVEND,
+        .optionalFeatures = 0,
+        .responseDelay = 1,
+        .wordTime = MDB_WORD_TIME_US,
+        .approveDelay = 400,
+        .cardInterval = 5000,
+        .cardFunds = 500,
+        .seed = 1
+    };
+    uint32_t duration = 60;
+    uint32_t restartInterval = 0;
+    bool wallClock = false;
+    bool checkLost = false;
+    int option;
+
+    while((option = getopt(argc, argv, "s:t:c:awf:r:T:d:g:k")) != -1) {
+        switch(option) {
+            case 's': config.seed = (uint32_t)strtoul(optarg, NULL, 0); break;
+            case 't': duration = (uint32_t)strtoul(optarg, NULL, 0); break;
+            case 'c': config.cardInterval = (uint32_t)strtoul(optarg, NULL, 0); break;
+            case 'a': config.optionalFeatures |= MDB_FEATURE_ALWAYS_IDLE; break;
+            case 'w': wallClock = true; break;
+            case 'k': checkLost = true; break;
+            case 'r': restartInterval = (uint32_t)strtoul(optarg, NULL, 0); break;
+            case 'd': config.responseDelay = (uint32_t)strtoul(optarg, NULL, 0); break;
+            case 'g': config.interByteGap = (uint32_t)strtoul(optarg, NULL, 0); break;
+            case 'T':
+                if(!MDB_BUS_TRACE) {
+                    fprintf(stderr, "-T needs a build with -DMDB_BUS_TRACE=1\n");
+                    return 2;
+                }
+                if((traceFile = fopen(optarg, "wb")) == NULL) {
+                    perror(optarg);
+                    return 1;
+                }
+                break;
+            case 'f': {
+                unsigned int rates[5] = {0};
+                sscanf(optarg, "%u,%u,%u,%u,%u", &rates[0], &rates[1], &rates[2], &rates[3], &rates[4]);
+                config.faults = (MdbSimFaults_t){ rates[0], rates[1], rates[2], rates[3], rates[4] };
+                break;
+            }
+            default:
+                fprintf(stderr, "usage: %s [-s seed] [-t seconds] [-c card ms] [-a] [-w] "
+                                "[-f nak,corrupt,drop,late,reset] [-r restart ms] [-T trace]\n", argv[0]);
+                return 2;
+        }
+    }
+
+    duration *= 1000;
+    config.script = script;
+    config.scriptLength = BuildRestartScript(restartInterval, duration);
+
+    MdbHostClockSetVirtual(!wallClock, 0);
+
+    static MdbSimReader_t sim;
+    MdbSimInit(&sim, &config);
+    MDB_Transport_t transport = MdbSimTransport(&sim);
+    MDB_SetTransport(&transport);
+
+    AppStats_t app = {0};
+    uint32_t start = HAL_GetTick();
+    while(!MDB_Initialize()) {
+        app.initFailures++;
+        HAL_Delay(MDB_POLL_INTERVAL);
+        if(HAL_GetTick() - start >= duration) {
+            break;
+        }
+    }
+
+    while(HAL_GetTick() - start < duration) {
+        MDB_Poll();
+        RunVendApp(&sim, &app);
+        SaveTrace(false);
+
+        // Nothing can happen before the next poll slot or reader event
+        if(MdbHostClockIsVirtual()) {
+            uint32_t now = HAL_GetTick();
+            uint32_t next = MDB_NextPollTime();
+            uint32_t simNext = MdbSimNextEvent(&sim, now);
+            if((int32_t)(simNext - next) < 0) {
+                next = simNext;
+            }
+            MdbHostClockAdvanceTo((int32_t)(next - now) > 0 ? next : now + 1);
+        } else {
+            HAL_Delay(1);
+        }
+    }
+
+    MDB_LogSinkService();
+    SaveTrace(true);
+    if(traceFile != NULL) {
+        fclose(traceFile);
+    }
+    fflush(stdout);
+    Report(&sim, &app, duration);
+    printf("wall     %.3f s\n", (double)clock() / CLOCKS_PER_SEC);
+    if(checkLost && (app.refused > 0 || app.abandoned > sim.stats.denials)) {
+        fprintf(stderr, "vends lost: refused=%lu abandoned=%lu denied=%lu\n", (unsigned long)app.refused,
+                (unsigned long)app.abandoned, (unsigned long)sim.stats.denials);
+        return 1;
+    }
+    return 0;
+}
+
+static uint16_t BuildRestartScript(uint32_t interval, uint32_t duration) {
+    uint16_t count = 0;
+    if(interval == 0) {
+        return 0;
+    }
+    for(uint32_t at = interval; at < duration && count < MAX_SCRIPT_STEPS; at += interval) {
+        bool silent = (count & 1) != 0;
+        script[count++] = (MdbSimStep_t){ at, silent ? SIM_STEP_SILENT : SIM_STEP_JUST_RESET, silent ? 3000 : 0 };
+    }
+    return count;
+}
+
+// One purchase per card: request, dispense on approval, close the session
+static void RunVendApp(MdbSimReader_t* sim, AppStats_t* app) {
+    static bool inVend = false;
+    static uint32_t served = 0;
+    const MDB_Session_t* session = MDB_GetSession();
+
+    if(inVend) {
+        if(session->state == MDB_STATE_VEND && session->outcomeId == session->transactionId) {
+            MDB_VendSuccess(session->itemNumber);
+            app->completed++;
+            inVend = false;
+            if(!session->alwaysIdle) {
+                MDB_SessionComplete();
+            }
+        } else if(session->state != MDB_STATE_VEND) {
+            app->abandoned++;
+            inVend = false;
+            if(session->state == MDB_STATE_SESSION_IDLE && !session->alwaysIdle) {
+                MDB_SessionComplete();
+            }
+        }
+        return;
+    }
+
+    if(session->state == MDB_STATE_SESSION_IDLE && served < sim->stats.sessions) {
+        served = sim->stats.sessions;
+        app->attempted++;
+        inVend = MDB_VendRequest((uint16_t)(1 + app->attempted % 24), ITEM_PRICE);
+        if(!inVend) {
+            app->refused++;
+        }
+    }
+}
+
+// Drains the capture ring once a second, well before it can overflow
+static void SaveTrace(bool force) {
+    static uint8_t chunk[MDB_BUS_TRACE_SIZE + sizeof(MDB_TraceFileHeader_t)];
+    static uint32_t lastSave = 0;
+    uint32_t length;
+    if(traceFile == NULL || (!force && HAL_GetTick() - lastSave < 1000)) {
+        return;
+    }
+    lastSave = HAL_GetTick();
+    while((length = MDB_ExportBusTrace(chunk, sizeof(chunk))) > 0) {
+        fwrite(chunk, 1, length, traceFile);
+    }
+}
+
+static void Report(const MdbSimReader_t* sim, const AppStats_t* app, uint32_t duration) {
+    const MdbSimStats_t* stats = &sim->stats;
+    static const char* const errorName[] = {
+        "none", "nak", "timeout", "checksum", "state", "parameter",
+        "communication", "sequence", "funds", "hardware"
+    };
+
+    printf("\n=== Simulation: %lu s, seed %lu ===\n",
+           (unsigned long)(duration / 1000), (unsigned long)sim->config.seed);
+    printf("bus      commands=%lu polls=%lu resets=%lu ret=%lu repeats=%lu\n",
+           (unsigned long)stats->commands, (unsigned long)stats->polls, (unsigned long)stats->resets,
+           (unsigned long)stats->retRequests, (unsigned long)stats->repeats);
+    printf("vends    sessions=%lu attempted=%lu completed=%lu abandoned=%lu refused=%lu denied=%lu init failures=%lu\n",
+           (unsigned long)stats->sessions, (unsigned long)app->attempted, (unsigned long)app->completed,
+           (unsigned long)app->abandoned, (unsigned long)app->refused, (unsigned long)stats->denials,
+           (unsigned long)app->initFailures);
+    printf("faults   nak=%lu corrupt=%lu drop=%lu late=%lu reset=%lu silent=%lu\n",
+           (unsigned long)stats->nakInjected, (unsigned long)stats->corruptInjected,
+           (unsigned long)stats->dropInjected, (unsigned long)stats->lateInjected,
+           (unsigned long)stats->resetInjected, (unsigned long)stats->silentInjected);
+    printf("recovery count=%lu mean=%lu ms max=%lu ms pending=%s breaker=%d\n",
+           (unsigned long)stats->recoveries,
+           (unsigned long)(stats->recoveries ? stats->recoveryTotal / stats->recoveries : 0),
+           (unsigned long)stats->recoveryMax, sim->faultTime ? "yes" : "no", (int)MDB_GetBreakerState());
+    printf("errors  ");
+    for(int i = MDB_ERR_NAK; i <= MDB_ERR_HARDWARE; i++) {
+        printf(" %s=%lu", errorName[i], (unsigned long)MDB_GetErrorCount((MDB_Error_t)i));
+    }
+    printf("\n");
+
+    const MDB_TimingStats_t* timing = MDB_GetTimingStats();
+    if(timing != NULL) {
+        const MDB_Histogram_t* histogram[2] = { &timing->response, &timing->interByte };
+        const uint32_t marginal[2] = { timing->responseMarginal, timing->interByteMarginal };
+        const uint32_t violations[2] = { timing->responseViolations, timing->interByteViolations };
+        for(int i = 0; i < 2; i++) {
+            printf("timing   %-9s n=%-8lu p50=%-5lu p99=%-5lu p999=%-5lu max=%-5lu us marginal=%lu over=%lu\n",
+                   i == 0 ? "response" : "interbyte", (unsigned long)histogram[i]->samples,
+                   (unsigned long)MDB_HistogramPercentile(histogram[i], 500),
+                   (unsigned long)MDB_HistogramPercentile(histogram[i], 990),
+                   (unsigned long)MDB_HistogramPercentile(histogram[i], 999),
+                   (unsigned long)histogram[i]->max, (unsigned long)marginal[i], (unsigned long)violations[i]);
+        }
+        printf("timing   reader %s\n", timing->flagged ? "FLAGGED near MDB limits" : "within MDB limits");
+    }
+
+    // Host cycles, only meaningful from an optimised -DMDB_PROFILE=1 build
+    MDB_ProfStats_t profile;
+    for(int i = 0; i < MDB_PROF_COUNT && MDB_GetProfile((MDB_ProfPoint_t)i, &profile); i++) {
+        if(profile.count != 0) {
+            printf("profile  %-16s n=%-8lu min=%-8lu max=%-10lu mean=%lu cycles\n",
+                   MDB_ProfileName((MDB_ProfPoint_t)i), (unsigned long)profile.count, (unsigned long)profile.min,
+                   (unsigned long)profile.max, (unsigned long)(profile.total / profile.count));
+        }
+    }
+}
@@ -0,0 +1,480 @@
+// mdbsimreader.c
+// Deterministic cashless reader model behind the driver's bus transport.
+//
+// Every VMC frame arrives whole through send(); the answer is built at
+// once and handed out word by word through receive(), which charges the
+// configured response delay to the HAL clock. Faults come from a script of
+// timed steps and from seeded random rates, so a given seed and script
+// always produce the same bus traffic.
+
+#include "MdbSimReader.h"
+
+// Private function declarations
+static bool SimSend(void* context, const uint16_t* words, uint8_t count);
+static bool SimReceive(void* context, uint16_t* word, uint32_t timeout);
+static void RunScript(MdbSimReader_t* sim, uint32_t now);
+static void HandleCommand(MdbSimReader_t* sim, const uint8_t* cmd, uint8_t length, uint32_t now);
+static void HandlePoll(MdbSimReader_t* sim, uint32_t now);
+static void HandleVend(MdbSimReader_t* sim, const uint8_t* cmd, uint8_t length, uint32_t now);
+static void HandleExpansion(MdbSimReader_t* sim, const uint8_t* cmd, uint8_t length);
+static void Restart(MdbSimReader_t* sim, uint32_t now);
+static void QueueEvent(MdbSimReader_t* sim, uint32_t due, const uint8_t* data, uint8_t length);
+static void AnswerAck(MdbSimReader_t* sim);
+static void AnswerNak(MdbSimReader_t* sim);
+static void AnswerData(MdbSimReader_t* sim, const uint8_t* data, uint8_t length);
+static bool Chance(MdbSimReader_t* sim, uint16_t perTenThousand);
+static uint32_t NextRandom(MdbSimReader_t* sim);
+
+void MdbSimInit(MdbSimReader_t* sim, const MdbSimConfig_t* config) {
+    memset(sim, 0, sizeof(MdbSimReader_t));
+    sim->config = *config;
+    sim->rng = config->seed ? config->seed : 1;
+    sim->state = SIM_INACTIVE;
+    sim->justReset = true;
+    sim->nextCard = config->cardInterval;
+}
+
+MDB_Transport_t MdbSimTransport(MdbSimReader_t* sim) {
+    MDB_Transport_t transport = { SimSend, SimReceive, sim };
+    return transport;
+}
+
+// BEGIN SESSION on the next POLL, if the reader is enabled and idle
+void MdbSimPresentCard(MdbSimReader_t* sim, uint32_t funds) {
+    bool alwaysIdle = (sim->enabledFeatures & MDB_FEATURE_ALWAYS_IDLE) != 0;
+    if(sim->state != SIM_ENABLED && !(alwaysIdle && sim->state == SIM_SESSION)) {
+        return;
+    }
+
+    uint8_t scale = sim->config.scaleFactor ? sim->config.scaleFactor : 1;
+    uint16_t scaled = (uint16_t)(funds / scale);
+    uint8_t begin[] = {MDBRxCashlessBeginSession, scaled >> 8, scaled & 0xFF, 0};
+    QueueEvent(sim, 0, begin, sizeof(begin));
+    sim->state = SIM_SESSION;
+    sim->stats.sessions++;
+}
+
+// Earliest tick at which the reader changes on its own, for virtual time
+uint32_t MdbSimNextEvent(const MdbSimReader_t* sim, uint32_t now) {
+    uint32_t next = now + 0x7FFFFFFFu;
+    if(sim->scriptIndex < sim->config.scriptLength &&
+       (int32_t)(sim->config.script[sim->scriptIndex].at - next) < 0) {
+        next = sim->config.script[sim->scriptIndex].at;
+    }
+    if(sim->config.cardInterval != 0 && (int32_t)(sim->nextCard - next) < 0) {
+        next = sim->nextCard;
+    }
+    for(uint8_t i = 0; i < sim->eventCount; i++) {
+        if((int32_t)(sim->events[i].due - next) < 0) {
+            next = sim->events[i].due;
+        }
+    }
+    if(sim->silentUntil != 0 && (int32_t)(sim->silentUntil - next) < 0) {
+        next = sim->silentUntil;
+    }
+    return next;
+}
+
+static bool SimSend(void* context, const uint16_t* words, uint8_t count) {
+    MdbSimReader_t* sim = (MdbSimReader_t*)context;
+    MdbHostClockAdvanceMicros(count * sim->config.wordTime);
+    uint32_t now = HAL_GetTick();
+
+    RunScript(sim, now);
+    sim->outLength = 0;
+    sim->outIndex = 0;
+    sim->outLate = false;
+
+    if((int32_t)(now - sim->silentUntil) < 0) {
+        return true; // Powered down, the frame goes nowhere
+    }
+    if(sim->silentUntil != 0) {
+        sim->silentUntil = 0;
+        Restart(sim, now);
+    }
+
+    // ACK, RET or NAK from the VMC
+    if(count == 1 && !(words[0] & MDB_MODE_BIT)) {
+        if(words[0] == MDB_ACK) {
+            sim->lastDataLength = 0;
+        } else if(words[0] == MDB_RET && sim->lastDataLength > 0) {
+            sim->stats.retRequests++;
+            AnswerData(sim, sim->lastData, sim->lastDataLength);
+        }
+        return true;
+    }
+
+    // Only frames addressed to the cashless device with a valid checksum
+    uint8_t cmd[SIM_FRAME_WORDS];
+    uint8_t sum = 0;
+    if(count < 2 || !(words[0] & MDB_MODE_BIT) || (words[0] & 0xF8) != MDB_CMD_RESET) {
+        return true;
+    }
+    for(uint8_t i = 0; i < count; i++) {
+        cmd[i] = (uint8_t)words[i];
+        if(i < count - 1) {
+            sum += cmd[i];
+        }
+    }
+    if(sum != cmd[count - 1]) {
+        return true;
+    }
+
+    sim->stats.commands++;
+    if(sim->nakNext || Chance(sim, sim->config.faults.nak)) {
+        sim->nakNext = false;
+        sim->stats.nakInjected++;
+        AnswerNak(sim);
+    } else {
+        HandleCommand(sim, cmd, count - 1, now);
+    }
+
+    // Transmission faults apply to whatever answer was built
+    if(sim->outLength > 0 && (sim->lateNext || Chance(sim, sim->config.faults.late))) {
+        sim->lateNext = false;
+        sim->stats.lateInjected++;
+        sim->outLate = true;
+    } else if(sim->outLength > 1 && (sim->dropNext || Chance(sim, sim->config.faults.drop))) {
+        sim->dropNext = false;
+        sim->stats.dropInjected++;
+        uint8_t victim = NextRandom(sim) % sim->outLength;
+        memmove(&sim->out[victim], &sim->out[victim + 1], (sim->outLength - victim - 1) * sizeof(uint16_t));
+        sim->outLength--;
+    }
+    return true;
+}
+
+static bool SimReceive(void* context, uint16_t* word, uint32_t timeout) {
+    MdbSimReader_t* sim = (MdbSimReader_t*)context;
+
+    if(sim->outIndex >= sim->outLength) {
+        HAL_Delay(timeout);
+        return false;
+    }
+
+    // A late answer is lost to the VMC, which has already given up
+    if(sim->outIndex == 0) {
+        uint32_t delay = sim->outLate ? timeout + 1 : sim->config.responseDelay;
+        if(delay > timeout) {
+            HAL_Delay(timeout);
+            sim->outLength = 0;
+            return false;
+        }
+        HAL_Delay(delay);
+    } else if(sim->config.interByteGap > timeout * 1000) {
+        HAL_Delay(timeout);
+        sim->outLength = 0;
+        return false;
+    } else {
+        MdbHostClockAdvanceMicros(sim->config.interByteGap);
+    }
+
+    MdbHostClockAdvanceMicros(sim->config.wordTime);
+    *word = sim->out[sim->outIndex++];
+    return true;
+}
+
+static void RunScript(MdbSimReader_t* sim, uint32_t now) {
+    while(sim->scriptIndex < sim->config.scriptLength &&
+          (int32_t)(now - sim->config.script[sim->scriptIndex].at) >= 0) {
+        const MdbSimStep_t* step = &sim->config.script[sim->scriptIndex++];
+        switch(step->action) {
+            case SIM_STEP_CARD:          MdbSimPresentCard(sim, step->value); break;
+            case SIM_STEP_DENY_NEXT:     sim->denyNext = true; break;
+            case SIM_STEP_APPROVE_DELAY: sim->config.approveDelay = step->value; break;
+            case SIM_STEP_JUST_RESET:    sim->stats.resetInjected++; Restart(sim, now); break;
+            case SIM_STEP_NAK_NEXT:      sim->nakNext = true; break;
+            case SIM_STEP_CORRUPT_NEXT:  sim->corruptNext = true; break;
+            case SIM_STEP_DROP_NEXT:     sim->dropNext = true; break;
+            case SIM_STEP_LATE_NEXT:     sim->lateNext = true; break;
+            case SIM_STEP_SILENT:
+                sim->stats.silentInjected++;
+                sim->silentUntil = now + (step->value ? step->value : 1);
+                if(sim->faultTime == 0) {
+                    sim->faultTime = now ? now : 1;
+                }
+                break;
+        }
+    }
+
+    if(sim->config.cardInterval != 0 && (int32_t)(now - sim->nextCard) >= 0) {
+        sim->nextCard = now + sim->config.cardInterval;
+        MdbSimPresentCard(sim, sim->config.cardFunds);
+    }
+}
+
+static void HandleCommand(MdbSimReader_t* sim, const uint8_t* cmd, uint8_t length, uint32_t now) {
+    switch(cmd[0]) {
+        case MDB_CMD_RESET:
+            sim->stats.resets++;
+            sim->state = SIM_INACTIVE;
+            sim->justReset = true;
+            sim->eventCount = 0;
+            sim->lastDataLength = 0;
+            sim->enabledFeatures = 0;
+            AnswerAck(sim);
+            break;
+
+        case MDB_CMD_SETUP:
+            if(length >= 2 && cmd[1] == 0x00) {
+                uint8_t config[] = {MDBRxCashlessReaderConfig, sim->config.featureLevel, 0x18, 0x40,
+                                    sim->config.scaleFactor, 2, 5, sim->config.miscOptions};
+                if(sim->state == SIM_INACTIVE) {
+                    sim->state = SIM_DISABLED;
+                }
+                AnswerData(sim, config, sizeof(config));
+            } else {
+                AnswerAck(sim);
+            }
+            break;
+
+        case MDB_CMD_POLL:
+            sim->stats.polls++;
+            HandlePoll(sim, now);
+            break;
+
+        case MDB_CMD_VEND:
+            HandleVend(sim, cmd, length, now);
+            break;
+
+        case MDB_CMD_READER:
+            if(length >= 2 && cmd[1] == MDB_READER_ENABLE && sim->state >= SIM_DISABLED) {
+                bool alwaysIdle = (sim->enabledFeatures & MDB_FEATURE_ALWAYS_IDLE) != 0;
+                if(sim->state == SIM_DISABLED) {
+                    sim->state = alwaysIdle ? SIM_SESSION : SIM_ENABLED;
+                }
+                if(sim->faultTime != 0) {
+                    uint32_t recovery = now - sim->faultTime;
+                    sim->stats.recoveries++;
+                    sim->stats.recoveryTotal += recovery;
+                    if(recovery > sim->stats.recoveryMax) {
+                        sim->stats.recoveryMax = recovery;
+                    }
+                    sim->faultTime = 0;
+                }
+            } else if(length >= 2 && cmd[1] == MDB_READER_DISABLE && sim->state >= SIM_DISABLED) {
+                sim->state = SIM_DISABLED;
+            } else if(length >= 2 && cmd[1] == MDB_READER_CANCEL) {
+                uint8_t cancelled[] = {MDBRxCashlessCancelled};
+                QueueEvent(sim, now, cancelled, sizeof(cancelled));
+            }
+            AnswerAck(sim);
+            break;
+
+        case MDB_CMD_EXPANSION:
+            HandleExpansion(sim, cmd, length);
+            break;
+
+        default:
+            break; // Unsupported commands get no answer
+    }
+}
+
+static void HandlePoll(MdbSimReader_t* sim, uint32_t now) {
+    if(sim->justReset) {
+        uint8_t justReset[] = {MDBRxCashlessJustReset};
+        sim->justReset = false;
+        AnswerData(sim, justReset, sizeof(justReset));
+        return;
+    }
+
+    // Spontaneous restarts show up as the answer to a POLL
+    if(sim->state >= SIM_ENABLED && Chance(sim, sim->config.faults.justReset)) {
+        sim->stats.resetInjected++;
+        Restart(sim, now);
+        sim->justReset = false;
+        uint8_t justReset[] = {MDBRxCashlessJustReset};
+        AnswerData(sim, justReset, sizeof(justReset));
+        return;
+    }
+
+    // Data the VMC never acknowledged is repeated first
+    if(sim->lastDataLength > 0) {
+        sim->stats.repeats++;
+        AnswerData(sim, sim->lastData, sim->lastDataLength);
+        return;
+    }
+
+    if(sim->eventCount > 0 && (int32_t)(now - sim->events[0].due) >= 0) {
+        MdbSimEvent_t event = sim->events[0];
+        sim->eventCount--;
+        memmove(&sim->events[0], &sim->events[1], sim->eventCount * sizeof(MdbSimEvent_t));
+        AnswerData(sim, event.data, event.length);
+        return;
+    }
+
+    AnswerAck(sim);
+}
+
+static void HandleVend(MdbSimReader_t* sim, const uint8_t* cmd, uint8_t length, uint32_t now) {
+    if(length < 2) {
+        return;
+    }
+
+    switch(cmd[1]) {
+        case MDB_VEND_REQUEST:
+            if(length < 6) {
+                return;
+            }
+            sim->stats.vendRequests++;
+            AnswerAck(sim);
+            if(sim->state != SIM_SESSION || sim->denyNext) {
+                uint8_t denied[] = {MDBRxCashlessVendDenied};
+                sim->denyNext = false;
+                sim->stats.denials++;
+                QueueEvent(sim, now, denied, sizeof(denied));
+            } else {
+                uint8_t approved[] = {MDBRxCashlessVendApproved, cmd[2], cmd[3]};
+                sim->stats.approvals++;
+                sim->state = SIM_VEND;
+                QueueEvent(sim, now + sim->config.approveDelay, approved, sizeof(approved));
+            }
+            break;
+
+        case MDB_VEND_CANCEL: {
+            uint8_t denied[] = {MDBRxCashlessVendDenied};
+            sim->eventCount = 0;
+            if(sim->state == SIM_VEND) {
+                sim->state = SIM_SESSION;
+            }
+            AnswerData(sim, denied, sizeof(denied));
+            break;
+        }
+
+        case MDB_VEND_SUCCESS:
+        case MDB_VEND_FAILURE:
+            if(cmd[1] == MDB_VEND_SUCCESS) {
+                sim->stats.vendSuccesses++;
+            }
+            if(sim->state == SIM_VEND) {
+                sim->state = SIM_SESSION;
+            }
+            AnswerAck(sim);
+            break;
+
+        case MDB_VEND_SESSION_COMPLETE: {
+            uint8_t endSession[] = {MDBRxCashlessEndSession};
+            bool alwaysIdle = (sim->enabledFeatures & MDB_FEATURE_ALWAYS_IDLE) != 0;
+            AnswerAck(sim);
+            if(sim->state >= SIM_SESSION && !alwaysIdle) {
+                sim->state = SIM_ENABLED;
+                QueueEvent(sim, now, endSession, sizeof(endSession));
+            }
+            break;
+        }
+
+        default:
+            break;
+    }
+}
+
+static void HandleExpansion(MdbSimReader_t* sim, const uint8_t* cmd, uint8_t length) {
+    if(length < 2 || sim->config.featureLevel < 2) {
+        return;
+    }
+
+    switch(cmd[1]) {
+        case MDB_EXP_REQUEST_ID: {
+            uint8_t id[34] = {MDBRxCashlessPeripheralId};
+            memcpy(&id[1], "SIM", 3);
+            memcpy(&id[4], "000000000042", 12);
+            memcpy(&id[16], "VIRTUAL-RDR ", 12);
+            id[28] = 0x01;
+            id[29] = 0x00;
+            uint32_t features = sim->config.optionalFeatures;
+            id[30] = features >> 24;
+            id[31] = (features >> 16) & 0xFF;
+            id[32] = (features >> 8) & 0xFF;
+            id[33] = features & 0xFF;
+            AnswerData(sim, id, sim->config.featureLevel >= 3 ? 34 : 30);
+            break;
+        }
+
+        case MDB_EXP_FEATURE_ENABLE:
+            if(length >= 6) {
+                sim->enabledFeatures = (((uint32_t)cmd[2] << 24) | ((uint32_t)cmd[3] << 16) |
+                                        ((uint32_t)cmd[4] << 8) | cmd[5]) & sim->config.optionalFeatures;
+            }
+            AnswerAck(sim);
+            break;
+
+        case MDB_EXP_DIAGNOSTICS: {
+            uint8_t diag[MDB_MAX_MESSAGE_LENGTH - 1] = {MDBRxCashlessDiagnostics};
+            uint8_t echo = length - 2;
+            if(echo > sizeof(diag) - 1) {
+                echo = sizeof(diag) - 1;
+            }
+            memcpy(&diag[1], &cmd[2], echo);
+            AnswerData(sim, diag, echo + 1);
+            break;
+        }
+
+        default:
+            break;
+    }
+}
+
+// Power-on state; the restart is timed until the VMC enables us again
+static void Restart(MdbSimReader_t* sim, uint32_t now) {
+    sim->state = SIM_INACTIVE;
+    sim->justReset = true;
+    sim->eventCount = 0;
+    sim->lastDataLength = 0;
+    sim->enabledFeatures = 0;
+    if(sim->faultTime == 0) {
+        sim->faultTime = now ? now : 1;
+    }
+}
+
+static void QueueEvent(MdbSimReader_t* sim, uint32_t due, const uint8_t* data, uint8_t length) {
+    if(sim->eventCount >= SIM_EVENT_QUEUE) {
+        return;
+    }
+    MdbSimEvent_t* event = &sim->events[sim->eventCount++];
+    event->due = due;
+    memcpy(event->data, data, length);
+    event->length = length;
+}
+
+static void AnswerAck(MdbSimReader_t* sim) {
+    sim->out[0] = MDB_ACK | MDB_MODE_BIT;
+    sim->outLength = 1;
+}
+
+static void AnswerNak(MdbSimReader_t* sim) {
+    sim->out[0] = MDB_NAK | MDB_MODE_BIT;
+    sim->outLength = 1;
+}
+
+// Data stays pending until the VMC ACKs it
+static void AnswerData(MdbSimReader_t* sim, const uint8_t* data, uint8_t length) {
+    uint8_t sum = 0;
+    if(data != sim->lastData) {
+        memcpy(sim->lastData, data, length);
+        sim->lastDataLength = length;
+    }
+    for(uint8_t i = 0; i < length; i++) {
+        sim->out[i] = data[i];
+        sum += data[i];
+    }
+
+    if(sim->corruptNext || Chance(sim, sim->config.faults.corrupt)) {
+        sim->corruptNext = false;
+        sim->stats.corruptInjected++;
+        sum ^= 0x5A;
+    }
+    sim->out[length] = sum | MDB_MODE_BIT;
+    sim->outLength = length + 1;
+}
+
+static bool Chance(MdbSimReader_t* sim, uint16_t perTenThousand) {
+    return perTenThousand != 0 && NextRandom(sim) % 10000 < perTenThousand;
+}
+
+// xorshift32, one stream per reader so runs are reproducible
+static uint32_t NextRandom(MdbSimReader_t* sim) {
+    sim->rng ^= sim->rng << 13;
+    sim->rng ^= sim->rng >> 17;
+    sim->rng ^= sim->rng << 5;
+    return sim->rng;
+}
@@ -0,0 +1,126 @@
+// mdbsimreader.h
+// Simulated cashless reader for host runs of the driver. Plugs into the
+// driver through MDB_SetTransport.
+#ifndef __MdbSimReader_h
+#define __MdbSimReader_h
+
+#include "MDB.h"
+
+#define SIM_EVENT_QUEUE   8
+#define SIM_FRAME_WORDS   (MDB_MAX_MESSAGE_LENGTH + 1)
+
+typedef enum {
+    SIM_STEP_CARD,           // value: funds, reported as BEGIN SESSION
+    SIM_STEP_DENY_NEXT,      // Next VEND REQUEST is denied
+    SIM_STEP_APPROVE_DELAY,  // value: ms from VEND REQUEST to VEND APPROVED
+    SIM_STEP_JUST_RESET,     // Reader restarts by itself
+    SIM_STEP_SILENT,         // value: ms without any answer, then a restart
+    SIM_STEP_NAK_NEXT,       // Next command is NAKed
+    SIM_STEP_CORRUPT_NEXT,   // Next data response has a bad checksum
+    SIM_STEP_DROP_NEXT,      // Next response loses one word
+    SIM_STEP_LATE_NEXT       // Next response misses the response timeout
+} MdbSimAction_t;
+
+typedef struct {
+    uint32_t at;             // Tick at which the step fires
+    MdbSimAction_t action;
+    uint32_t value;
+} MdbSimStep_t;
+
+// Random fault rates, per 10000 commands (justReset: per 10000 POLLs)
+typedef struct {
+    uint16_t nak;
+    uint16_t corrupt;
+    uint16_t drop;
+    uint16_t late;
+    uint16_t justReset;
+} MdbSimFaults_t;
+
+typedef struct {
+    uint8_t featureLevel;
+    uint8_t scaleFactor;
+    uint8_t miscOptions;
+    uint32_t optionalFeatures;   // Offered in PERIPHERAL ID, level 3
+    uint32_t responseDelay;      // ms before the first word of any answer
+    uint32_t wordTime;           // us on the wire per 11-bit word, virtual time only
+    uint32_t interByteGap;       // us idle between the words of an answer, virtual time only
+    uint32_t approveDelay;       // ms from VEND REQUEST to VEND APPROVED
+    uint32_t cardInterval;       // ms between automatic card presentations, 0 off
+    uint32_t cardFunds;
+    uint32_t seed;
+    MdbSimFaults_t faults;
+    const MdbSimStep_t* script;
+    uint16_t scriptLength;
+} MdbSimConfig_t;
+
+typedef struct {
+    uint32_t commands;
+    uint32_t polls;
+    uint32_t resets;
+    uint32_t sessions;
+    uint32_t vendRequests;
+    uint32_t approvals;
+    uint32_t denials;
+    uint32_t vendSuccesses;
+    uint32_t retRequests;
+    uint32_t repeats;            // Data resent because the VMC did not ACK
+    uint32_t nakInjected;
+    uint32_t corruptInjected;
+    uint32_t dropInjected;
+    uint32_t lateInjected;
+    uint32_t resetInjected;
+    uint32_t silentInjected;
+    uint32_t recoveries;         // Reader restarts the VMC brought back to enabled
+    uint64_t recoveryTotal;      // ms from restart to READER ENABLE
+    uint32_t recoveryMax;
+} MdbSimStats_t;
+
+typedef enum {
+    SIM_INACTIVE,
+    SIM_DISABLED,
+    SIM_ENABLED,
+    SIM_SESSION,
+    SIM_VEND
+} MdbSimState_t;
+
+typedef struct {
+    uint32_t due;
+    uint8_t data[MDB_MAX_MESSAGE_LENGTH];
+    uint8_t length;
+} MdbSimEvent_t;
+
+typedef struct {
+    MdbSimConfig_t config;
+    MdbSimStats_t stats;
+    MdbSimState_t state;
+    uint32_t rng;
+    uint16_t scriptIndex;
+    uint32_t enabledFeatures;
+    bool justReset;
+    bool denyNext;
+    bool nakNext;
+    bool corruptNext;
+    bool dropNext;
+    bool lateNext;
+    uint32_t silentUntil;
+    uint32_t faultTime;          // Restart not yet recovered from, 0 none
+    uint32_t nextCard;
+
+    MdbSimEvent_t events[SIM_EVENT_QUEUE];
+    uint8_t eventCount;
+
+    uint8_t lastData[MDB_MAX_MESSAGE_LENGTH];  // Unacknowledged data response
+    uint8_t lastDataLength;
+
+    uint16_t out[SIM_FRAME_WORDS];             // Answer being read by the VMC
+    uint8_t outLength;
+    uint8_t outIndex;
+    bool outLate;
+} MdbSimReader_t;
+
+void MdbSimInit(MdbSimReader_t* sim, const MdbSimConfig_t* config);
+MDB_Transport_t MdbSimTransport(MdbSimReader_t* sim);
+void MdbSimPresentCard(MdbSimReader_t* sim, uint32_t funds);
+uint32_t MdbSimNextEvent(const MdbSimReader_t* sim, uint32_t now);
+
+#endif
@@ -0,0 +1,102 @@
+// mdbuplink.c
+// Host settlement uplinks for testing store-and-forward without a modem.
+//
+// The file uplink appends every accepted batch to one file, and a second
+// marker file simulates an outage: while it exists isUp reports the link
+// down and batches stay queued on the device side. The UDP uplink sends
+// each batch as one datagram; a send error counts as a failed attempt.
+
+#include "MdbUplink.h"
+#include <stdlib.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/socket.h>
+
+// Private function declarations
+static bool FileIsUp(void* context);
+static bool FileSend(void* context, const uint8_t* data, uint16_t length);
+static bool UdpSend(void* context, const uint8_t* data, uint16_t length);
+
+MDB_SettleUplink_t MdbFileUplink(MdbFileUplink_t* file) {
+    MDB_SettleUplink_t uplink = { .isUp = FileIsUp, .send = FileSend, .context = file };
+    return uplink;
+}
+
+bool MdbUdpUplinkOpen(MdbUdpUplink_t* udp, const char* host, uint16_t port) {
+    udp->socket = socket(AF_INET, SOCK_DGRAM, 0);
+    udp->host = host;
+    udp->port = port;
+    return udp->socket >= 0;
+}
+
+MDB_SettleUplink_t MdbUdpUplink(MdbUdpUplink_t* udp) {
+    MDB_SettleUplink_t uplink = { .isUp = NULL, .send = UdpSend, .context = udp };
+    return uplink;
+}
+
+int MdbUplinkDecode(const uint8_t* data, size_t length,
+                    void (*handler)(const MDB_TransactionLog_t* record, void* context), void* context) {
+    size_t offset = 0;
+    int batches = 0;
+
+    while(offset + sizeof(MDB_SettleBatchHeader_t) <= length) {
+        MDB_SettleBatchHeader_t header;
+        memcpy(&header, data + offset, sizeof(header));
+        offset += sizeof(header);
+
+        if(header.magic != MDB_SETTLE_MAGIC || offset + header.payloadLength > length ||
+           header.crc != MDB_Crc32(data + offset, header.payloadLength)) {
+            return -1;
+        }
+
+        const uint8_t* payload = data + offset;
+        uint16_t used = 0;
+        uint32_t previousTimestamp = 0;
+        for(uint16_t i = 0; i < header.count; i++) {
+            MDB_TransactionLog_t record;
+            uint16_t remaining = header.payloadLength - used;
+            uint8_t n = MDB_UnpackTransaction(&payload[used], remaining > 255 ? 255 : (uint8_t)remaining,
+                                              previousTimestamp, &record);
+            if(n == 0) {
+                return -1;
+            }
+            used += n;
+            previousTimestamp = record.timestamp;
+            handler(&record, context);
+        }
+
+        offset += header.payloadLength;
+        batches++;
+    }
+    return offset == length ? batches : -1;
+}
+
+static bool FileIsUp(void* context) {
+    MdbFileUplink_t* file = (MdbFileUplink_t*)context;
+    return file->downPath == NULL || access(file->downPath, F_OK) != 0;
+}
+
+static bool FileSend(void* context, const uint8_t* data, uint16_t length) {
+    MdbFileUplink_t* file = (MdbFileUplink_t*)context;
+    FILE* out = fopen(file->path, "ab");
+    if(out == NULL) {
+        return false;
+    }
+    bool ok = fwrite(data, 1, length, out) == length;
+    return fclose(out) == 0 && ok;
+}
+
+static bool UdpSend(void* context, const uint8_t* data, uint16_t length) {
+    MdbUdpUplink_t* udp = (MdbUdpUplink_t*)context;
+    struct addrinfo hints = { .ai_family = AF_INET, .ai_socktype = SOCK_DGRAM };
+    struct addrinfo* address;
+    char port[8];
+
+    snprintf(port, sizeof(port), "%u", udp->port);
+    if(getaddrinfo(udp->host, port, &hints, &address) != 0) {
+        return false;
+    }
+    bool ok = sendto(udp->socket, data, length, 0, address->ai_addr, address->ai_addrlen) == length;
+    freeaddrinfo(address);
+    return ok;
+}
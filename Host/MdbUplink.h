@@ -0,0 +1,29 @@
+// mdbuplink.h
+// Host stand-ins for the settlement uplink: append batches to a file or
+// send them as UDP datagrams.
+#ifndef __MdbUplink_h
+#define __MdbUplink_h
+
+#include "MDB.h"
+
+typedef struct {
+    const char* path;       // Batches are appended here
+    const char* downPath;   // Link reads as down while this file exists, may be NULL
+} MdbFileUplink_t;
+
+typedef struct {
+    int socket;
+    const char* host;
+    uint16_t port;
+} MdbUdpUplink_t;
+
+MDB_SettleUplink_t MdbFileUplink(MdbFileUplink_t* file);
+bool MdbUdpUplinkOpen(MdbUdpUplink_t* udp, const char* host, uint16_t port);
+MDB_SettleUplink_t MdbUdpUplink(MdbUdpUplink_t* udp);
+
+// Walks a batch stream, calling handler for each settled transaction.
+// Returns the number of batches, or -1 on the first corrupt batch.
+int MdbUplinkDecode(const uint8_t* data, size_t length,
+                    void (*handler)(const MDB_TransactionLog_t* record, void* context), void* context);
+
+#endif
@@ -2,7 +2,11 @@
 #ifndef __MDB_h
 #define __MDB_h
 
+#ifdef MDB_HOST_BUILD
+#include "MdbHostHal.h"
+#else
 #include "stm32f7xx_hal.h"
+#endif
 #include <stdint.h>
 #include <stdbool.h>
 #include <string.h>
@@ -29,6 +33,13 @@ typedef enum {
     LOG_DEBUG
 } MDB_LogLevel_t;
 
+// Compile-time log threshold: 0 none, 1 error, 2 warning, 3 info, 4 debug.
+// Calls more verbose than this compile to nothing, arguments included;
+// currentLogLevel still filters the remaining levels at runtime.
+#ifndef MDB_LOG_LEVEL_MIN
+#define MDB_LOG_LEVEL_MIN        4
+#endif
+
 // Error Codes
 typedef enum {
     MDB_ERR_NONE = 0,
@@ -43,10 +54,19 @@ typedef enum {
     MDB_ERR_HARDWARE
 } MDB_Error_t;
 
+// Circuit Breaker States
+typedef enum {
+    MDB_BREAKER_CLOSED,     // Normal operation, resets allowed
+    MDB_BREAKER_OPEN,       // Peripheral quarantined until backoff expires
+    MDB_BREAKER_HALF_OPEN   // Single trial reset in progress
+} MDB_BreakerState_t;
+
 // MDB Commands
 #define MDB_ACK                  0x00
 #define MDB_NAK                  0xFF
 #define MDB_RET                  0xAA
+#define MDB_MODE_BIT             0x100 // Ninth bit: VMC address byte, last byte of a peripheral frame
+#define MDB_ADDRESS_MASK         0xF8  // Address bits of the first command byte
 
 #define MDB_CMD_RESET           0x10
 #define MDB_CMD_SETUP           0x11
@@ -56,18 +76,328 @@ typedef enum {
 #define MDB_CMD_REVALUE         0x15
 #define MDB_CMD_EXPANSION       0x17
 
+// EXPANSION Subcommands
+#define MDB_EXP_REQUEST_ID       0x00
+#define MDB_EXP_FEATURE_ENABLE   0x04
+#define MDB_EXP_DIAGNOSTICS      0xFF
+
+// Optional Features, level 3 Peripheral ID and OPTIONAL FEATURE ENABLE
+#define MDB_FEATURE_FILE_TRANSPORT 0x00000001
+#define MDB_FEATURE_MONETARY_32    0x00000002
+#define MDB_FEATURE_MULTI_CURRENCY 0x00000004
+#define MDB_FEATURE_NEGATIVE_VEND  0x00000008
+#define MDB_FEATURE_DATA_ENTRY     0x00000010
+#define MDB_FEATURE_ALWAYS_IDLE    0x00000020
+
+// VEND Subcommands
+#define MDB_VEND_REQUEST         0x00
+#define MDB_VEND_CANCEL          0x01
+#define MDB_VEND_SUCCESS         0x02
+#define MDB_VEND_FAILURE         0x03
+#define MDB_VEND_SESSION_COMPLETE 0x04
+
+// READER Subcommands
+#define MDB_READER_DISABLE       0x00
+#define MDB_READER_ENABLE        0x01
+#define MDB_READER_CANCEL        0x02
+
+// Reader Config Miscellaneous Options
+#define MDB_READER_OPT_REFUNDS   0x01 // Level 2+, reader can restore funds
+#define MDB_READER_OPT_MULTIVEND 0x02 // Level 2+, several vends per session
+
+// Cashless Responses
+#define MDBRxCashlessJustReset       0x00
+#define MDBRxCashlessReaderConfig    0x01
+#define MDBRxCashlessDisplayRequest  0x02
+#define MDBRxCashlessBeginSession    0x03
+#define MDBRxCashlessSessionCancel   0x04
+#define MDBRxCashlessVendApproved    0x05
+#define MDBRxCashlessVendDenied      0x06
+#define MDBRxCashlessEndSession      0x07
+#define MDBRxCashlessCancelled       0x08
+#define MDBRxCashlessPeripheralId    0x09
+#define MDBRxCashlessMalfunction     0x0A
+#define MDBRxCashlessOutOfSequence   0x0B
+#define MDBRxCashlessRevalueApproved 0x0D
+#define MDBRxCashlessRevalueDenied   0x0E
+#define MDBRxCashlessDiagnostics     0xFF
+
+// Coin Changer Commands, address 0x08
+#define MDB_COIN_RESET           0x08
+#define MDB_COIN_SETUP           0x09
+#define MDB_COIN_TUBE_STATUS     0x0A
+#define MDB_COIN_POLL            0x0B
+#define MDB_COIN_TYPE            0x0C
+#define MDB_COIN_DISPENSE        0x0D
+#define MDB_COIN_EXPANSION       0x0F
+
+// Coin Changer EXPANSION Subcommands
+#define MDB_COIN_EXP_IDENTIFICATION  0x00
+#define MDB_COIN_EXP_FEATURE_ENABLE  0x01
+#define MDB_COIN_EXP_PAYOUT          0x02 // Level 3 alternative payout, value in scale units
+#define MDB_COIN_EXP_PAYOUT_STATUS   0x03
+#define MDB_COIN_EXP_PAYOUT_POLL     0x04
+#define MDB_COIN_EXP_DIAGNOSTICS     0x05
+
+// Coin Changer Optional Features, level 3 IDENTIFICATION
+#define MDB_COIN_FEATURE_ALT_PAYOUT     0x00000001
+#define MDB_COIN_FEATURE_EXT_DIAG       0x00000002
+#define MDB_COIN_FEATURE_MANUAL_FILL    0x00000004
+#define MDB_COIN_FEATURE_FILE_TRANSPORT 0x00000008
+
+// Coin Changer POLL activity, first byte of each entry
+#define MDB_COIN_ACT_DISPENSED   0x80 // 1nnntttt tubeCount: manual dispense
+#define MDB_COIN_ACT_DEPOSITED   0x40 // 01rrtttt tubeCount: coin accepted or rejected
+#define MDB_COIN_ACT_SLUG        0x20 // 001nnnnn: slugs since last POLL
+#define MDB_COIN_ROUTE_CASHBOX   0x00
+#define MDB_COIN_ROUTE_TUBES     0x01
+#define MDB_COIN_ROUTE_REJECT    0x03
+#define MDB_COIN_TOKEN           0xFF // Coin type credit of a token
+
+// Coin Changer POLL status, 0000xxxx
+#define MDBRxCoinEscrowRequest       0x01
+#define MDBRxCoinPayoutBusy          0x02
+#define MDBRxCoinNoCredit            0x03
+#define MDBRxCoinTubeSensor          0x04
+#define MDBRxCoinDoubleArrival       0x05
+#define MDBRxCoinAcceptorUnplugged   0x06
+#define MDBRxCoinTubeJam             0x07
+#define MDBRxCoinRomChecksum         0x08
+#define MDBRxCoinRoutingError        0x09
+#define MDBRxCoinChangerBusy         0x0A
+#define MDBRxCoinJustReset           0x0B
+#define MDBRxCoinJam                 0x0C
+#define MDBRxCoinRemoval             0x0D
+
 // Timing Constants
 #define MDB_RESPONSE_TIMEOUT     5    // 5ms
 #define MDB_INTERBYTE_TIMEOUT    1    // 1ms
 #define MDB_NON_RESPONSE_TIMEOUT 5000 // 5sec
 #define MDB_RESET_HOLD_TIME      100  // 100ms
+#define MDB_WORD_TIME_US         1146 // 11 bits at 9600 baud
+#ifndef MDB_POLL_INTERVAL
 #define MDB_POLL_INTERVAL        200  // 200ms
+#endif
+
+// Recovery Constants
+#define MDB_NAK_RETRIES          3     // Resends of a NAKed command before recovery
+#define MDB_BREAKER_TRIP_COUNT   5     // Failures within window to open breaker
+#define MDB_BREAKER_WINDOW       5000  // 5sec
+#define MDB_BREAKER_BACKOFF_MIN  500   // 500ms
+#define MDB_BREAKER_BACKOFF_MAX  60000 // 60sec
 
 // Buffer Sizes
 #define MDB_MAX_MESSAGE_LENGTH   36
 #define MDB_QUEUE_SIZE          10
+#define MDB_MULTIVEND_QUEUE      4    // Vend requests waiting behind the current one
 #define MDB_TRANSACTION_LOG_SIZE 50
 #define MDB_ERROR_LOG_SIZE      50
+#define MDB_PACKED_TRANSACTION_MAX 19 // Worst case packed transaction bytes
+
+// Deferred Logging
+#ifndef MDB_LOG_DEFERRED
+#define MDB_LOG_DEFERRED         0    // 1 = binary records, formatted on host
+#endif
+#define MDB_DEFERRED_LOG_SIZE    128  // Records, power of two
+#define MDB_DEFERRED_LOG_ARGS    3
+#define MDB_LOG_FILE_MAGIC       0x4C42444D // "MDBL"
+#define MDB_LOG_FILE_VERSION     2
+
+// Log Sink
+#define MDB_LOG_SINK_NONE        0
+#define MDB_LOG_SINK_UART_DMA    1    // Second UART, drained by DMA
+#define MDB_LOG_SINK_ITM         2    // Cortex-M7 ITM stimulus port 0 / SWO
+#define MDB_LOG_SINK_STDIO       3    // Host builds
+#ifndef MDB_LOG_SINK
+#ifdef MDB_HOST_BUILD
+#define MDB_LOG_SINK             MDB_LOG_SINK_STDIO
+#else
+#define MDB_LOG_SINK             MDB_LOG_SINK_UART_DMA
+#endif
+#endif
+#ifndef MDB_LOG_UART
+#define MDB_LOG_UART             huart3
+#endif
+#define MDB_LOG_SINK_SIZE        2048 // Bytes, power of two
+#define MDB_LOG_LINE_LENGTH      96
+#define MDB_LOG_ITM_BUDGET       64   // Bytes per service call
+
+// Reserved Flash. The journal and the config cache write to sectors of
+// application flash, so the linker script must keep the image out of them
+// before either is enabled. With the defaults below that is sector 3
+// (0x08018000-0x0801FFFF) and sectors 6-7 (0x08080000-0x080FFFFF), plus
+// 256KB per extra journal sector, e.g.
+//   FLASH      (rx) : ORIGIN = 0x08000000, LENGTH = 96K
+//   FLASH_APP  (rx) : ORIGIN = 0x08020000, LENGTH = 384K
+// with no output section placed at 0x08018000 or above 0x08080000. Define
+// MDB_FLASH_RESERVED to 1 once the linker script does this.
+#ifndef MDB_FLASH_RESERVED
+#define MDB_FLASH_RESERVED       0
+#endif
+
+// Flash Journal, sectors must be equally sized and consecutive. A 256KB
+// sector holds 8191 records of 32 bytes after its header. The oldest
+// sector is erased when the journal wraps, so (count - 1) full sectors
+// of history are always kept: 8191 records with the default two.
+#ifndef MDB_JOURNAL_ENABLE
+#ifdef MDB_HOST_BUILD
+#define MDB_JOURNAL_ENABLE       0
+#else
+#define MDB_JOURNAL_ENABLE       MDB_FLASH_RESERVED
+#endif
+#endif
+#define MDB_JOURNAL_SECTOR_FIRST 6          // FLASH_SECTOR_6
+#ifndef MDB_JOURNAL_SECTOR_COUNT
+#define MDB_JOURNAL_SECTOR_COUNT 2          // Sectors 8-11 follow on 2MB parts
+#endif
+#define MDB_JOURNAL_SECTOR_SIZE  0x40000    // 256KB
+#define MDB_JOURNAL_BASE_ADDR    0x08080000 // Address of MDB_JOURNAL_SECTOR_FIRST
+#define MDB_JOURNAL_BATCH        8          // Records per program cycle
+#define MDB_JOURNAL_FLUSH_INTERVAL 5000     // 5sec, max age of a partial batch
+#define MDB_JOURNAL_MAGIC        0x4A42444D // "MDBJ"
+
+// Vend Write-Ahead Journal
+#ifndef MDB_VEND_JOURNAL_BKPSRAM
+#ifdef MDB_HOST_BUILD
+#define MDB_VEND_JOURNAL_BKPSRAM 0    // .noinit RAM, survives reset only
+#else
+#define MDB_VEND_JOURNAL_BKPSRAM 1    // Backup SRAM, survives power loss on VBAT
+#endif
+#endif
+#define MDB_VEND_JOURNAL_MAGIC   0x5742444D // "MDBW"
+
+// Settlement Queue, forwarded to the uplink in packed batches
+#ifndef MDB_SETTLE_ENABLE
+#define MDB_SETTLE_ENABLE        1
+#endif
+#define MDB_SETTLE_QUEUE_SIZE    64         // Records, power of two
+#define MDB_SETTLE_BATCH         8          // Records per uplink message
+#define MDB_SETTLE_INTERVAL      60000      // 60sec, max age of a partial batch
+#define MDB_SETTLE_RETRY         30000      // 30sec between attempts while the link is down
+#define MDB_SETTLE_WARN_INTERVAL 60000      // 60sec between queue full warnings
+#define MDB_SETTLE_BKPSRAM_OFFSET 0x100     // Behind the vend journal when in backup SRAM
+#define MDB_SETTLE_MAGIC         0x5342444D // "MDBS"
+#define MDB_SETTLE_BATCH_MAX     (sizeof(MDB_SettleBatchHeader_t) + MDB_SETTLE_BATCH * MDB_PACKED_TRANSACTION_MAX)
+
+// Driver instance selection is per thread on host builds
+#ifdef MDB_HOST_BUILD
+#define MDB_INSTANCE_LOCAL       _Thread_local
+#else
+#define MDB_INSTANCE_LOCAL
+#endif
+
+// Stage Trace, timestamps each frame on its way through the driver
+#ifndef MDB_STAGE_TRACE
+#define MDB_STAGE_TRACE          0    // 1 = call MDB_StageHook, supplied by the application
+#endif
+
+// Bus Trace, every frame on the bus with its direction and time in us
+#ifndef MDB_BUS_TRACE
+#define MDB_BUS_TRACE            0    // 1 = capture into a RAM ring, see MDB_ExportBusTrace
+#endif
+#ifndef MDB_BUS_TRACE_SIZE
+#define MDB_BUS_TRACE_SIZE       4096 // Bytes, power of two
+#endif
+#define MDB_TRACE_FILE_MAGIC     0x5442444D // "MDBT"
+#define MDB_TRACE_FILE_VERSION   1
+
+// Bus Timing Monitor, every answer measured against the MDB limits
+#ifndef MDB_TIMING_MONITOR
+#define MDB_TIMING_MONITOR       0    // 1 = histograms and compliance flag, see MDB_GetTimingStats
+#endif
+#define MDB_T_RESPONSE_US        5000 // Spec limit, end of command to first answer word
+#define MDB_T_INTERBYTE_US       1000 // Spec limit between the words of one answer
+#define MDB_TIMING_MARGIN_PCT    80   // Samples past this share of a limit are marginal
+#define MDB_TIMING_FLAG_MIN      100  // Samples before a reader can be flagged marginal
+#define MDB_TIMING_FLAG_PERMILLE 10   // Marginal share that flags the reader
+#define MDB_HISTOGRAM_SUB_BITS   3    // 8 linear steps per power of two, 12.5% resolution
+#define MDB_HISTOGRAM_BUCKETS    112  // 1 us steps to 8 us, last bucket from 61.4 ms
+
+// Profiling, cycle counts of the hot paths
+#ifndef MDB_PROFILE
+#define MDB_PROFILE              0    // 1 = count cycles, see MDB_GetProfile
+#endif
+
+// Coin Changer, polled by MDB_Poll in the cashless poll slot
+#ifndef MDB_COIN_ENABLE
+#define MDB_COIN_ENABLE          0    // 1 = coin changer at 0x08 on the same bus
+#endif
+#define MDB_COIN_TYPES           16
+#define MDB_COIN_RETRY_INTERVAL  2000 // ms between resets of a missing changer
+#define MDB_COIN_DISPENSE_MAX    15   // Coins of one type per DISPENSE
+#ifndef MDB_VMC_COIN_FEATURES
+#define MDB_VMC_COIN_FEATURES    MDB_COIN_FEATURE_ALT_PAYOUT // Optional features this VMC handles
+#endif
+
+// Warm-Boot Configuration Cache
+#ifndef MDB_CONFIG_CACHE_ENABLE
+#ifdef MDB_HOST_BUILD
+#define MDB_CONFIG_CACHE_ENABLE  0
+#else
+#define MDB_CONFIG_CACHE_ENABLE  MDB_FLASH_RESERVED
+#endif
+#endif
+#define MDB_CONFIG_CACHE_SECTOR  3          // FLASH_SECTOR_3
+#define MDB_CONFIG_CACHE_ADDR    0x08018000 // Address of MDB_CONFIG_CACHE_SECTOR
+#define MDB_CONFIG_CACHE_SIZE    0x8000     // 32KB
+
+#if (MDB_JOURNAL_ENABLE || MDB_CONFIG_CACHE_ENABLE) && !MDB_FLASH_RESERVED && !defined(MDB_HOST_BUILD)
+#error "Journal and config cache erase application flash, reserve their sectors and define MDB_FLASH_RESERVED"
+#endif
+#define MDB_CONFIG_CACHE_SLOT    64
+#define MDB_CONFIG_CACHE_MAGIC   0x4342444D // "MDBC"
+
+// VMC Identity, sent with EXPANSION REQUEST ID
+#define MDB_VMC_MANUFACTURER     "BYT"
+#define MDB_VMC_SERIAL           "000000000001"
+#define MDB_VMC_MODEL            "MDB-STM32F7 "
+#define MDB_VMC_SW_VERSION       0x0100
+#ifndef MDB_VMC_FEATURES
+#define MDB_VMC_FEATURES         MDB_FEATURE_ALWAYS_IDLE // Optional features this VMC handles
+#endif
+
+// Log Message Catalog: X(id, argc, format)
+// Hot-path messages are logged by ID so deferred builds store raw argument
+// words only. Arguments are 32-bit words, formats must not use %l or %f.
+#define MDB_LOG_CATALOG(X) \
+    X(MDB_MSG_RESET_START,        0, "Performing reset...") \
+    X(MDB_MSG_RESET_COMPLETE,     0, "Reset complete") \
+    X(MDB_MSG_PROCESSING,         1, "Processing message: command=0x%02X") \
+    X(MDB_MSG_DUPLICATE_DROPPED,  1, "Duplicate response dropped: command=0x%02X") \
+    X(MDB_MSG_RET_DUPLICATE,      0, "RET answered with already processed response") \
+    X(MDB_MSG_UNKNOWN_COMMAND,    1, "Unknown command received: 0x%02X") \
+    X(MDB_MSG_SESSION_TIMEOUT,    0, "Session timeout") \
+    X(MDB_MSG_RETRYING,           1, "Retrying command, attempt %u") \
+    X(MDB_MSG_MAX_RETRIES,        0, "Max retries exceeded") \
+    X(MDB_MSG_COMM_TIMEOUT,       0, "Communication timeout") \
+    X(MDB_MSG_CHECKSUM_ERROR,     0, "Checksum error") \
+    X(MDB_MSG_INVALID_STATE,      0, "Invalid state transition") \
+    X(MDB_MSG_SEQUENCE_ERROR,     0, "Command sequence error") \
+    X(MDB_MSG_INSUFFICIENT_FUNDS, 0, "Insufficient funds") \
+    X(MDB_MSG_HARDWARE_ERROR,     0, "Hardware error detected") \
+    X(MDB_MSG_COMM_ERROR,         0, "Communication error") \
+    X(MDB_MSG_UNKNOWN_ERROR,      1, "Unknown error: %d") \
+    X(MDB_MSG_BREAKER_TRIPPED,    0, "Too many errors, opening circuit breaker") \
+    X(MDB_MSG_BREAKER_OPEN,       1, "Circuit open, next reset attempt in %u ms") \
+    X(MDB_MSG_BREAKER_HALF_OPEN,  0, "Circuit half-open, trial reset") \
+    X(MDB_MSG_BREAKER_CLOSED,     0, "Circuit closed") \
+    X(MDB_MSG_VEND_REQUEST,       2, "Vend request: item=%u amount=%u") \
+    X(MDB_MSG_VEND_APPROVED,      1, "Vend approved: amount=%u") \
+    X(MDB_MSG_UNEXPECTED_RESET,   0, "Reader reported JUST RESET, setup lost") \
+    X(MDB_MSG_ERROR_RECORDED,     1, "Error recorded: code=%u") \
+    X(MDB_MSG_TIMING_MARGINAL,    2, "Reader timing near MDB limits: response max=%u us, gap max=%u us") \
+    X(MDB_MSG_COIN_READY,         2, "Coin changer ready: level=%u scale=%u") \
+    X(MDB_MSG_COIN_LOST,          0, "Coin changer not responding") \
+    X(MDB_MSG_COIN_STATUS,        1, "Coin changer status 0x%02X") \
+    X(MDB_MSG_COIN_DEPOSIT,       2, "Coin deposited: type=%u value=%u") \
+    X(MDB_MSG_COIN_PAYOUT,        2, "Coin payout done: paid=%u short=%u")
+
+#define MDB_LOG_CATALOG_ID(id, argc, format) id,
+
+typedef enum {
+    MDB_LOG_CATALOG(MDB_LOG_CATALOG_ID)
+    MDB_MSG_COUNT
+} MDB_LogId_t;
 
 // Transaction Types
 typedef enum {
@@ -78,6 +408,15 @@ typedef enum {
     TRANS_NEGATIVE_VEND
 } MDB_TransactionType_t;
 
+// Vend Journal States
+typedef enum {
+    MDB_VEND_JOURNAL_IDLE,
+    MDB_VEND_JOURNAL_REQUESTED,  // VEND REQUEST about to be sent
+    MDB_VEND_JOURNAL_APPROVED,   // VEND APPROVED received, product may dispense
+    MDB_VEND_JOURNAL_SUCCEEDED,  // VEND SUCCESS about to be sent
+    MDB_VEND_JOURNAL_FAILED      // VEND FAILURE about to be sent
+} MDB_VendJournalState_t;
+
 // Structure Definitions
 typedef struct {
     uint8_t featureLevel;
@@ -87,8 +426,84 @@ typedef struct {
     uint16_t maxPrice;
     uint16_t minPrice;
     uint8_t miscOptions;
+    uint32_t optionalFeatures;  // Enabled with OPTIONAL FEATURE ENABLE
 } MDB_Config_t;
 
+typedef enum {
+    MDB_COIN_INACTIVE,      // Not set up, RESET goes out on the next poll slot
+    MDB_COIN_RESETTING,     // RESET ACKed, waiting for JUST RESET
+    MDB_COIN_DISABLED,      // Set up, no coin type accepted
+    MDB_COIN_ENABLED,
+    MDB_COIN_PAYOUT         // Paying out, deposits still counted
+} MDB_CoinState_t;
+
+// Coin changer as set up by the driver; values are in scale units unless
+// noted, amounts in the smallest currency unit like the cashless side
+typedef struct {
+    MDB_CoinState_t state;
+    uint8_t featureLevel;
+    uint16_t countryCode;
+    uint8_t scaleFactor;
+    uint8_t decimalPlaces;
+    uint16_t tubeRouting;               // Coin types that can go to a tube
+    uint8_t coinValue[MDB_COIN_TYPES];  // MDB_COIN_TOKEN for tokens
+    uint16_t tubeFull;
+    uint8_t tubeCount[MDB_COIN_TYPES];
+    uint16_t acceptedCoins;             // Last COIN TYPE, restored after a changer reset
+    uint32_t optionalFeatures;          // Offered in IDENTIFICATION
+    uint32_t enabledFeatures;
+    uint32_t credit;                    // Amount deposited and not yet taken
+    uint32_t payoutPending;             // Amount still to pay out
+    uint32_t payoutPaid;                // Amount paid by the current payout
+    uint32_t payoutShort;               // Amount the last payout could not pay
+    uint8_t payoutRequested;            // Scale units of the outstanding alternative PAYOUT
+    bool payoutBusy;                    // Changer still paying a DISPENSE or PAYOUT
+    bool escrowRequest;                 // Escrow lever pressed, cleared by MDB_CoinPayout
+    uint8_t lastStatus;
+    uint32_t coinsAccepted;
+    uint32_t coinsRejected;
+    uint32_t tokens;
+    uint32_t slugs;
+    uint32_t busErrors;                 // Kept out of MDB_GetErrorCount, which is the reader's
+    uint32_t lastResponseTime;
+    uint32_t retryTime;
+} MDB_CoinChanger_t;
+
+typedef struct {
+    char manufacturer[3];
+    char serialNumber[12];
+    char modelNumber[12];
+    uint16_t softwareVersion;
+    uint32_t optionalFeatures;  // Offered by level 3 readers
+} MDB_PeripheralId_t;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t sequence;
+    MDB_Config_t config;
+    MDB_PeripheralId_t peripheral;
+    uint32_t crc;
+} MDB_ConfigCache_t;
+
+// Written before every vend step, two copies so a torn write is survivable
+typedef struct {
+    uint32_t magic;
+    uint32_t sequence;
+    uint32_t transactionId;
+    MDB_VendJournalState_t state;
+    uint32_t amount;
+    uint16_t itemNumber;
+    uint32_t timestamp;
+    MDB_Config_t config;
+    MDB_PeripheralId_t peripheral;  // Reader the config was negotiated with
+    uint32_t crc;
+} MDB_VendJournal_t;
+
+typedef struct {
+    uint16_t itemNumber;
+    uint32_t amount;
+} MDB_PendingVend_t;
+
 typedef struct {
     MDB_State_t state;
     uint32_t availableFunds;
@@ -96,8 +511,14 @@ typedef struct {
     uint16_t itemNumber;
     bool multivend;
     bool refundable;
+    bool alwaysIdle;        // Session stays open, vends need no BEGIN SESSION
     uint32_t sessionTimeout;
     MDB_TransactionType_t transType;
+    uint32_t transactionId; // Current vend or revalue
+    uint32_t outcomeId;     // Last transaction whose reader outcome was applied
+    MDB_PendingVend_t pendingVends[MDB_MULTIVEND_QUEUE];
+    uint8_t pendingHead;
+    uint8_t pendingCount;
 } MDB_Session_t;
 
 typedef struct {
@@ -120,8 +541,149 @@ typedef struct {
     uint16_t itemNumber;
     bool success;
     MDB_Error_t error;
+    uint32_t transactionId;     // 0 for records not tied to a vend or revalue
 } MDB_TransactionLog_t;
 
+// Journal record slot, one flash write unit
+typedef struct {
+    uint32_t sequence;
+    MDB_TransactionLog_t record;
+    uint32_t crc;
+} MDB_JournalSlot_t;
+
+_Static_assert(sizeof(MDB_JournalSlot_t) == 32, "Journal slot must stay 32 bytes");
+
+typedef struct {
+    uint32_t timestamp;
+    uint16_t id;
+    uint8_t level;
+    uint8_t argc;
+    uint32_t args[MDB_DEFERRED_LOG_ARGS];
+} MDB_DeferredLogRecord_t;
+
+// Log dump section header, followed by recordCount records of recordSize
+typedef struct {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t section;
+    uint32_t recordSize;
+    uint32_t recordCount;
+} MDB_LogFileHeader_t;
+
+// Settlement batch header, followed by count packed transactions whose
+// timestamps chain from 0
+typedef struct {
+    uint32_t magic;
+    uint32_t firstTransactionId;
+    uint16_t count;
+    uint16_t payloadLength;
+    uint32_t crc;               // Over the payload
+} MDB_SettleBatchHeader_t;
+
+// Profiled code paths, timed inclusive of anything they call
+typedef enum {
+    MDB_PROF_SEND_COMMAND,
+    MDB_PROF_WAIT_RESPONSE,
+    MDB_PROF_PROCESS_MESSAGE,
+    MDB_PROF_JUST_RESET,
+    MDB_PROF_BEGIN_SESSION,
+    MDB_PROF_VEND_APPROVED,
+    MDB_PROF_VEND_DENIED,
+    MDB_PROF_END_SESSION,
+    MDB_PROF_PERIPHERAL_ID,
+    MDB_PROF_HANDLE_ERROR,
+    MDB_PROF_COUNT
+} MDB_ProfPoint_t;
+
+// Cycles spent in one profiled path
+typedef struct {
+    uint32_t count;
+    uint32_t min;
+    uint32_t max;
+    uint64_t total;
+} MDB_ProfStats_t;
+
+// Log-linear histogram of microsecond times
+typedef struct {
+    uint32_t counts[MDB_HISTOGRAM_BUCKETS];
+    uint32_t samples;
+    uint32_t max;
+} MDB_Histogram_t;
+
+// Reader timing against the spec. Times are from the end of one word to
+// the start of the next, the word itself taken off at MDB_WORD_TIME_US.
+typedef struct {
+    MDB_Histogram_t response;
+    MDB_Histogram_t interByte;
+    uint32_t responseMarginal;  // Past MDB_TIMING_MARGIN_PCT of t_response
+    uint32_t responseViolations;// Past t_response, yet still read in time
+    uint32_t interByteMarginal;
+    uint32_t interByteViolations;
+    bool flagged;               // Reader runs close enough to the limits to cause timeouts
+} MDB_TimingStats_t;
+
+// Bus trace export, followed by length bytes of frame records. Each
+// record is a header byte, the time since the previous record in us as a
+// LEB128 varint, then one byte per word. The first record of an export
+// is at startMicros. A peripheral record without words is a timeout.
+typedef struct {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t reserved;
+    uint32_t startMicros;
+    uint32_t length;
+    uint32_t dropped;           // Frames lost to overflow since the last export
+} MDB_TraceFileHeader_t;
+
+#define MDB_TRACE_RX             0x80 // Frame from the peripheral
+#define MDB_TRACE_MODE           0x40 // Mode bit on the first (VMC) or last (peripheral) word
+#define MDB_TRACE_LENGTH_MASK    0x3F
+#define MDB_TRACE_RECORD_MAX     (1 + 5 + MDB_MAX_MESSAGE_LENGTH)
+
+// Bus transport, one 9-bit word per character with the mode bit in bit 8.
+// receive waits at most timeout ms for the next word.
+typedef struct {
+    bool (*send)(void* context, const uint16_t* words, uint8_t count);
+    bool (*receive)(void* context, uint16_t* word, uint32_t timeout);
+    void* context;
+} MDB_Transport_t;
+
+// Settlement uplink, send returns true once the batch is accepted upstream
+typedef struct {
+    bool (*isUp)(void* context);
+    bool (*send)(void* context, const uint8_t* data, uint16_t length);
+    void* context;
+} MDB_SettleUplink_t;
+
+#define MDB_LOG_SECTION_DEFERRED    1
+#define MDB_LOG_SECTION_TRANSACTION 2
+#define MDB_LOG_SECTION_ERROR       3
+
+// Dump records are raw structs, layout must match between target and host
+_Static_assert(sizeof(MDB_TransactionLog_t) == 24, "Transaction log record layout changed");
+_Static_assert(sizeof(MDB_DeferredLogRecord_t) == 20, "Deferred log record layout changed");
+_Static_assert(sizeof(MDB_LogFileHeader_t) == 16, "Log file header layout changed");
+_Static_assert(sizeof(MDB_TraceFileHeader_t) == 20, "Trace file header layout changed");
+_Static_assert(LOG_DEBUG == 4, "MDB_LOG_LEVEL_MIN assumes numeric log levels");
+
+typedef struct {
+    MDB_BreakerState_t state;
+    uint8_t failureCount;
+    uint8_t openCount;
+    uint32_t windowStart;
+    uint32_t retryTime;
+    bool resetPending;
+    bool enableAfterReset;
+} MDB_Breaker_t;
+
+typedef struct {
+    uint8_t data[MDB_MAX_MESSAGE_LENGTH];
+    uint8_t length;
+    uint8_t checksum;
+    bool valid;
+    bool retPending;
+} MDB_ResponseCache_t;
+
 typedef struct {
     uint32_t timestamp;
     MDB_Error_t error;
@@ -130,6 +692,75 @@ typedef struct {
     uint8_t lastResponse;
 } MDB_ErrorLog_t;
 
+_Static_assert(sizeof(MDB_ErrorLog_t) == 16, "Error log record layout changed");
+
+// Everything the driver keeps about one machine. The firmware runs a
+// single built-in instance; host tools simulating many machines give each
+// its own and select it before calling into the driver.
+typedef struct {
+    MDB_Config_t config;
+    MDB_PeripheralId_t peripheral;
+    MDB_Session_t session;
+    MDB_MessageQueue_t messageQueue;
+    MDB_TransactionLog_t transactionLog[MDB_TRANSACTION_LOG_SIZE];
+    MDB_ErrorLog_t errorLog[MDB_ERROR_LOG_SIZE];
+    uint8_t transactionLogIndex;
+    uint8_t errorLogIndex;
+    uint32_t lastPollTime;
+#if MDB_LOG_DEFERRED
+    MDB_DeferredLogRecord_t deferredLog[MDB_DEFERRED_LOG_SIZE];
+    uint16_t deferredLogHead;
+    uint16_t deferredLogTail;
+    uint32_t deferredLogOverwritten;
+#endif
+    uint16_t txBuffer[MDB_MAX_MESSAGE_LENGTH];
+    uint8_t rxBuffer[MDB_MAX_MESSAGE_LENGTH];
+    MDB_Error_t rxError;
+    uint32_t lastResponseTime;
+    bool justResetExpected;
+    uint32_t errorCounters[MDB_ERR_HARDWARE + 1];
+    uint8_t seriousErrorCount;          // Hardware/communication errors toward a log dump
+    uint8_t lastCommand[MDB_MAX_MESSAGE_LENGTH];
+    uint8_t lastCommandLength;
+    uint8_t retryCount;
+    MDB_ResponseCache_t responseCache;
+    MDB_Breaker_t breaker;
+    uint32_t jitterState;
+    MDB_VendJournal_t* vendJournal;     // Two alternating copies
+    uint32_t nextTransactionId;
+    uint32_t lastLoggedTransaction;
+    bool dumpActive;
+    uint8_t dumpIndex;
+    MDB_Transport_t transport;
+#if MDB_COIN_ENABLE
+    MDB_CoinChanger_t coin;
+    MDB_PeripheralId_t coinIdentity;
+    bool coinTurn;                      // This poll slot belongs to the changer
+#endif
+#if MDB_PROFILE
+    MDB_ProfStats_t profile[MDB_PROF_COUNT];
+#endif
+#if MDB_BUS_TRACE
+    uint8_t busTrace[MDB_BUS_TRACE_SIZE];
+    uint16_t busTraceHead;
+    uint16_t busTraceTail;
+    uint16_t busTraceUsed;
+    bool busTracePaused;
+    uint32_t busTraceStart;             // us of the oldest record
+    uint32_t busTraceLast;              // us of the newest record
+    uint32_t busTraceDropped;
+#endif
+#if MDB_TIMING_MONITOR
+    MDB_TimingStats_t timing;
+    uint32_t busTxDone;                 // us, end of the last frame we sent
+#endif
+#if MDB_BUS_TRACE || MDB_TIMING_MONITOR
+    uint32_t busClockCycles;            // Cycle counter at busClockMicros
+    uint32_t busClockTick;
+    uint32_t busClockMicros;
+#endif
+} MDB_Instance_t;
+
 // Function Declarations
 bool MDB_Initialize(void);
 bool MDB_Reset(void);
@@ -138,11 +769,33 @@ bool MDB_VendRequest(uint16_t itemNumber, uint32_t amount);
 bool MDB_VendSuccess(uint16_t itemNumber);
 bool MDB_VendFailure(void);
 bool MDB_SessionComplete(void);
+uint32_t MDB_GetTransactionId(void);
+const MDB_Session_t* MDB_GetSession(void);
+void MDB_SetTransport(const MDB_Transport_t* transport);
+void MDB_InstanceInit(MDB_Instance_t* instance, MDB_VendJournal_t* journal);
+void MDB_SelectInstance(MDB_Instance_t* instance);
 bool MDB_Revalue(uint32_t amount);
 void MDB_Poll(void);
+uint32_t MDB_NextPollTime(void);
 bool MDB_EnableReader(void);
 bool MDB_DisableReader(void);
 void MDB_HandleError(MDB_Error_t error);
+MDB_BreakerState_t MDB_GetBreakerState(void);
+const MDB_PeripheralId_t* MDB_GetPeripheralId(void);
+bool MDB_EnableOptionalFeatures(uint32_t features);
+bool MDB_Diagnostics(const uint8_t* request, uint8_t requestLen, uint8_t* response, uint8_t responseSize, uint8_t* responseLen);
+bool MDB_CoinReset(void);
+bool MDB_CoinEnable(uint16_t coinTypes);
+bool MDB_CoinDisable(void);
+bool MDB_CoinUpdateTubes(void);
+bool MDB_CoinDispense(uint8_t coinType, uint8_t count);
+bool MDB_CoinPayout(uint32_t amount);
+bool MDB_CoinTakeCredit(uint32_t amount);
+bool MDB_CoinDiagnostics(uint8_t* status, uint8_t* statusLen);
+const MDB_CoinChanger_t* MDB_GetCoinChanger(void);
+const MDB_PeripheralId_t* MDB_GetCoinIdentity(void);
+
+uint32_t MDB_Crc32(const void* data, uint32_t length);
 
 // Message Processing Functions
 bool MDB_ProcessMessage(uint8_t* msg, uint8_t len);
@@ -153,7 +806,127 @@ bool MDB_ProcessMessageQueue(void);
 void MDB_LogMessage(MDB_LogLevel_t level, const char* format, ...);
 void MDB_LogTransaction(MDB_TransactionLog_t* transaction);
 void MDB_LogError(MDB_Error_t error);
+uint32_t MDB_GetErrorCount(MDB_Error_t error);
 void MDB_DumpLogs(void);
+void MDB_LogEvent(MDB_LogLevel_t level, MDB_LogId_t id, ...);
+uint16_t MDB_ReadDeferredLog(MDB_DeferredLogRecord_t* records, uint16_t maxRecords);
+uint32_t MDB_ExportDeferredLog(uint8_t* buffer, uint32_t size);
+uint32_t MDB_GetDeferredLogOverwritten(void);
+uint32_t MDB_ExportLogs(uint8_t* buffer, uint32_t size);
+void MDB_PauseBusTrace(bool pause);
+const MDB_TimingStats_t* MDB_GetTimingStats(void);
+void MDB_ResetTimingStats(void);
+uint32_t MDB_HistogramBucketLow(uint8_t bucket);
+uint32_t MDB_HistogramPercentile(const MDB_Histogram_t* histogram, uint16_t permille);
+bool MDB_GetProfile(MDB_ProfPoint_t point, MDB_ProfStats_t* stats);
+void MDB_ResetProfile(void);
+void MDB_LogProfile(void);
+const char* MDB_ProfileName(MDB_ProfPoint_t point);
+uint32_t MDB_ExportBusTrace(uint8_t* buffer, uint32_t size);
+
+// Packed Encoding Functions
+uint8_t MDB_PackTransaction(const MDB_TransactionLog_t* record, uint32_t previousTimestamp, uint8_t* out);
+uint8_t MDB_UnpackTransaction(const uint8_t* in, uint8_t length, uint32_t previousTimestamp,
+                              MDB_TransactionLog_t* record);
+
+// Flash Functions
+bool MDB_FlashEraseSector(uint32_t sector);
+bool MDB_FlashProgram(uint32_t address, const void* data, uint32_t length);
+bool MDB_ConfigCacheLoad(MDB_ConfigCache_t* entry);
+bool MDB_ConfigCacheStore(const MDB_Config_t* config, const MDB_PeripheralId_t* peripheral);
+
+// Journal Functions
+bool MDB_JournalInit(void);
+bool MDB_JournalAppend(const MDB_TransactionLog_t* record);
+bool MDB_JournalFlush(void);
+void MDB_JournalService(bool busIdle);
+bool MDB_JournalRead(uint32_t sequence, MDB_TransactionLog_t* record);
+uint32_t MDB_JournalNextSequence(void);
+
+// Settlement Functions
+bool MDB_SettleInit(void);
+void MDB_SettleSetUplink(const MDB_SettleUplink_t* uplink);
+bool MDB_SettleEnqueue(const MDB_TransactionLog_t* record);
+void MDB_SettleService(bool busIdle);
+uint16_t MDB_SettlePending(void);
+uint32_t MDB_SettleDropped(void);
+
+// Log Sink Functions
+bool MDB_LogSinkWrite(const uint8_t* data, uint16_t length);
+uint16_t MDB_LogSinkFree(void);
+uint32_t MDB_LogSinkDropped(void);
+void MDB_LogSinkService(void);
+void MDB_LogSinkTxComplete(UART_HandleTypeDef* huart);
+
+#if MDB_LOG_LEVEL_MIN >= 1
+#define MDB_LOG_ERROR(...)       MDB_LogMessage(LOG_ERROR, __VA_ARGS__)
+#define MDB_EVENT_ERROR(...)     MDB_LogEvent(LOG_ERROR, __VA_ARGS__)
+#else
+#define MDB_LOG_ERROR(...)       ((void)0)
+#define MDB_EVENT_ERROR(...)     ((void)0)
+#endif
+
+#if MDB_LOG_LEVEL_MIN >= 2
+#define MDB_LOG_WARNING(...)     MDB_LogMessage(LOG_WARNING, __VA_ARGS__)
+#define MDB_EVENT_WARNING(...)   MDB_LogEvent(LOG_WARNING, __VA_ARGS__)
+#else
+#define MDB_LOG_WARNING(...)     ((void)0)
+#define MDB_EVENT_WARNING(...)   ((void)0)
+#endif
+
+#if MDB_LOG_LEVEL_MIN >= 3
+#define MDB_LOG_INFO(...)        MDB_LogMessage(LOG_INFO, __VA_ARGS__)
+#define MDB_EVENT_INFO(...)      MDB_LogEvent(LOG_INFO, __VA_ARGS__)
+#else
+#define MDB_LOG_INFO(...)        ((void)0)
+#define MDB_EVENT_INFO(...)      ((void)0)
+#endif
+
+#if MDB_LOG_LEVEL_MIN >= 4
+#define MDB_LOG_DEBUG(...)       MDB_LogMessage(LOG_DEBUG, __VA_ARGS__)
+#define MDB_EVENT_DEBUG(...)     MDB_LogEvent(LOG_DEBUG, __VA_ARGS__)
+#else
+#define MDB_LOG_DEBUG(...)       ((void)0)
+#define MDB_EVENT_DEBUG(...)     ((void)0)
+#endif
+
+// Stage trace points; code is the command or response code of the frame
+typedef enum {
+    MDB_STAGE_TX_START,      // Command handed to the transport
+    MDB_STAGE_TX_DONE,       // Transport accepted the whole frame
+    MDB_STAGE_RX_FIRST,      // First word of the answer
+    MDB_STAGE_RX_COMPLETE,   // Last word of the answer, before checksum and ACK
+    MDB_STAGE_DISPATCH,      // Response handler about to run
+    MDB_STAGE_HANDLED        // Response handler returned
+} MDB_Stage_t;
+
+#if MDB_STAGE_TRACE
+void MDB_StageHook(MDB_Stage_t stage, uint8_t code);
+#define MDB_STAGE(stage, code)   MDB_StageHook(stage, code)
+#else
+#define MDB_STAGE(stage, code)   ((void)0)
+#endif
+
+// Profile scopes time the rest of the enclosing block, every return
+// included. They cost nothing unless MDB_PROFILE is set.
+#if MDB_PROFILE
+#ifdef MDB_HOST_BUILD
+#define MDB_CYCLES()             MdbHostCycles()
+#else
+#define MDB_CYCLES()             (DWT->CYCCNT)
+#endif
+
+typedef struct {
+    uint32_t start;
+    MDB_ProfPoint_t point;
+} MDB_ProfScope_t;
+
+void MDB_ProfileEnd(MDB_ProfScope_t* scope);
+#define MDB_PROFILE_SCOPE(point) \
+    MDB_ProfScope_t profScope __attribute__((cleanup(MDB_ProfileEnd), unused)) = { MDB_CYCLES(), point }
+#else
+#define MDB_PROFILE_SCOPE(point) ((void)0)
+#endif
 
 // State Management
 void MDB_SetState(MDB_State_t newState);
@@ -1,32 +1,66 @@
 // mdb.c
 
-#include "mdb.h"
+#include "MDB.h"
+#include <stddef.h>
 
+#ifndef MDB_HOST_BUILD
 // External declarations
 extern UART_HandleTypeDef huart6;  // MDB UART interface
+#endif
 
 // Private variables
-static MDB_Config_t mdbConfig;
-static MDB_Session_t mdbSession;
-static MDB_MessageQueue_t messageQueue;
-static MDB_TransactionLog_t transactionLog[MDB_TRANSACTION_LOG_SIZE];
-static MDB_ErrorLog_t errorLog[MDB_ERROR_LOG_SIZE];
-
-static uint8_t transactionLogIndex = 0;
-static uint8_t errorLogIndex = 0;
-static uint32_t lastPollTime = 0;
 static MDB_LogLevel_t currentLogLevel = LOG_INFO;
 
-static uint8_t txBuffer[MDB_MAX_MESSAGE_LENGTH];
-static uint8_t rxBuffer[MDB_MAX_MESSAGE_LENGTH];
-static uint8_t lastCommand[MDB_MAX_MESSAGE_LENGTH];
-static uint8_t lastCommandLength = 0;
-static uint8_t retryCount = 0;
+#define MDB_LOG_CATALOG_ARGC(id, argc, format) argc,
+static const uint8_t logArgCount[MDB_MSG_COUNT] = { MDB_LOG_CATALOG(MDB_LOG_CATALOG_ARGC) };
+
+#if !MDB_LOG_DEFERRED
+#define MDB_LOG_CATALOG_FORMAT(id, argc, format) format,
+static const char* const logFormat[MDB_MSG_COUNT] = { MDB_LOG_CATALOG(MDB_LOG_CATALOG_FORMAT) };
+#endif
+
+static const char* const logLevelTag[] = { "", "E", "W", "I", "D" };
+
+#ifndef MDB_HOST_BUILD
+static bool UartSend(void* context, const uint16_t* words, uint8_t count);
+static bool UartReceive(void* context, uint16_t* word, uint32_t timeout);
+#endif
+
+#if !MDB_VEND_JOURNAL_BKPSRAM
+static MDB_VendJournal_t vendJournalStorage[2] __attribute__((section(".noinit")));
+#endif
+
+// The firmware only ever runs this instance; host builds leave the
+// transport to the harness
+static MDB_Instance_t defaultInstance = {
+#ifndef MDB_HOST_BUILD
+    .transport = { UartSend, UartReceive, &huart6 },
+#endif
+#if MDB_VEND_JOURNAL_BKPSRAM
+    .vendJournal = (MDB_VendJournal_t*)BKPSRAM_BASE,
+#else
+    .vendJournal = vendJournalStorage,
+#endif
+    .nextTransactionId = 1
+};
+static MDB_INSTANCE_LOCAL MDB_Instance_t* mdb = &defaultInstance;
+
+#if MDB_BUS_TRACE
+#define TRACE_FRAME(flags, data, count)  TraceFrame(flags, data, count)
+#else
+#define TRACE_FRAME(flags, data, count)  ((void)0)
+#endif
 
 // Private function declarations
 static uint8_t CalculateChecksum(uint8_t* data, uint8_t length);
 static bool SendCommand(uint8_t* data, uint8_t length);
 static bool WaitForResponse(uint8_t* response, uint8_t* length);
+static bool SendControl(uint8_t control);
+static bool RequestRepeat(uint8_t* respLen);
+static bool ReaderAddressed(void);
+static void LogBusError(MDB_Error_t error);
+static bool BusSend(const uint16_t* words, uint8_t count);
+static bool SetupReader(void);
 static void HandleStateChange(MDB_State_t newState);
 static bool HandleJustReset(void);
 static bool HandleBeginSession(uint8_t* msg, uint8_t len);
@@ -34,56 +68,130 @@ static bool HandleVendApproved(uint8_t* msg, uint8_t len);
 static bool HandleVendDenied(void);
 static bool HandleEndSession(void);
 static bool HandleRevalueDenied(void);
+static void RequestRecovery(bool enableAfterReset);
+static void BreakerRecordFailure(uint32_t currentTime);
+static void BreakerOpen(uint32_t currentTime);
+static bool BreakerService(uint32_t currentTime);
+static uint32_t NextJitter(void);
+static bool IsDuplicateResponse(uint8_t* msg, uint8_t len);
+static void CacheResponse(uint8_t* msg, uint8_t len);
+static void DumpLogsStep(void);
+static bool ExchangeCommand(uint8_t* data, uint8_t length);
+static bool ExchangeData(uint8_t* data, uint8_t length, uint8_t* respLen);
+static uint16_t ScalePrice(uint32_t amount);
+static void LogVendOutcome(bool success, MDB_Error_t error);
+static void VendJournalAttach(void);
+static void VendJournalWrite(MDB_VendJournalState_t state);
+static bool VendJournalLoad(MDB_VendJournal_t* entry);
+static bool VendJournalRecover(void);
+static bool ParseConfiguration(uint8_t* msg, uint8_t len);
+static bool RequestPeripheralId(MDB_PeripheralId_t* peripheral);
+static bool ParsePeripheralId(uint8_t* msg, uint8_t len, MDB_PeripheralId_t* peripheral);
+static bool HandlePeripheralId(uint8_t* msg, uint8_t len);
+static bool WarmBoot(void);
+static void UpdateSessionOptions(void);
+static void SeedTransactionId(void);
+static bool OutcomeApplied(void);
+static bool QueueVend(uint16_t itemNumber, uint32_t amount);
+static bool IssueQueuedVend(void);
+static bool SendOutcome(uint8_t* vendCmd, uint8_t length);
+#if MDB_COIN_ENABLE
+static bool CoinService(uint32_t currentTime);
+static bool CoinExchange(uint8_t* data, uint8_t length, uint8_t* respLen);
+static bool CoinSetup(void);
+static bool CoinPoll(void);
+static bool CoinActivity(uint8_t* msg, uint8_t len);
+static void CoinDeposit(uint8_t coinType, uint8_t route);
+static bool CoinDispense(uint8_t coinType, uint8_t count);
+static void CoinPayoutStep(void);
+static void CoinPayoutDone(void);
+#endif
+#if !defined(MDB_HOST_BUILD) && (MDB_PROFILE || MDB_BUS_TRACE || MDB_TIMING_MONITOR)
+static void CycleCounterStart(void);
+#endif
+#if MDB_BUS_TRACE || MDB_TIMING_MONITOR
+static uint32_t BusMicros(void);
+#endif
+#if MDB_TIMING_MONITOR
+static uint8_t HistogramBucket(uint32_t micros);
+static void HistogramAdd(MDB_Histogram_t* histogram, uint32_t micros);
+static void TimingSample(uint32_t now, bool firstWord);
+#endif
+#if MDB_BUS_TRACE
+static void TraceFrame(uint8_t flags, const uint8_t* data, uint8_t count);
+static uint8_t TraceRecordAt(uint16_t offset, uint32_t* delta);
+#endif
 
 bool MDB_Initialize(void) {
     // Reset internal state
-    memset(&mdbConfig, 0, sizeof(MDB_Config_t));
-    memset(&mdbSession, 0, sizeof(MDB_Session_t));
-    memset(&messageQueue, 0, sizeof(MDB_MessageQueue_t));
+    memset(&mdb->config, 0, sizeof(MDB_Config_t));
+    memset(&mdb->peripheral, 0, sizeof(MDB_PeripheralId_t));
+    memset(&mdb->session, 0, sizeof(MDB_Session_t));
+    memset(&mdb->messageQueue, 0, sizeof(MDB_MessageQueue_t));
+    memset(&mdb->responseCache, 0, sizeof(MDB_ResponseCache_t));
+#if MDB_COIN_ENABLE
+    // The changer is brought up from the poll slots, it never holds up the reader
+    memset(&mdb->coin, 0, sizeof(MDB_CoinChanger_t));
+    memset(&mdb->coinIdentity, 0, sizeof(MDB_PeripheralId_t));
+    mdb->coin.retryTime = HAL_GetTick() - MDB_COIN_RETRY_INTERVAL;
+#endif
     
-    MDB_LogMessage(LOG_INFO, "Initializing MDB interface...");
+    MDB_LOG_INFO("Initializing MDB interface...");
+    
+#if MDB_JOURNAL_ENABLE
+    // Mount the flash journal, a failure only costs persistence
+    if(!MDB_JournalInit()) {
+        MDB_LOG_WARNING("Transaction journal unavailable");
+    }
+#endif
     
     // Set initial state
-    mdbSession.state = MDB_STATE_INACTIVE;
+    mdb->session.state = MDB_STATE_INACTIVE;
+#if MDB_PROFILE && !defined(MDB_HOST_BUILD)
+    CycleCounterStart();
+#endif
     
-    // Perform reset sequence
-    if(!MDB_Reset()) {
-        MDB_LogMessage(LOG_ERROR, "Reset failed");
-        return false;
+    // A vend interrupted by reset or power loss is settled with the reader
+    // directly, which also tells us the negotiated setup is still valid
+    VendJournalAttach();
+    SeedTransactionId();
+#if MDB_SETTLE_ENABLE
+    MDB_SettleInit();
+#endif
+    if(VendJournalRecover()) {
+        MDB_LOG_INFO("MDB resumed after pending vend");
+        return true;
     }
     
-    // Send SETUP command
-    uint8_t setupCmd[] = {MDB_CMD_SETUP, 0x00};
-    if(!SendCommand(setupCmd, 2)) {
-        MDB_LogMessage(LOG_ERROR, "Setup command failed");
-        return false;
+    // A reader that kept power keeps its setup; one REQUEST ID exchange
+    // proves it is the unit we negotiated with
+    if(WarmBoot()) {
+        MDB_LOG_INFO("MDB warm boot complete");
+        return true;
     }
     
-    // Wait for configuration response
-    uint8_t respLen;
-    if(!WaitForResponse(rxBuffer, &respLen)) {
-        MDB_LogMessage(LOG_ERROR, "No response to setup command");
+    // Perform reset sequence
+    if(!MDB_Reset()) {
+        MDB_LOG_ERROR("Reset failed");
         return false;
     }
     
-    // Parse configuration
-    if(!ParseConfiguration(rxBuffer, respLen)) {
-        MDB_LogMessage(LOG_ERROR, "Failed to parse configuration");
+    if(!SetupReader()) {
         return false;
     }
     
     // Enable reader
     if(!MDB_EnableReader()) {
-        MDB_LogMessage(LOG_ERROR, "Failed to enable reader");
+        MDB_LOG_ERROR("Failed to enable reader");
         return false;
     }
     
-    MDB_LogMessage(LOG_INFO, "MDB initialization complete");
+    MDB_LOG_INFO("MDB initialization complete");
     return true;
 }
 
 bool MDB_Reset(void) {
-    MDB_LogMessage(LOG_INFO, "Performing reset...");
+    MDB_EVENT_INFO(MDB_MSG_RESET_START);
     
     // Send reset command
     uint8_t resetCmd = MDB_CMD_RESET;
@@ -92,33 +200,44 @@ bool MDB_Reset(void) {
         return false;
     }
     
-    // Wait for JUST RESET response
+    // Reader ACKs the RESET, JUST RESET follows on a later POLL
     uint8_t respLen;
-    if(!WaitForResponse(rxBuffer, &respLen)) {
-        MDB_LogError(MDB_ERR_TIMEOUT);
+    if(!WaitForResponse(mdb->rxBuffer, &respLen)) {
         return false;
     }
     
-    if(rxBuffer[0] != 0x00) { // Check for JUST RESET
+    if(respLen != 1 || mdb->rxBuffer[0] != MDB_ACK) {
         MDB_LogError(MDB_ERR_SEQUENCE);
         return false;
     }
     
+    mdb->responseCache.valid = false;
+    mdb->responseCache.retPending = false;
+    mdb->justResetExpected = true;
+    
     MDB_SetState(MDB_STATE_INACTIVE);
-    MDB_LogMessage(LOG_INFO, "Reset complete");
+    MDB_EVENT_INFO(MDB_MSG_RESET_COMPLETE);
     return true;
 }
 
 bool MDB_ProcessMessage(uint8_t* msg, uint8_t len) {
-    if(len == 0 || msg == NULL) {
+    MDB_PROFILE_SCOPE(MDB_PROF_PROCESS_MESSAGE);
+    if(len == 0 || len > MDB_MAX_MESSAGE_LENGTH || msg == NULL) {
         MDB_LogError(MDB_ERR_PARAMETER);
         return false;
     }
 
+    // Drop retransmitted copies of the last accepted response
+    if(IsDuplicateResponse(msg, len)) {
+        MDB_EVENT_DEBUG(MDB_MSG_DUPLICATE_DROPPED, msg[0]);
+        return true;
+    }
+
     uint8_t command = msg[0];
     bool success = true;
 
-    MDB_LogMessage(LOG_DEBUG, "Processing message: command=0x%02X", command);
+    MDB_EVENT_DEBUG(MDB_MSG_PROCESSING, command);
+    MDB_STAGE(MDB_STAGE_DISPATCH, command);
 
     switch(command) {
         case MDBRxCashlessJustReset:
@@ -141,30 +260,100 @@ bool MDB_ProcessMessage(uint8_t* msg, uint8_t len) {
             success = HandleEndSession();
             break;
 
+        case MDBRxCashlessPeripheralId:
+            success = HandlePeripheralId(msg, len);
+            break;
+
         // ... Diğer komutlar için case'ler eklenecek
 
         default:
-            MDB_LogMessage(LOG_WARNING, "Unknown command received: 0x%02X", command);
+            MDB_EVENT_WARNING(MDB_MSG_UNKNOWN_COMMAND, command);
             success = false;
             break;
     }
+    MDB_STAGE(MDB_STAGE_HANDLED, command);
 
     if(!success) {
         MDB_LogError(MDB_ERR_SEQUENCE);
+    } else {
+        CacheResponse(msg, len);
     }
 
     return success;
 }
 
+// Commands queued from outside the poll loop go out one per poll slot
+bool MDB_QueueMessage(uint8_t* data, uint8_t length) {
+    if(data == NULL || length == 0 || length > MDB_MAX_MESSAGE_LENGTH - 1 ||
+       mdb->messageQueue.count >= MDB_QUEUE_SIZE) {
+        MDB_LogError(MDB_ERR_PARAMETER);
+        return false;
+    }
+    
+    MDB_Message_t* message = &mdb->messageQueue.messages[mdb->messageQueue.tail];
+    memcpy(message->data, data, length);
+    message->length = length;
+    message->timestamp = HAL_GetTick();
+    mdb->messageQueue.tail = (mdb->messageQueue.tail + 1) % MDB_QUEUE_SIZE;
+    mdb->messageQueue.count++;
+    return true;
+}
+
+bool MDB_ProcessMessageQueue(void) {
+    if(mdb->messageQueue.count == 0) {
+        return false;
+    }
+    
+    MDB_Message_t* message = &mdb->messageQueue.messages[mdb->messageQueue.head];
+    mdb->messageQueue.head = (mdb->messageQueue.head + 1) % MDB_QUEUE_SIZE;
+    mdb->messageQueue.count--;
+    return ExchangeCommand(message->data, message->length);
+}
+
+// Tick of the next poll slot, for callers that sleep between polls
+uint32_t MDB_NextPollTime(void) {
+    return mdb->lastPollTime + MDB_POLL_INTERVAL;
+}
+
 void MDB_Poll(void) {
     uint32_t currentTime = HAL_GetTick();
     
+    // Background log output, bounded by free space in the sink
+    DumpLogsStep();
+    MDB_LogSinkService();
+    
+#if MDB_JOURNAL_ENABLE || MDB_SETTLE_ENABLE
+    // Slow background work waits until no vend is in progress
+    bool busIdle = mdb->session.state <= MDB_STATE_ENABLED ||
+                   (mdb->session.alwaysIdle && mdb->session.state == MDB_STATE_SESSION_IDLE);
+#endif
+#if MDB_JOURNAL_ENABLE
+    MDB_JournalService(busIdle);
+#endif
+#if MDB_SETTLE_ENABLE
+    MDB_SettleService(busIdle);
+#endif
+    
     // Only poll at defined interval
-    if(currentTime - lastPollTime < MDB_POLL_INTERVAL) {
+    if(currentTime - mdb->lastPollTime < MDB_POLL_INTERVAL) {
+        return;
+    }
+    
+    mdb->lastPollTime = currentTime;
+    
+#if MDB_COIN_ENABLE
+    // Devices take turns so a slot carries one POLL, and the changer stays
+    // clear of the reader's breaker. An idle turn goes to the reader.
+    mdb->coinTurn = !mdb->coinTurn;
+    if(mdb->coinTurn && CoinService(currentTime)) {
         return;
     }
+#endif
     
-    lastPollTime = currentTime;
+    // Recovery resets and quarantine use this device's poll slot only
+    if(!BreakerService(currentTime)) {
+        return;
+    }
     
     // Process any queued messages first
     MDB_ProcessMessageQueue();
@@ -178,238 +367,2164 @@ void MDB_Poll(void) {
     
     // Wait for response
     uint8_t respLen;
-    if(!WaitForResponse(rxBuffer, &respLen)) {
-        return; // Just ACK is fine
+    if(!WaitForResponse(mdb->rxBuffer, &respLen)) {
+        // Corrupt data is requested again; a silent reader is only given
+        // up on after the non-response time
+        if(mdb->rxError == MDB_ERR_CHECKSUM) {
+            MDB_HandleError(MDB_ERR_CHECKSUM);
+        } else if(currentTime - mdb->lastResponseTime > MDB_NON_RESPONSE_TIMEOUT) {
+            mdb->lastResponseTime = currentTime;
+            MDB_HandleError(MDB_ERR_TIMEOUT);
+        }
+        return;
     }
+    mdb->lastResponseTime = currentTime;
     
-    // Process response if any
-    if(respLen > 0) {
-        MDB_ProcessMessage(rxBuffer, respLen);
+    // Process response if any, a bare ACK means nothing to report and
+    // closes the retransmission window
+    if(respLen > 1) {
+        MDB_ProcessMessage(mdb->rxBuffer, respLen);
+    } else {
+        mdb->responseCache.valid = false;
     }
     
-    // Check session timeout
-    if(mdbSession.state == MDB_STATE_SESSION_IDLE) {
-        if(currentTime - mdbSession.sessionTimeout > 30000) { // 30 second timeout
-            MDB_LogMessage(LOG_WARNING, "Session timeout");
+    // Check session timeout, an always-idle session never ends
+    if(mdb->session.state == MDB_STATE_SESSION_IDLE && !mdb->session.alwaysIdle) {
+        // The response above may have just opened the session, after currentTime
+        if((int32_t)(HAL_GetTick() - mdb->session.sessionTimeout) > 30000) { // 30 second timeout
+            MDB_EVENT_WARNING(MDB_MSG_SESSION_TIMEOUT);
             MDB_SessionComplete();
         }
     }
 }
 
-static bool SendCommand(uint8_t* data, uint8_t length) {
-    if(length > MDB_MAX_MESSAGE_LENGTH - 1) { // Leave room for checksum
-        MDB_LogError(MDB_ERR_PARAMETER);
+const MDB_Session_t* MDB_GetSession(void) {
+    return &mdb->session;
+}
+
+void MDB_SetTransport(const MDB_Transport_t* newTransport) {
+    if(newTransport != NULL) {
+        mdb->transport = *newTransport;
+    }
+}
+
+// A machine of its own for host simulations; journal holds two entries
+void MDB_InstanceInit(MDB_Instance_t* instance, MDB_VendJournal_t* journal) {
+    memset(instance, 0, sizeof(MDB_Instance_t));
+    instance->vendJournal = journal;
+    instance->nextTransactionId = 1;
+}
+
+// Later driver calls from this thread act on instance, NULL is the default
+void MDB_SelectInstance(MDB_Instance_t* instance) {
+    mdb = instance != NULL ? instance : &defaultInstance;
+}
+
+bool MDB_EnableReader(void) {
+    uint8_t readerCmd[] = {MDB_CMD_READER, MDB_READER_ENABLE};
+    if(!ExchangeCommand(readerCmd, sizeof(readerCmd))) {
         return false;
     }
     
-    // Save command for potential retry
-    memcpy(lastCommand, data, length);
-    lastCommandLength = length;
+    // In always-idle mode the enabled reader is a permanently open session
+    // and the VMC goes straight to VEND REQUEST
+    UpdateSessionOptions();
+    MDB_SetState(mdb->session.alwaysIdle ? MDB_STATE_SESSION_IDLE : MDB_STATE_ENABLED);
+    return true;
+}
+
+bool MDB_BeginSession(uint32_t funds) {
+    // Always-idle readers still report funds when a card is presented
+    if(mdb->session.state != MDB_STATE_ENABLED &&
+       !(mdb->session.alwaysIdle && mdb->session.state == MDB_STATE_SESSION_IDLE)) {
+        MDB_LogError(MDB_ERR_STATE);
+        return false;
+    }
     
-    // Copy data to tx buffer
-    memcpy(txBuffer, data, length);
+    mdb->session.availableFunds = funds;
+    mdb->session.sessionTimeout = HAL_GetTick();
+    MDB_SetState(MDB_STATE_SESSION_IDLE);
+    return true;
+}
+
+bool MDB_DisableReader(void) {
+    uint8_t readerCmd[] = {MDB_CMD_READER, MDB_READER_DISABLE};
+    if(!ExchangeCommand(readerCmd, sizeof(readerCmd))) {
+        return false;
+    }
+    MDB_SetState(MDB_STATE_DISABLED);
+    return true;
+}
+
+bool MDB_VendRequest(uint16_t itemNumber, uint32_t amount) {
+    // A multivend reader takes the next request once this outcome is ACKed
+    if(mdb->session.state == MDB_STATE_VEND && mdb->session.multivend) {
+        return QueueVend(itemNumber, amount);
+    }
     
-    // Add checksum
-    txBuffer[length] = CalculateChecksum(data, length);
+    if(mdb->session.state != MDB_STATE_SESSION_IDLE) {
+        MDB_LogError(MDB_ERR_STATE);
+        return false;
+    }
     
-    // Send data
-    if(HAL_UART_Transmit(&huart6, txBuffer, length + 1, 100) != HAL_OK) {
-        MDB_LogError(MDB_ERR_COMMUNICATION);
+    mdb->session.itemNumber = itemNumber;
+    mdb->session.vendAmount = amount;
+    mdb->session.transType = TRANS_PAID_VEND;
+    mdb->session.transactionId = mdb->nextTransactionId++;
+    if(mdb->nextTransactionId == 0) {
+        mdb->nextTransactionId = 1;
+    }
+    
+    // Write-ahead: the intent is durable before the reader sees it
+    VendJournalWrite(MDB_VEND_JOURNAL_REQUESTED);
+    
+    uint16_t price = ScalePrice(amount);
+    uint8_t vendCmd[] = {MDB_CMD_VEND, MDB_VEND_REQUEST, price >> 8, price & 0xFF,
+                         itemNumber >> 8, itemNumber & 0xFF};
+    MDB_SetState(MDB_STATE_VEND);
+    MDB_EVENT_INFO(MDB_MSG_VEND_REQUEST, itemNumber, amount);
+    if(!ExchangeCommand(vendCmd, sizeof(vendCmd))) {
+        MDB_SetState(MDB_STATE_SESSION_IDLE);
+        VendJournalWrite(MDB_VEND_JOURNAL_IDLE);
         return false;
     }
     
     return true;
 }
 
-static bool WaitForResponse(uint8_t* response, uint8_t* length) {
-    uint32_t startTime = HAL_GetTick();
+bool MDB_VendSuccess(uint16_t itemNumber) {
+    if(mdb->session.state != MDB_STATE_VEND) {
+        MDB_LogError(MDB_ERR_STATE);
+        return false;
+    }
     
-    while(HAL_GetTick() - startTime < MDB_RESPONSE_TIMEOUT) {
-        if(HAL_UART_Receive(&huart6, response, 1, 1) == HAL_OK) {
-            *length = 1;
-            
-            // Check if more data is coming (mode bit not set)
-            while(!(response[*length-1] & 0x100)) {
-                if(HAL_UART_Receive(&huart6, &response[*length], 1, MDB_INTERBYTE_TIMEOUT) != HAL_OK) {
-                    MDB_LogError(MDB_ERR_COMMUNICATION);
-                    return false;
-                }
-                (*length)++;
-                
-                if(*length >= MDB_MAX_MESSAGE_LENGTH) {
-                    MDB_LogError(MDB_ERR_PARAMETER);
-                    return false;
-                }
-            }
-            
-            // Validate checksum if more than just ACK/NAK
-            if(*length > 1) {
-                uint8_t checksum = CalculateChecksum(response, *length - 1);
-                if(checksum != response[*length - 1]) {
-                    MDB_LogError(MDB_ERR_CHECKSUM);
-                    return false;
-                }
-            }
-            
-            return true;
-        }
+    VendJournalWrite(MDB_VEND_JOURNAL_SUCCEEDED);
+    LogVendOutcome(true, MDB_ERR_NONE);
+    
+    uint8_t vendCmd[] = {MDB_CMD_VEND, MDB_VEND_SUCCESS, itemNumber >> 8, itemNumber & 0xFF};
+    MDB_SetState(MDB_STATE_SESSION_IDLE);
+    return SendOutcome(vendCmd, sizeof(vendCmd));
+}
+
+bool MDB_VendFailure(void) {
+    if(mdb->session.state != MDB_STATE_VEND) {
+        MDB_LogError(MDB_ERR_STATE);
+        return false;
     }
     
-    MDB_LogError(MDB_ERR_TIMEOUT);
-    return false;
+    VendJournalWrite(MDB_VEND_JOURNAL_FAILED);
+    LogVendOutcome(false, MDB_ERR_HARDWARE);
+    
+    uint8_t vendCmd[] = {MDB_CMD_VEND, MDB_VEND_FAILURE};
+    MDB_SetState(MDB_STATE_SESSION_IDLE);
+    return SendOutcome(vendCmd, sizeof(vendCmd));
 }
 
-void MDB_HandleError(MDB_Error_t error) {
-   MDB_LogError(error);
+bool MDB_SessionComplete(void) {
+    if(mdb->session.state < MDB_STATE_SESSION_IDLE) {
+        MDB_LogError(MDB_ERR_STATE);
+        return false;
+    }
+    
+    // Nothing to close, the next vend can follow immediately
+    if(mdb->session.alwaysIdle) {
+        VendJournalWrite(MDB_VEND_JOURNAL_IDLE);
+        return true;
+    }
+    
+    // Reader answers with END SESSION, now or on a later poll
+    uint8_t sessionCmd[] = {MDB_CMD_VEND, MDB_VEND_SESSION_COMPLETE};
+    return ExchangeCommand(sessionCmd, sizeof(sessionCmd));
+}
 
-   switch(error) {
-       case MDB_ERR_NAK:
-           // Retry the last command up to 3 times
-           if(retryCount < 3) {
-               retryCount++;
-               MDB_LogMessage(LOG_WARNING, "Retrying command, attempt %d", retryCount);
-               if(lastCommandLength > 0) {
-                   SendCommand(lastCommand, lastCommandLength);
-               }
-           } else {
-               MDB_LogMessage(LOG_ERROR, "Max retries exceeded");
-               retryCount = 0;
-               MDB_Reset();
-           }
-           break;
+uint32_t MDB_GetTransactionId(void) {
+    return mdb->session.transactionId;
+}
 
-       case MDB_ERR_TIMEOUT:
-           MDB_LogMessage(LOG_ERROR, "Communication timeout");
-           if(mdbSession.state != MDB_STATE_INACTIVE) {
-               MDB_Reset();
-           }
-           break;
+void MDB_SetState(MDB_State_t newState) {
+    if(newState != mdb->session.state) {
+        HandleStateChange(newState);
+    }
+}
 
-       case MDB_ERR_CHECKSUM:
-           MDB_LogMessage(LOG_ERROR, "Checksum error");
-           // Request retransmission
-           uint8_t ret = MDB_RET;
-           SendCommand(&ret, 1);
-           break;
+static void HandleStateChange(MDB_State_t newState) {
+    MDB_LOG_DEBUG("State change: %d -> %d", mdb->session.state, newState);
+    
+    // Session timeout counts from the last time the session went idle
+    if(newState == MDB_STATE_SESSION_IDLE) {
+        mdb->session.sessionTimeout = HAL_GetTick();
+    }
+    
+    // Queued vends die with the session
+    if(newState < MDB_STATE_SESSION_IDLE && mdb->session.pendingCount > 0) {
+        MDB_LOG_WARNING("Session closed, %u queued vends dropped", mdb->session.pendingCount);
+        mdb->session.pendingCount = 0;
+    }
+    mdb->session.state = newState;
+}
 
-       case MDB_ERR_STATE:
-           MDB_LogMessage(LOG_ERROR, "Invalid state transition");
-           // Try to recover by completing current session
-           if(mdbSession.state > MDB_STATE_ENABLED) {
-               MDB_SessionComplete();
-           }
-           break;
+// VEND APPROVED: 05 amount(2)
+static bool HandleVendApproved(uint8_t* msg, uint8_t len) {
+    MDB_PROFILE_SCOPE(MDB_PROF_VEND_APPROVED);
+    if(mdb->session.state != MDB_STATE_VEND || len < 4) {
+        return false;
+    }
+    
+    // A repeated approval for the same transaction is ACKed but not reapplied
+    if(OutcomeApplied()) {
+        return true;
+    }
+    
+    (void)msg; // Only read by the event when INFO is compiled in
+    VendJournalWrite(MDB_VEND_JOURNAL_APPROVED);
+    MDB_EVENT_INFO(MDB_MSG_VEND_APPROVED,
+                   (uint32_t)((msg[1] << 8) | msg[2]) * (mdb->config.scaleFactor ? mdb->config.scaleFactor : 1));
+    return true;
+}
 
-       case MDB_ERR_SEQUENCE:
-           MDB_LogMessage(LOG_ERROR, "Command sequence error");
-           // Try to recover by resetting to known state
-           if(mdbSession.state > MDB_STATE_ENABLED) {
-               MDB_SessionComplete();
-           } else {
-               MDB_Reset();
-           }
-           break;
+static bool HandleVendDenied(void) {
+    MDB_PROFILE_SCOPE(MDB_PROF_VEND_DENIED);
+    if(mdb->session.state != MDB_STATE_VEND) {
+        return false;
+    }
+    
+    if(OutcomeApplied()) {
+        return true;
+    }
+    
+    LogVendOutcome(false, MDB_ERR_FUNDS);
+    MDB_SetState(MDB_STATE_SESSION_IDLE);
+    VendJournalWrite(MDB_VEND_JOURNAL_IDLE);
+    
+    // Later items were requested against the same funds, do not retry them
+    mdb->session.pendingCount = 0;
+    return true;
+}
 
-       case MDB_ERR_FUNDS:
-           MDB_LogMessage(LOG_ERROR, "Insufficient funds");
-           // Cancel current transaction
-           if(mdbSession.state == MDB_STATE_VEND) {
-               MDB_VendFailure();
-           }
-           break;
+// JUST RESET is expected once after our own RESET. Any other time the
+// reader restarted by itself and lost the negotiated setup.
+static bool HandleJustReset(void) {
+    MDB_PROFILE_SCOPE(MDB_PROF_JUST_RESET);
+    if(mdb->justResetExpected || mdb->session.state == MDB_STATE_INACTIVE) {
+        mdb->justResetExpected = false;
+        return true;
+    }
+    
+    MDB_EVENT_WARNING(MDB_MSG_UNEXPECTED_RESET);
+    bool wasEnabled = mdb->session.state >= MDB_STATE_ENABLED;
+    MDB_SetState(MDB_STATE_INACTIVE);
+    RequestRecovery(wasEnabled);
+    return true;
+}
 
-       case MDB_ERR_HARDWARE:
-           MDB_LogMessage(LOG_ERROR, "Hardware error detected");
-           // Disable reader and try full reset
-           MDB_DisableReader();
-           HAL_Delay(100);
-           MDB_Reset();
-           break;
+// BEGIN SESSION: 03 funds(2) [level 3 payment media data]
+static bool HandleBeginSession(uint8_t* msg, uint8_t len) {
+    MDB_PROFILE_SCOPE(MDB_PROF_BEGIN_SESSION);
+    if(len < 4) {
+        return false;
+    }
+    
+    uint8_t scale = mdb->config.scaleFactor ? mdb->config.scaleFactor : 1;
+    return MDB_BeginSession((uint32_t)((msg[1] << 8) | msg[2]) * scale);
+}
 
-       case MDB_ERR_COMMUNICATION:
-           MDB_LogMessage(LOG_ERROR, "Communication error");
-           // Try to re-establish communication
-           MDB_DisableReader();
-           HAL_Delay(100);
-           MDB_Reset();
-           HAL_Delay(100); 
-           MDB_EnableReader();
-           break;
+static bool HandleEndSession(void) {
+    MDB_PROFILE_SCOPE(MDB_PROF_END_SESSION);
+    MDB_SetState(mdb->session.alwaysIdle ? MDB_STATE_SESSION_IDLE : MDB_STATE_ENABLED);
+    VendJournalWrite(MDB_VEND_JOURNAL_IDLE);
+    return true;
+}
 
-       default:
-           MDB_LogMessage(LOG_ERROR, "Unknown error: %d", error);
-           // Try full reset for unknown errors
-           MDB_Reset();
-           break;
-   }
+// Sends a command and handles the reply: ACK, NAK or data sent in place of ACK
+static bool ExchangeCommand(uint8_t* data, uint8_t length) {
+    uint8_t respLen;
+    if(!ExchangeData(data, length, &respLen)) {
+        return false;
+    }
+    if(respLen > 1) {
+        return MDB_ProcessMessage(mdb->rxBuffer, respLen);
+    }
+    return true;
+}
 
-   // Update error statistics
-   static uint32_t lastErrorTime = 0;
-   uint32_t currentTime = HAL_GetTick();
-   
-   // If errors are happening too frequently, disable reader
-   if(currentTime - lastErrorTime < 5000) { // Less than 5 seconds between errors
-       static uint8_t rapidErrorCount = 0;
-       rapidErrorCount++;
-       
-       if(rapidErrorCount > 5) { // More than 5 errors in 5 seconds
-           MDB_LogMessage(LOG_ERROR, "Too many errors, disabling reader");
-           MDB_DisableReader();
-           rapidErrorCount = 0;
-       }
-   } else {
-       rapidErrorCount = 0;
-   }
-   
-   lastErrorTime = currentTime;
+// Sends a command and reads the reply, resending it after a NAK and asking
+// for corrupt data again. A data reply is left in rxBuffer for the caller.
+static bool ExchangeData(uint8_t* data, uint8_t length, uint8_t* respLen) {
+    // A new command closes the retransmission window, so an identical
+    // answer to it is a new answer and not a repeat
+    mdb->responseCache.valid = false;
+    mdb->retryCount = 0;
+    for(;;) {
+        if(!SendCommand(data, length)) {
+            return false;
+        }
+        if(!WaitForResponse(mdb->rxBuffer, respLen) &&
+           (mdb->rxError != MDB_ERR_CHECKSUM || !RequestRepeat(respLen))) {
+            return false;
+        }
+        if(*respLen != 1 || mdb->rxBuffer[0] != MDB_NAK) {
+            break;
+        }
+        
+        // A NAKed command was not acted on. Each copy sent again gets its
+        // own answer, so an ACK to a retry is a success like any other.
+        if(mdb->retryCount >= MDB_NAK_RETRIES) {
+            MDB_HandleError(MDB_ERR_NAK);
+            return false;
+        }
+        mdb->retryCount++;
+        MDB_LogError(MDB_ERR_NAK);
+        MDB_EVENT_WARNING(MDB_MSG_RETRYING, mdb->retryCount);
+    }
+    mdb->retryCount = 0;
+    return true;
+}
 
-   // Log extended error information
-   MDB_ErrorLog_t errorEntry = {
-       .timestamp = currentTime,
-       .error = error,
-       .state = mdbSession.state,
-       .lastCommand = lastCommand[0],
-       .lastResponse = rxBuffer[0]
-   };
-   
-   // Add to error log array
-   memcpy(&errorLog[errorLogIndex], &errorEntry, sizeof(MDB_ErrorLog_t));
-   errorLogIndex = (errorLogIndex + 1) % MDB_ERROR_LOG_SIZE;
+static uint16_t ScalePrice(uint32_t amount) {
+    uint8_t scale = mdb->config.scaleFactor ? mdb->config.scaleFactor : 1;
+    uint32_t scaled = amount / scale;
+    return scaled > 0xFFFF ? 0xFFFF : (uint16_t)scaled;
+}
 
-   // If we have serious errors, consider dumping logs
-   static uint8_t seriousErrorCount = 0;
-   if(error == MDB_ERR_HARDWARE || error == MDB_ERR_COMMUNICATION) {
-       seriousErrorCount++;
-       if(seriousErrorCount >= 3) {
-           MDB_DumpLogs();
-           seriousErrorCount = 0;
-       }
-   }
+static void LogVendOutcome(bool success, MDB_Error_t error) {
+    MDB_TransactionLog_t transaction = {
+        .timestamp = HAL_GetTick(),
+        .type = mdb->session.transType,
+        .amount = mdb->session.vendAmount,
+        .itemNumber = mdb->session.itemNumber,
+        .success = success,
+        .error = error,
+        .transactionId = mdb->session.transactionId
+    };
+    MDB_LogTransaction(&transaction);
 }
 
-// Yardımcı fonksiyon - Toplu hata bilgisi yazdırma
-void MDB_DumpErrorStats(void) {
-   uint32_t errorCounts[MDB_ERR_HARDWARE + 1] = {0};
-   uint32_t totalErrors = 0;
-   
-   // Hata sayılarını hesapla
-   for(int i = 0; i < MDB_ERROR_LOG_SIZE; i++) {
-       if(errorLog[i].timestamp != 0) {
-           errorCounts[errorLog[i].error]++;
-           totalErrors++;
-       }
-   }
+static void VendJournalAttach(void) {
+#if MDB_VEND_JOURNAL_BKPSRAM
+    __HAL_RCC_PWR_CLK_ENABLE();
+    HAL_PWR_EnableBkUpAccess();
+    __HAL_RCC_BKPSRAM_CLK_ENABLE();
+    HAL_PWREx_EnableBkUpReg();
+#endif
+}
 
-   // İstatistikleri yazdır
-   MDB_LogMessage(LOG_INFO, "=== Error Statistics ===");
-   MDB_LogMessage(LOG_INFO, "Total Errors: %lu", totalErrors);
-   
-   for(int i = 0; i <= MDB_ERR_HARDWARE; i++) {
-       if(errorCounts[i] > 0) {
-           float percentage = (float)errorCounts[i] / totalErrors * 100.0f;
-           MDB_LogMessage(LOG_INFO, "Error %d: Count=%lu (%.1f%%)", 
-                         i, errorCounts[i], percentage);
-       }
-   }
+// Alternates between two copies; the newer valid copy wins on load
+static void VendJournalWrite(MDB_VendJournalState_t state) {
+    MDB_VendJournal_t current;
+    uint32_t sequence = VendJournalLoad(&current) ? current.sequence + 1 : 1;
+    MDB_VendJournal_t* entry = &mdb->vendJournal[sequence & 1];
+    
+    entry->magic = 0;
+    entry->sequence = sequence;
+    entry->transactionId = mdb->session.transactionId;
+    entry->state = state;
+    entry->amount = mdb->session.vendAmount;
+    entry->itemNumber = mdb->session.itemNumber;
+    entry->timestamp = HAL_GetTick();
+    entry->config = mdb->config;
+    entry->peripheral = mdb->peripheral;
+    entry->crc = MDB_Crc32(entry, offsetof(MDB_VendJournal_t, crc));
+    entry->magic = MDB_VEND_JOURNAL_MAGIC;
+    __DSB();
+}
+
+static bool VendJournalLoad(MDB_VendJournal_t* entry) {
+    bool found = false;
+    for(uint8_t i = 0; i < 2; i++) {
+        MDB_VendJournal_t* copy = &mdb->vendJournal[i];
+        if(copy->magic != MDB_VEND_JOURNAL_MAGIC) {
+            continue;
+        }
+        // CRC covers the entry with magic still cleared, as written
+        MDB_VendJournal_t check = *copy;
+        check.magic = 0;
+        if(check.crc != MDB_Crc32(&check, offsetof(MDB_VendJournal_t, crc))) {
+            continue;
+        }
+        if(!found || (int32_t)(copy->sequence - entry->sequence) > 0) {
+            *entry = *copy;
+            found = true;
+        }
+    }
+    return found;
+}
+
+static bool VendJournalRecover(void) {
+    MDB_VendJournal_t entry;
+    if(!VendJournalLoad(&entry) || entry.state == MDB_VEND_JOURNAL_IDLE) {
+        return false;
+    }
+    
+    MDB_LOG_WARNING("Pending vend found: state=%d item=%u", entry.state, entry.itemNumber);
+    
+    // Only the reader the vend was started with can settle it. One that was
+    // swapped or lost power does not answer with the journaled ID.
+    if(entry.config.featureLevel >= 2) {
+        MDB_PeripheralId_t peripheral;
+        if(!RequestPeripheralId(&peripheral) ||
+           memcmp(&peripheral, &entry.peripheral, sizeof(MDB_PeripheralId_t)) != 0) {
+            MDB_LOG_WARNING("Reader changed or reset, pending vend dropped");
+            VendJournalWrite(MDB_VEND_JOURNAL_IDLE);
+            return false;
+        }
+        mdb->peripheral = peripheral;
+    }
+    
+    // Resume the reader's view of the session
+    mdb->config = entry.config;
+    mdb->session.itemNumber = entry.itemNumber;
+    mdb->session.vendAmount = entry.amount;
+    mdb->session.transType = TRANS_PAID_VEND;
+    mdb->session.transactionId = entry.transactionId;
+    UpdateSessionOptions();
+    mdb->session.state = MDB_STATE_VEND;
+    
+    bool resolved;
+    switch(entry.state) {
+        case MDB_VEND_JOURNAL_REQUESTED: {
+            // Never approved as far as we know, withdraw the request
+            uint8_t cancelCmd[] = {MDB_CMD_VEND, MDB_VEND_CANCEL};
+            resolved = ExchangeCommand(cancelCmd, sizeof(cancelCmd));
+            LogVendOutcome(false, MDB_ERR_SEQUENCE);
+            MDB_SetState(MDB_STATE_SESSION_IDLE);
+            break;
+        }
+        
+        case MDB_VEND_JOURNAL_APPROVED:
+            // Dispense outcome unknown, refund rather than charge
+            resolved = MDB_VendFailure();
+            break;
+        
+        default:
+            // Outcome already reported, only the session is left open
+            MDB_SetState(MDB_STATE_SESSION_IDLE);
+            resolved = true;
+            break;
+    }
+    
+    if(!resolved || !MDB_SessionComplete()) {
+        MDB_LOG_WARNING("Pending vend not resolved, full setup required");
+        memset(&mdb->config, 0, sizeof(MDB_Config_t));
+        memset(&mdb->session, 0, sizeof(MDB_Session_t));
+        mdb->session.state = MDB_STATE_INACTIVE;
+        VendJournalWrite(MDB_VEND_JOURNAL_IDLE);
+        return false;
+    }
+    
+    VendJournalWrite(MDB_VEND_JOURNAL_IDLE);
+    return true;
+}
+
+// SETUP config exchange, then identify the reader and agree on optional
+// features and remember the setup for the next warm boot. Level 1 readers
+// have no ID.
+static bool SetupReader(void) {
+    uint8_t setupCmd[] = {MDB_CMD_SETUP, 0x00};
+    if(!SendCommand(setupCmd, 2)) {
+        MDB_LOG_ERROR("Setup command failed");
+        return false;
+    }
+    
+    // Wait for configuration response
+    uint8_t respLen;
+    if(!WaitForResponse(mdb->rxBuffer, &respLen)) {
+        MDB_LOG_ERROR("No response to setup command");
+        return false;
+    }
+    
+    if(!ParseConfiguration(mdb->rxBuffer, respLen)) {
+        MDB_LOG_ERROR("Failed to parse configuration");
+        return false;
+    }
+    MDB_SetState(MDB_STATE_DISABLED);
+    VendJournalWrite(MDB_VEND_JOURNAL_IDLE);
+    
+    if(mdb->config.featureLevel >= 2 && RequestPeripheralId(&mdb->peripheral)) {
+        if(mdb->config.featureLevel >= 3 && !MDB_EnableOptionalFeatures(MDB_VMC_FEATURES)) {
+            MDB_LOG_WARNING("Optional feature enable failed");
+        }
+#if MDB_CONFIG_CACHE_ENABLE
+        MDB_ConfigCacheStore(&mdb->config, &mdb->peripheral);
+#endif
+    }
+    return true;
+}
+
+// READER CONFIG DATA: 01 level country(2) scale decimals maxResponse misc
+static bool ParseConfiguration(uint8_t* msg, uint8_t len) {
+    if(len < 9 || msg[0] != MDBRxCashlessReaderConfig) {
+        return false;
+    }
+    
+    mdb->config.featureLevel = msg[1];
+    mdb->config.countryCode = (msg[2] << 8) | msg[3];
+    mdb->config.scaleFactor = msg[4];
+    mdb->config.decimalPlaces = msg[5];
+    mdb->config.miscOptions = msg[7];
+    mdb->config.maxPrice = 0xFFFF;
+    mdb->config.minPrice = 0x0000;
+    
+    MDB_LOG_INFO("Reader config: level=%d country=0x%04X scale=%d decimals=%d",
+                 mdb->config.featureLevel, mdb->config.countryCode,
+                 mdb->config.scaleFactor, mdb->config.decimalPlaces);
+    return true;
+}
+
+// EXPANSION REQUEST ID, answered with PERIPHERAL ID by level 2+ readers
+static bool RequestPeripheralId(MDB_PeripheralId_t* peripheral) {
+    uint8_t idCmd[31] = {MDB_CMD_EXPANSION, MDB_EXP_REQUEST_ID};
+    memcpy(&idCmd[2], MDB_VMC_MANUFACTURER, 3);
+    memcpy(&idCmd[5], MDB_VMC_SERIAL, 12);
+    memcpy(&idCmd[17], MDB_VMC_MODEL, 12);
+    idCmd[29] = MDB_VMC_SW_VERSION >> 8;
+    idCmd[30] = MDB_VMC_SW_VERSION & 0xFF;
+    
+    uint8_t respLen;
+    if(!ExchangeData(idCmd, sizeof(idCmd), &respLen)) {
+        return false;
+    }
+    return ParsePeripheralId(mdb->rxBuffer, respLen, peripheral);
+}
+
+// 09 manufacturer(3) serial(12) model(12) version(2) [features(4)] checksum
+static bool ParsePeripheralId(uint8_t* msg, uint8_t len, MDB_PeripheralId_t* peripheral) {
+    if(len < 31 || msg[0] != MDBRxCashlessPeripheralId) {
+        return false;
+    }
+    
+    // Cleared whole so identities compare with memcmp, padding included
+    memset(peripheral, 0, sizeof(MDB_PeripheralId_t));
+    memcpy(peripheral->manufacturer, &msg[1], 3);
+    memcpy(peripheral->serialNumber, &msg[4], 12);
+    memcpy(peripheral->modelNumber, &msg[16], 12);
+    peripheral->softwareVersion = (msg[28] << 8) | msg[29];
+    peripheral->optionalFeatures = 0;
+    if(len >= 35) {
+        peripheral->optionalFeatures = ((uint32_t)msg[30] << 24) | ((uint32_t)msg[31] << 16) |
+                                       ((uint32_t)msg[32] << 8) | msg[33];
+    }
+    return true;
+}
+
+// PERIPHERAL ID may also arrive as a POLL response
+static bool HandlePeripheralId(uint8_t* msg, uint8_t len) {
+    MDB_PROFILE_SCOPE(MDB_PROF_PERIPHERAL_ID);
+    return ParsePeripheralId(msg, len, &mdb->peripheral);
+}
+
+const MDB_PeripheralId_t* MDB_GetPeripheralId(void) {
+    return &mdb->peripheral;
+}
+
+// Level 3 only. Features the reader did not offer are never requested.
+bool MDB_EnableOptionalFeatures(uint32_t features) {
+    if(mdb->config.featureLevel < 3) {
+        return features == 0;
+    }
+    
+    features &= mdb->peripheral.optionalFeatures;
+    uint8_t featureCmd[] = {MDB_CMD_EXPANSION, MDB_EXP_FEATURE_ENABLE,
+                            features >> 24, (features >> 16) & 0xFF,
+                            (features >> 8) & 0xFF, features & 0xFF};
+    if(!ExchangeCommand(featureCmd, sizeof(featureCmd))) {
+        return false;
+    }
+    
+    mdb->config.optionalFeatures = features;
+    MDB_LOG_INFO("Optional features enabled: 0x%08lX", (unsigned long)features);
+    return true;
+}
+
+// Manufacturer specific request, answered with DIAGNOSTICS RESPONSE (FF data).
+// Fails when the answer does not fit in responseSize bytes.
+bool MDB_Diagnostics(const uint8_t* request, uint8_t requestLen, uint8_t* response, uint8_t responseSize, uint8_t* responseLen) {
+    uint8_t diagCmd[MDB_MAX_MESSAGE_LENGTH - 1] = {MDB_CMD_EXPANSION, MDB_EXP_DIAGNOSTICS};
+    if(requestLen > sizeof(diagCmd) - 2) {
+        MDB_LogError(MDB_ERR_PARAMETER);
+        return false;
+    }
+    memcpy(&diagCmd[2], request, requestLen);
+    
+    uint8_t respLen;
+    if(!ExchangeData(diagCmd, requestLen + 2, &respLen)) {
+        return false;
+    }
+    if(respLen < 2 || mdb->rxBuffer[0] != MDBRxCashlessDiagnostics) {
+        return false;
+    }
+    if(respLen - 2 > responseSize) {
+        MDB_LogError(MDB_ERR_PARAMETER);
+        return false;
+    }
+    
+    // Strip response code and checksum
+    *responseLen = respLen - 2;
+    memcpy(response, &mdb->rxBuffer[1], *responseLen);
+    return true;
+}
+
+// RESET the changer, JUST RESET on a later POLL starts its setup
+bool MDB_CoinReset(void) {
+#if MDB_COIN_ENABLE
+    uint8_t resetCmd = MDB_COIN_RESET;
+    uint8_t respLen;
+    if(!CoinExchange(&resetCmd, 1, &respLen) || respLen != 1) {
+        return false;
+    }
+    
+    mdb->coin.state = MDB_COIN_RESETTING;
+    mdb->coin.payoutBusy = false;
+    mdb->coin.lastResponseTime = HAL_GetTick();
+    return true;
+#else
+    return false;
+#endif
+}
+
+// COIN TYPE: coin types to accept, bit n for type n. Manual dispense stays
+// enabled for every type. The mask is sent again after a changer reset.
+bool MDB_CoinEnable(uint16_t coinTypes) {
+#if MDB_COIN_ENABLE
+    if(mdb->coin.state < MDB_COIN_DISABLED) {
+        MDB_LogError(MDB_ERR_STATE);
+        return false;
+    }
+    
+    uint8_t typeCmd[] = {MDB_COIN_TYPE, coinTypes >> 8, coinTypes & 0xFF, 0xFF, 0xFF};
+    uint8_t respLen;
+    if(!CoinExchange(typeCmd, sizeof(typeCmd), &respLen)) {
+        return false;
+    }
+    
+    mdb->coin.acceptedCoins = coinTypes;
+    if(mdb->coin.state != MDB_COIN_PAYOUT) {
+        mdb->coin.state = coinTypes != 0 ? MDB_COIN_ENABLED : MDB_COIN_DISABLED;
+    }
+    return true;
+#else
+    (void)coinTypes;
+    return false;
+#endif
+}
+
+bool MDB_CoinDisable(void) {
+    return MDB_CoinEnable(0);
+}
+
+// TUBE STATUS: full flags (2) then the coins in each tube (16)
+bool MDB_CoinUpdateTubes(void) {
+#if MDB_COIN_ENABLE
+    MDB_CoinChanger_t* coin = &mdb->coin;
+    uint8_t tubeCmd = MDB_COIN_TUBE_STATUS;
+    uint8_t respLen;
+    if(coin->state == MDB_COIN_INACTIVE || !CoinExchange(&tubeCmd, 1, &respLen) || respLen < 4) {
+        return false;
+    }
+    
+    uint8_t types = respLen - 3 < MDB_COIN_TYPES ? respLen - 3 : MDB_COIN_TYPES;
+    coin->tubeFull = (mdb->rxBuffer[0] << 8) | mdb->rxBuffer[1];
+    memset(coin->tubeCount, 0, sizeof(coin->tubeCount));
+    memcpy(coin->tubeCount, &mdb->rxBuffer[2], types);
+    return true;
+#else
+    return false;
+#endif
+}
+
+// Coins of one type straight from the tube, outside any payout
+bool MDB_CoinDispense(uint8_t coinType, uint8_t count) {
+#if MDB_COIN_ENABLE
+    if(mdb->coin.state != MDB_COIN_DISABLED && mdb->coin.state != MDB_COIN_ENABLED) {
+        MDB_LogError(MDB_ERR_STATE);
+        return false;
+    }
+    return CoinDispense(coinType, count);
+#else
+    (void)coinType;
+    (void)count;
+    return false;
+#endif
+}
+
+// Pays amount out as change from the following poll slots; progress and
+// any shortfall are in MDB_GetCoinChanger. Credit is not touched, an
+// escrow return is MDB_CoinTakeCredit of the credit followed by this.
+bool MDB_CoinPayout(uint32_t amount) {
+#if MDB_COIN_ENABLE
+    MDB_CoinChanger_t* coin = &mdb->coin;
+    if(coin->state != MDB_COIN_DISABLED && coin->state != MDB_COIN_ENABLED) {
+        MDB_LogError(MDB_ERR_STATE);
+        return false;
+    }
+    if(amount == 0) {
+        return true;
+    }
+    
+    coin->escrowRequest = false;
+    coin->payoutPending = amount;
+    coin->payoutPaid = 0;
+    coin->payoutShort = 0;
+    coin->payoutRequested = 0;
+    coin->state = MDB_COIN_PAYOUT;
+    return true;
+#else
+    (void)amount;
+    return false;
+#endif
+}
+
+// Deposited coins spent on a vend
+bool MDB_CoinTakeCredit(uint32_t amount) {
+#if MDB_COIN_ENABLE
+    if(amount > mdb->coin.credit) {
+        MDB_LogError(MDB_ERR_FUNDS);
+        return false;
+    }
+    mdb->coin.credit -= amount;
+    return true;
+#else
+    (void)amount;
+    return false;
+#endif
+}
+
+// Level 3 SEND DIAGNOSTIC STATUS, pairs of main and sub code; status
+// needs room for 16 bytes
+bool MDB_CoinDiagnostics(uint8_t* status, uint8_t* statusLen) {
+#if MDB_COIN_ENABLE
+    uint8_t diagCmd[] = {MDB_COIN_EXPANSION, MDB_COIN_EXP_DIAGNOSTICS};
+    uint8_t respLen;
+    if(mdb->coin.featureLevel < 3 || mdb->coin.state == MDB_COIN_INACTIVE ||
+       !CoinExchange(diagCmd, sizeof(diagCmd), &respLen) || respLen < 3) {
+        return false;
+    }
+    
+    *statusLen = respLen - 1 < 16 ? respLen - 1 : 16;
+    memcpy(status, mdb->rxBuffer, *statusLen);
+    return true;
+#else
+    (void)status;
+    (void)statusLen;
+    return false;
+#endif
+}
+
+// NULL when the coin changer is not compiled in
+const MDB_CoinChanger_t* MDB_GetCoinChanger(void) {
+#if MDB_COIN_ENABLE
+    return &mdb->coin;
+#else
+    return NULL;
+#endif
+}
+
+const MDB_PeripheralId_t* MDB_GetCoinIdentity(void) {
+#if MDB_COIN_ENABLE
+    return &mdb->coinIdentity;
+#else
+    return NULL;
+#endif
+}
+
+#if MDB_COIN_ENABLE
+// Changer work for one poll slot: RESET while it is missing, POLL
+// otherwise, then the next step of a payout. Returns false when the
+// slot was left unused.
+static bool CoinService(uint32_t currentTime) {
+    MDB_CoinChanger_t* coin = &mdb->coin;
+    
+    if(coin->state == MDB_COIN_INACTIVE) {
+        if(currentTime - coin->retryTime < MDB_COIN_RETRY_INTERVAL) {
+            return false;
+        }
+        coin->retryTime = currentTime;
+        MDB_CoinReset();
+        return true;
+    }
+    
+    if(!CoinPoll()) {
+        if((int32_t)(currentTime - coin->lastResponseTime) > MDB_NON_RESPONSE_TIMEOUT) {
+            MDB_EVENT_WARNING(MDB_MSG_COIN_LOST);
+            if(coin->state == MDB_COIN_PAYOUT) {
+                CoinPayoutDone();
+            }
+            coin->state = MDB_COIN_INACTIVE;
+            coin->retryTime = currentTime;
+        }
+        return true;
+    }
+    coin->lastResponseTime = currentTime;
+    
+    if(coin->state == MDB_COIN_PAYOUT) {
+        CoinPayoutStep();
+    }
+    return true;
+}
+
+// Data answers are left in rxBuffer. Corrupt data is asked for again,
+// other errors are only counted and the changer is given up on from the
+// poll slots.
+static bool CoinExchange(uint8_t* data, uint8_t length, uint8_t* respLen) {
+    if(!SendCommand(data, length)) {
+        return false;
+    }
+    if(!WaitForResponse(mdb->rxBuffer, respLen) &&
+       (mdb->rxError != MDB_ERR_CHECKSUM || !RequestRepeat(respLen))) {
+        return false;
+    }
+    if(*respLen == 1 && mdb->rxBuffer[0] == MDB_NAK) {
+        LogBusError(MDB_ERR_NAK);
+        return false;
+    }
+    return true;
+}
+
+// SETUP, TUBE STATUS and at level 3 IDENTIFICATION and FEATURE ENABLE,
+// then the coin types accepted before the changer reset
+static bool CoinSetup(void) {
+    MDB_CoinChanger_t* coin = &mdb->coin;
+    uint8_t setupCmd = MDB_COIN_SETUP;
+    uint8_t respLen;
+    
+    // level country(2) scale decimals routing(2) credit(up to 16)
+    if(!CoinExchange(&setupCmd, 1, &respLen) || respLen < 8) {
+        coin->state = MDB_COIN_INACTIVE;
+        return false;
+    }
+    uint8_t types = respLen - 8 < MDB_COIN_TYPES ? respLen - 8 : MDB_COIN_TYPES;
+    coin->featureLevel = mdb->rxBuffer[0];
+    coin->countryCode = (mdb->rxBuffer[1] << 8) | mdb->rxBuffer[2];
+    coin->scaleFactor = mdb->rxBuffer[3] ? mdb->rxBuffer[3] : 1;
+    coin->decimalPlaces = mdb->rxBuffer[4];
+    coin->tubeRouting = (mdb->rxBuffer[5] << 8) | mdb->rxBuffer[6];
+    memset(coin->coinValue, 0, sizeof(coin->coinValue));
+    memcpy(coin->coinValue, &mdb->rxBuffer[7], types);
+    coin->state = MDB_COIN_DISABLED;
+    MDB_CoinUpdateTubes();
+    
+    // manufacturer(3) serial(12) model(12) version(2) features(4)
+    coin->optionalFeatures = 0;
+    coin->enabledFeatures = 0;
+    uint8_t idCmd[] = {MDB_COIN_EXPANSION, MDB_COIN_EXP_IDENTIFICATION};
+    if(coin->featureLevel >= 3 && CoinExchange(idCmd, sizeof(idCmd), &respLen) && respLen >= 34) {
+        memcpy(mdb->coinIdentity.manufacturer, &mdb->rxBuffer[0], 3);
+        memcpy(mdb->coinIdentity.serialNumber, &mdb->rxBuffer[3], 12);
+        memcpy(mdb->coinIdentity.modelNumber, &mdb->rxBuffer[15], 12);
+        mdb->coinIdentity.softwareVersion = (mdb->rxBuffer[27] << 8) | mdb->rxBuffer[28];
+        coin->optionalFeatures = ((uint32_t)mdb->rxBuffer[29] << 24) | ((uint32_t)mdb->rxBuffer[30] << 16) |
+                                 ((uint32_t)mdb->rxBuffer[31] << 8) | mdb->rxBuffer[32];
+        mdb->coinIdentity.optionalFeatures = coin->optionalFeatures;
+        
+        uint32_t features = coin->optionalFeatures & MDB_VMC_COIN_FEATURES;
+        uint8_t featureCmd[] = {MDB_COIN_EXPANSION, MDB_COIN_EXP_FEATURE_ENABLE,
+                                features >> 24, (features >> 16) & 0xFF,
+                                (features >> 8) & 0xFF, features & 0xFF};
+        if(CoinExchange(featureCmd, sizeof(featureCmd), &respLen)) {
+            coin->enabledFeatures = features;
+        }
+    }
+    
+    MDB_EVENT_INFO(MDB_MSG_COIN_READY, coin->featureLevel, coin->scaleFactor);
+    if(coin->acceptedCoins != 0) {
+        MDB_CoinEnable(coin->acceptedCoins);
+    }
+    return true;
+}
+
+// Payout busy is only known from the latest POLL
+static bool CoinPoll(void) {
+    uint8_t pollCmd = MDB_COIN_POLL;
+    uint8_t respLen;
+    if(!CoinExchange(&pollCmd, 1, &respLen)) {
+        return false;
+    }
+    
+    mdb->coin.payoutBusy = false;
+    if(respLen > 1 && CoinActivity(mdb->rxBuffer, respLen - 1)) {
+        // Setup reuses rxBuffer, so it waits until the whole answer is read
+        if(mdb->coin.state == MDB_COIN_PAYOUT) {
+            CoinPayoutDone();
+        }
+        CoinSetup();
+    }
+    return true;
+}
+
+// Up to 16 bytes of activity, one or two bytes per entry. Returns true
+// when the changer reported JUST RESET.
+static bool CoinActivity(uint8_t* msg, uint8_t len) {
+    MDB_CoinChanger_t* coin = &mdb->coin;
+    bool justReset = false;
+    
+    for(uint8_t i = 0; i < len; ) {
+        uint8_t entry = msg[i];
+        uint8_t coinType = entry & 0x0F;
+        if(entry & (MDB_COIN_ACT_DISPENSED | MDB_COIN_ACT_DEPOSITED)) {
+            if(i + 1 < len) {
+                coin->tubeCount[coinType] = msg[i + 1];
+            }
+            if(!(entry & MDB_COIN_ACT_DISPENSED)) {
+                CoinDeposit(coinType, (entry >> 4) & 0x03);
+            }
+            i += 2;
+            continue;
+        }
+        if(entry & MDB_COIN_ACT_SLUG) {
+            coin->slugs += entry & 0x1F;
+            i++;
+            continue;
+        }
+        
+        coin->lastStatus = entry;
+        switch(entry) {
+            case MDBRxCoinEscrowRequest:
+                coin->escrowRequest = true;
+                break;
+            
+            case MDBRxCoinPayoutBusy:
+                coin->payoutBusy = true;
+                break;
+            
+            case MDBRxCoinJustReset:
+                justReset = true;
+                break;
+            
+            // Transient, the changer sorts these out itself
+            case MDBRxCoinNoCredit:
+            case MDBRxCoinDoubleArrival:
+            case MDBRxCoinChangerBusy:
+                break;
+            
+            default:
+                MDB_EVENT_WARNING(MDB_MSG_COIN_STATUS, entry);
+                break;
+        }
+        i++;
+    }
+    return justReset;
+}
+
+static void CoinDeposit(uint8_t coinType, uint8_t route) {
+    MDB_CoinChanger_t* coin = &mdb->coin;
+    
+    if(route == MDB_COIN_ROUTE_REJECT) {
+        coin->coinsRejected++;
+    } else if(coin->coinValue[coinType] == MDB_COIN_TOKEN) {
+        coin->tokens++;
+    } else {
+        uint32_t value = (uint32_t)coin->coinValue[coinType] * coin->scaleFactor;
+        coin->credit += value;
+        coin->coinsAccepted++;
+        MDB_EVENT_INFO(MDB_MSG_COIN_DEPOSIT, coinType, value);
+    }
+}
+
+// DISPENSE: count in the high nibble, coin type in the low one
+static bool CoinDispense(uint8_t coinType, uint8_t count) {
+    if(coinType >= MDB_COIN_TYPES || count == 0 || count > MDB_COIN_DISPENSE_MAX) {
+        MDB_LogError(MDB_ERR_PARAMETER);
+        return false;
+    }
+    
+    uint8_t dispenseCmd[] = {MDB_COIN_DISPENSE, (count << 4) | coinType};
+    uint8_t respLen;
+    if(!CoinExchange(dispenseCmd, sizeof(dispenseCmd), &respLen)) {
+        return false;
+    }
+    mdb->coin.tubeCount[coinType] -= count < mdb->coin.tubeCount[coinType] ? count : mdb->coin.tubeCount[coinType];
+    return true;
+}
+
+// Runs in the changer's poll slot after a POLL that did not report the
+// changer busy. A step is one DISPENSE or PAYOUT, or a PAYOUT VALUE POLL
+// followed by PAYOUT STATUS once the value poll shows the payout ended.
+// Level 3 changers that offer it pay by value and choose the coins
+// themselves, others get DISPENSE of the largest coin that still fits.
+static void CoinPayoutStep(void) {
+    MDB_CoinChanger_t* coin = &mdb->coin;
+    uint8_t respLen;
+    
+    if(coin->payoutBusy) {
+        return;
+    }
+    
+    if(coin->enabledFeatures & MDB_COIN_FEATURE_ALT_PAYOUT) {
+        if(coin->payoutRequested == 0) {
+            uint32_t units = coin->payoutPending / coin->scaleFactor;
+            if(units == 0) {
+                CoinPayoutDone();
+                return;
+            }
+            uint8_t payoutCmd[] = {MDB_COIN_EXPANSION, MDB_COIN_EXP_PAYOUT, units > 0xFF ? 0xFF : units};
+            if(CoinExchange(payoutCmd, sizeof(payoutCmd), &respLen)) {
+                coin->payoutRequested = payoutCmd[2];
+            }
+            return;
+        }
+        
+        // PAYOUT VALUE POLL answers with progress until an ACK marks the
+        // end, PAYOUT STATUS then has the coins of each type paid
+        uint8_t valueCmd[] = {MDB_COIN_EXPANSION, MDB_COIN_EXP_PAYOUT_POLL};
+        uint8_t statusCmd[] = {MDB_COIN_EXPANSION, MDB_COIN_EXP_PAYOUT_STATUS};
+        if(!CoinExchange(valueCmd, sizeof(valueCmd), &respLen) || respLen > 1 ||
+           !CoinExchange(statusCmd, sizeof(statusCmd), &respLen) || respLen < 2) {
+            return;
+        }
+        uint32_t paid = 0;
+        for(uint8_t i = 0; i < respLen - 1 && i < MDB_COIN_TYPES; i++) {
+            if(coin->coinValue[i] != MDB_COIN_TOKEN) {
+                paid += (uint32_t)mdb->rxBuffer[i] * coin->coinValue[i] * coin->scaleFactor;
+            }
+        }
+        bool shortfall = paid < (uint32_t)coin->payoutRequested * coin->scaleFactor;
+        coin->payoutPaid += paid;
+        coin->payoutPending -= paid < coin->payoutPending ? paid : coin->payoutPending;
+        coin->payoutRequested = 0;
+        if(shortfall) {
+            CoinPayoutDone();
+        }
+        return;
+    }
+    
+    uint8_t best = MDB_COIN_TYPES;
+    for(uint8_t i = 0; i < MDB_COIN_TYPES; i++) {
+        uint32_t value = (uint32_t)coin->coinValue[i] * coin->scaleFactor;
+        if((coin->tubeRouting & (1u << i)) && coin->tubeCount[i] > 0 && coin->coinValue[i] != 0 &&
+           coin->coinValue[i] != MDB_COIN_TOKEN && value <= coin->payoutPending &&
+           (best == MDB_COIN_TYPES || coin->coinValue[i] > coin->coinValue[best])) {
+            best = i;
+        }
+    }
+    if(best == MDB_COIN_TYPES) {
+        CoinPayoutDone();
+        return;
+    }
+    
+    uint32_t value = (uint32_t)coin->coinValue[best] * coin->scaleFactor;
+    uint32_t count = coin->payoutPending / value;
+    if(count > coin->tubeCount[best]) {
+        count = coin->tubeCount[best];
+    }
+    if(count > MDB_COIN_DISPENSE_MAX) {
+        count = MDB_COIN_DISPENSE_MAX;
+    }
+    if(CoinDispense(best, (uint8_t)count)) {
+        coin->payoutPaid += count * value;
+        coin->payoutPending -= count * value;
+    }
+}
+
+// Whatever could not be paid is left in payoutShort
+static void CoinPayoutDone(void) {
+    MDB_CoinChanger_t* coin = &mdb->coin;
+    
+    coin->payoutShort = coin->payoutPending;
+    coin->payoutPending = 0;
+    coin->payoutRequested = 0;
+    coin->state = coin->acceptedCoins != 0 ? MDB_COIN_ENABLED : MDB_COIN_DISABLED;
+    MDB_CoinUpdateTubes();
+    MDB_EVENT_INFO(MDB_MSG_COIN_PAYOUT, coin->payoutPaid, coin->payoutShort);
+}
+#endif
+
+static bool WarmBoot(void) {
+#if MDB_CONFIG_CACHE_ENABLE
+    MDB_ConfigCache_t cache;
+    if(!MDB_ConfigCacheLoad(&cache)) {
+        return false;
+    }
+    
+    // A reader that lost power answers JUST RESET instead of its ID
+    MDB_PeripheralId_t peripheral;
+    if(!RequestPeripheralId(&peripheral) ||
+       memcmp(&peripheral, &cache.peripheral, sizeof(MDB_PeripheralId_t)) != 0) {
+        MDB_LOG_INFO("Reader changed or reset, full setup required");
+        return false;
+    }
+    
+    mdb->config = cache.config;
+    mdb->peripheral = peripheral;
+    MDB_SetState(MDB_STATE_DISABLED);
+    if(!MDB_EnableReader()) {
+        memset(&mdb->config, 0, sizeof(MDB_Config_t));
+        MDB_SetState(MDB_STATE_INACTIVE);
+        return false;
+    }
+    
+    VendJournalWrite(MDB_VEND_JOURNAL_IDLE);
+    return true;
+#else
+    return false;
+#endif
+}
+
+uint32_t MDB_Crc32(const void* data, uint32_t length) {
+    const uint8_t* bytes = (const uint8_t*)data;
+    uint32_t crc = 0xFFFFFFFFu;
+    while(length--) {
+        crc ^= *bytes++;
+        for(uint8_t bit = 0; bit < 8; bit++) {
+            crc = (crc >> 1) ^ (0xEDB88320u & -(crc & 1u));
+        }
+    }
+    return ~crc;
+}
+
+static uint8_t CalculateChecksum(uint8_t* data, uint8_t length) {
+    uint8_t sum = 0;
+    for(uint8_t i = 0; i < length; i++) {
+        sum += data[i];
+    }
+    return sum;
+}
+
+static bool SendCommand(uint8_t* data, uint8_t length) {
+    MDB_PROFILE_SCOPE(MDB_PROF_SEND_COMMAND);
+    if(length == 0 || length > MDB_MAX_MESSAGE_LENGTH - 1) { // Leave room for checksum
+        MDB_LogError(MDB_ERR_PARAMETER);
+        return false;
+    }
+    
+    // Save command for potential retry
+    memcpy(mdb->lastCommand, data, length);
+    mdb->lastCommandLength = length;
+    
+    // Address byte carries the mode bit, the checksum closes the frame
+    mdb->txBuffer[0] = data[0] | MDB_MODE_BIT;
+    for(uint8_t i = 1; i < length; i++) {
+        mdb->txBuffer[i] = data[i];
+    }
+    mdb->txBuffer[length] = CalculateChecksum(data, length);
+    
+    // Send data
+    MDB_STAGE(MDB_STAGE_TX_START, data[0]);
+    if(!BusSend(mdb->txBuffer, length + 1)) {
+        LogBusError(MDB_ERR_COMMUNICATION);
+        return false;
+    }
+    MDB_STAGE(MDB_STAGE_TX_DONE, data[0]);
+    
+    return true;
+}
+
+// ACK, NAK or RET from the VMC: one byte, no mode bit, no checksum
+static bool SendControl(uint8_t control) {
+    uint16_t word = control;
+    if(!BusSend(&word, 1)) {
+        LogBusError(MDB_ERR_COMMUNICATION);
+        return false;
+    }
+    return true;
+}
+
+// RET after a corrupt answer, the peripheral sends the same data again.
+// A repeat of the reader's answer is checked against the duplicate cache.
+static bool RequestRepeat(uint8_t* respLen) {
+    MDB_EVENT_ERROR(MDB_MSG_CHECKSUM_ERROR);
+    if(!SendControl(MDB_RET)) {
+        return false;
+    }
+    if(ReaderAddressed()) {
+        mdb->responseCache.retPending = true;
+    }
+    return WaitForResponse(mdb->rxBuffer, respLen);
+}
+
+// The answer being read belongs to the cashless reader, not the changer
+static bool ReaderAddressed(void) {
+    return (mdb->lastCommand[0] & MDB_ADDRESS_MASK) == MDB_CMD_RESET;
+}
+
+// Bus errors count against the device that was addressed
+static void LogBusError(MDB_Error_t error) {
+#if MDB_COIN_ENABLE
+    if(!ReaderAddressed()) {
+        mdb->coin.busErrors++;
+        return;
+    }
+#endif
+    MDB_LogError(error);
+}
+
+// Every frame to the peripheral leaves through here
+static bool BusSend(const uint16_t* words, uint8_t count) {
+#if MDB_BUS_TRACE
+    uint8_t data[MDB_MAX_MESSAGE_LENGTH];
+    for(uint8_t i = 0; i < count && i < MDB_MAX_MESSAGE_LENGTH; i++) {
+        data[i] = (uint8_t)words[i];
+    }
+    TraceFrame((words[0] & MDB_MODE_BIT) ? MDB_TRACE_MODE : 0, data, count);
+#endif
+    if(mdb->transport.send == NULL || !mdb->transport.send(mdb->transport.context, words, count)) {
+        return false;
+    }
+#if MDB_TIMING_MONITOR
+    mdb->busTxDone = BusMicros();
+#endif
+    return true;
+}
+
+// Peripheral frames end on the word with the mode bit set: a lone ACK or
+// NAK, or the checksum after data. Valid data is ACKed right away, the
+// reader would repeat it otherwise.
+static bool WaitForResponse(uint8_t* response, uint8_t* length) {
+    MDB_PROFILE_SCOPE(MDB_PROF_WAIT_RESPONSE);
+    uint32_t timeout = MDB_RESPONSE_TIMEOUT;
+    uint16_t word;
+    
+    *length = 0;
+    mdb->rxError = MDB_ERR_NONE;
+    do {
+        if(mdb->transport.receive == NULL || !mdb->transport.receive(mdb->transport.context, &word, timeout)) {
+            mdb->rxError = *length == 0 ? MDB_ERR_TIMEOUT : MDB_ERR_COMMUNICATION;
+            TRACE_FRAME(MDB_TRACE_RX, response, *length);
+            LogBusError(mdb->rxError);
+            return false;
+        }
+        if(*length >= MDB_MAX_MESSAGE_LENGTH) {
+            mdb->rxError = MDB_ERR_PARAMETER;
+            TRACE_FRAME(MDB_TRACE_RX, response, *length);
+            LogBusError(mdb->rxError);
+            return false;
+        }
+#if MDB_TIMING_MONITOR
+        // The limits are checked for the reader only
+        if(ReaderAddressed()) {
+            TimingSample(BusMicros(), *length == 0);
+        }
+#endif
+        if(*length == 0) {
+            MDB_STAGE(MDB_STAGE_RX_FIRST, (uint8_t)word);
+        }
+        response[(*length)++] = (uint8_t)word;
+        timeout = MDB_INTERBYTE_TIMEOUT;
+    } while(!(word & MDB_MODE_BIT));
+    MDB_STAGE(MDB_STAGE_RX_COMPLETE, response[0]);
+    TRACE_FRAME(MDB_TRACE_RX | MDB_TRACE_MODE, response, *length);
+    
+    if(*length > 1) {
+        if(CalculateChecksum(response, *length - 1) != response[*length - 1]) {
+            mdb->rxError = MDB_ERR_CHECKSUM;
+            LogBusError(mdb->rxError);
+            return false;
+        }
+        SendControl(MDB_ACK);
+    }
+    
+    return true;
+}
+
+#ifndef MDB_HOST_BUILD
+// 9-bit frames, the HAL takes one halfword per character
+static bool UartSend(void* context, const uint16_t* words, uint8_t count) {
+    return HAL_UART_Transmit((UART_HandleTypeDef*)context, (uint8_t*)words, count, 100) == HAL_OK;
+}
+
+static bool UartReceive(void* context, uint16_t* word, uint32_t timeout) {
+    return HAL_UART_Receive((UART_HandleTypeDef*)context, (uint8_t*)word, 1, timeout) == HAL_OK;
+}
+#endif
+
+void MDB_HandleError(MDB_Error_t error) {
+   MDB_PROFILE_SCOPE(MDB_PROF_HANDLE_ERROR);
+   MDB_LogError(error);
+
+   switch(error) {
+       case MDB_ERR_NAK:
+           // ExchangeCommand already resent the command MDB_NAK_RETRIES times
+           MDB_EVENT_ERROR(MDB_MSG_MAX_RETRIES);
+           mdb->retryCount = 0;
+           RequestRecovery(mdb->session.state >= MDB_STATE_ENABLED);
+           break;
+
+       case MDB_ERR_TIMEOUT:
+           MDB_EVENT_ERROR(MDB_MSG_COMM_TIMEOUT);
+           if(mdb->session.state != MDB_STATE_INACTIVE) {
+               RequestRecovery(mdb->session.state >= MDB_STATE_ENABLED);
+           }
+           break;
+
+       case MDB_ERR_CHECKSUM: {
+           // Request retransmission, the repeat is handled like the original
+           uint8_t respLen;
+           if(RequestRepeat(&respLen) && respLen > 1) {
+               MDB_ProcessMessage(mdb->rxBuffer, respLen);
+           }
+           break;
+       }
+
+       case MDB_ERR_STATE:
+           MDB_EVENT_ERROR(MDB_MSG_INVALID_STATE);
+           // Try to recover by completing current session
+           if(mdb->session.state > MDB_STATE_ENABLED) {
+               MDB_SessionComplete();
+           }
+           break;
+
+       case MDB_ERR_SEQUENCE:
+           MDB_EVENT_ERROR(MDB_MSG_SEQUENCE_ERROR);
+           // Try to recover by resetting to known state
+           if(mdb->session.state > MDB_STATE_ENABLED) {
+               MDB_SessionComplete();
+           } else {
+               RequestRecovery(mdb->session.state == MDB_STATE_ENABLED);
+           }
+           break;
+
+       case MDB_ERR_FUNDS:
+           MDB_EVENT_ERROR(MDB_MSG_INSUFFICIENT_FUNDS);
+           // Cancel current transaction
+           if(mdb->session.state == MDB_STATE_VEND) {
+               MDB_VendFailure();
+           }
+           break;
+
+       case MDB_ERR_HARDWARE:
+           MDB_EVENT_ERROR(MDB_MSG_HARDWARE_ERROR);
+           // Disable reader and schedule a full reset
+           MDB_DisableReader();
+           RequestRecovery(false);
+           break;
+
+       case MDB_ERR_COMMUNICATION:
+           MDB_EVENT_ERROR(MDB_MSG_COMM_ERROR);
+           // Re-establish communication on the next poll slot
+           MDB_DisableReader();
+           RequestRecovery(true);
+           break;
+
+       default:
+           MDB_EVENT_ERROR(MDB_MSG_UNKNOWN_ERROR, error);
+           // Try full reset for unknown errors
+           RequestRecovery(false);
+           break;
+   }
+
+   // Update error statistics, opening the breaker on error bursts
+   uint32_t currentTime = HAL_GetTick();
+   BreakerRecordFailure(currentTime);
+
+   // Log extended error information
+   MDB_ErrorLog_t errorEntry = {
+       .timestamp = currentTime,
+       .error = error,
+       .state = mdb->session.state,
+       .lastCommand = mdb->lastCommand[0],
+       .lastResponse = mdb->rxBuffer[0]
+   };
+   
+   // Add to error log array
+   memcpy(&mdb->errorLog[mdb->errorLogIndex], &errorEntry, sizeof(MDB_ErrorLog_t));
+   mdb->errorLogIndex = (mdb->errorLogIndex + 1) % MDB_ERROR_LOG_SIZE;
+
+   // If we have serious errors, consider dumping logs
+   if(error == MDB_ERR_HARDWARE || error == MDB_ERR_COMMUNICATION) {
+       mdb->seriousErrorCount++;
+       if(mdb->seriousErrorCount >= 3) {
+           MDB_DumpLogs();
+           mdb->seriousErrorCount = 0;
+       }
+   }
+}
+
+void MDB_LogMessage(MDB_LogLevel_t level, const char* format, ...) {
+    if(level == LOG_NONE || level > currentLogLevel) {
+        return;
+    }
+    
+    char line[MDB_LOG_LINE_LENGTH];
+    int length = snprintf(line, sizeof(line), "[%lu] %s ", (unsigned long)HAL_GetTick(), logLevelTag[level]);
+    
+    va_list args;
+    va_start(args, format);
+    length += vsnprintf(&line[length], sizeof(line) - length - 2, format, args);
+    va_end(args);
+    
+    if(length > (int)sizeof(line) - 3) {
+        length = sizeof(line) - 3; // Truncated
+    }
+    line[length++] = '\r';
+    line[length++] = '\n';
+    
+    // Never blocks, drops are counted by the sink
+    MDB_LogSinkWrite((uint8_t*)line, (uint16_t)length);
+}
+
+// Counts every low level error; MDB_HandleError decides on recovery
+void MDB_LogError(MDB_Error_t error) {
+    if(error <= MDB_ERR_HARDWARE) {
+        mdb->errorCounters[error]++;
+    }
+    MDB_EVENT_DEBUG(MDB_MSG_ERROR_RECORDED, error);
+}
+
+uint32_t MDB_GetErrorCount(MDB_Error_t error) {
+    return error <= MDB_ERR_HARDWARE ? mdb->errorCounters[error] : 0;
+}
+
+void MDB_LogTransaction(MDB_TransactionLog_t* transaction) {
+    if(transaction == NULL) {
+        return;
+    }
+    
+    // IDs only grow, so a record at or below the last logged one is a retry
+    if(transaction->transactionId != 0) {
+        if((int32_t)(transaction->transactionId - mdb->lastLoggedTransaction) <= 0) {
+            MDB_LOG_DEBUG("Duplicate transaction %lu not logged", (unsigned long)transaction->transactionId);
+            return;
+        }
+        mdb->lastLoggedTransaction = transaction->transactionId;
+    }
+    
+    memcpy(&mdb->transactionLog[mdb->transactionLogIndex], transaction, sizeof(MDB_TransactionLog_t));
+    mdb->transactionLogIndex = (mdb->transactionLogIndex + 1) % MDB_TRANSACTION_LOG_SIZE;
+    
+#if MDB_JOURNAL_ENABLE
+    // RAM log holds the recent window, the journal survives power cycles
+    MDB_JournalAppend(transaction);
+#endif
+    
+#if MDB_SETTLE_ENABLE
+    // Completed sales wait for the settlement uplink
+    if(transaction->success && transaction->transactionId != 0) {
+        MDB_SettleEnqueue(transaction);
+    }
+#endif
+}
+
+// Dumps are emitted a few lines at a time from MDB_Poll so a dump requested
+// during error handling adds no latency to the bus
+void MDB_DumpLogs(void) {
+    mdb->dumpActive = true;
+    mdb->dumpIndex = 0;
+}
+
+static void DumpLogsStep(void) {
+    while(mdb->dumpActive && MDB_LogSinkFree() >= MDB_LOG_LINE_LENGTH) {
+        if(mdb->dumpIndex < MDB_ERROR_LOG_SIZE) {
+            MDB_ErrorLog_t* entry = &mdb->errorLog[(mdb->errorLogIndex + mdb->dumpIndex) % MDB_ERROR_LOG_SIZE];
+            if(entry->timestamp != 0) {
+                MDB_LOG_ERROR("Error log: t=%lu error=%d state=%d cmd=0x%02X resp=0x%02X",
+                              (unsigned long)entry->timestamp, entry->error, entry->state,
+                              entry->lastCommand, entry->lastResponse);
+            }
+        } else if(mdb->dumpIndex < MDB_ERROR_LOG_SIZE + MDB_TRANSACTION_LOG_SIZE) {
+            uint8_t i = mdb->dumpIndex - MDB_ERROR_LOG_SIZE;
+            MDB_TransactionLog_t* entry = &mdb->transactionLog[(mdb->transactionLogIndex + i) % MDB_TRANSACTION_LOG_SIZE];
+            if(entry->timestamp != 0) {
+                MDB_LOG_ERROR("Transaction log: t=%lu type=%d amount=%lu item=%u success=%d error=%d",
+                              (unsigned long)entry->timestamp, entry->type, (unsigned long)entry->amount,
+                              entry->itemNumber, entry->success, entry->error);
+            }
+        } else {
+            mdb->dumpActive = false;
+            break;
+        }
+        mdb->dumpIndex++;
+    }
+}
+
+// Catalogued log message. Deferred builds store the ID and raw argument
+// words without formatting; format strings are not linked into the image.
+void MDB_LogEvent(MDB_LogLevel_t level, MDB_LogId_t id, ...) {
+    if(level > currentLogLevel || id >= MDB_MSG_COUNT) {
+        return;
+    }
+    
+    uint32_t args[MDB_DEFERRED_LOG_ARGS] = {0};
+    uint8_t argc = logArgCount[id];
+    va_list ap;
+    va_start(ap, id);
+    for(uint8_t i = 0; i < argc; i++) {
+        args[i] = va_arg(ap, uint32_t);
+    }
+    va_end(ap);
+    
+#if MDB_LOG_DEFERRED
+    MDB_DeferredLogRecord_t* record = &mdb->deferredLog[mdb->deferredLogHead];
+    record->timestamp = HAL_GetTick();
+    record->id = (uint16_t)id;
+    record->level = (uint8_t)level;
+    record->argc = argc;
+    memcpy(record->args, args, sizeof(args));
+    
+    // Keep the newest records, like the transaction and error logs
+    mdb->deferredLogHead = (mdb->deferredLogHead + 1) & (MDB_DEFERRED_LOG_SIZE - 1);
+    if(mdb->deferredLogHead == mdb->deferredLogTail) {
+        mdb->deferredLogTail = (mdb->deferredLogTail + 1) & (MDB_DEFERRED_LOG_SIZE - 1);
+        mdb->deferredLogOverwritten++;
+    }
+#else
+    MDB_LogMessage(level, logFormat[id], (unsigned int)args[0],
+                   (unsigned int)args[1], (unsigned int)args[2]);
+#endif
+}
+
+uint16_t MDB_ReadDeferredLog(MDB_DeferredLogRecord_t* records, uint16_t maxRecords) {
+    uint16_t count = 0;
+#if MDB_LOG_DEFERRED
+    while(count < maxRecords && mdb->deferredLogTail != mdb->deferredLogHead) {
+        records[count++] = mdb->deferredLog[mdb->deferredLogTail];
+        mdb->deferredLogTail = (mdb->deferredLogTail + 1) & (MDB_DEFERRED_LOG_SIZE - 1);
+    }
+#else
+    (void)records;
+    (void)maxRecords;
+#endif
+    return count;
+}
+
+uint32_t MDB_GetDeferredLogOverwritten(void) {
+#if MDB_LOG_DEFERRED
+    return mdb->deferredLogOverwritten;
+#else
+    return 0;
+#endif
+}
+
+// Drains the deferred log into a dump section for the host decoder.
+// The buffer must be word aligned. Returns the number of bytes written.
+uint32_t MDB_ExportDeferredLog(uint8_t* buffer, uint32_t size) {
+    if(buffer == NULL || size < sizeof(MDB_LogFileHeader_t)) {
+        return 0;
+    }
+    
+    uint32_t space = (size - sizeof(MDB_LogFileHeader_t)) / sizeof(MDB_DeferredLogRecord_t);
+    if(space > 0xFFFF) {
+        space = 0xFFFF;
+    }
+    
+    MDB_DeferredLogRecord_t* records = (MDB_DeferredLogRecord_t*)(buffer + sizeof(MDB_LogFileHeader_t));
+    MDB_LogFileHeader_t header = {
+        .magic = MDB_LOG_FILE_MAGIC,
+        .version = MDB_LOG_FILE_VERSION,
+        .section = MDB_LOG_SECTION_DEFERRED,
+        .recordSize = sizeof(MDB_DeferredLogRecord_t),
+        .recordCount = MDB_ReadDeferredLog(records, (uint16_t)space)
+    };
+    memcpy(buffer, &header, sizeof(header));
+    
+    return sizeof(header) + header.recordCount * sizeof(MDB_DeferredLogRecord_t);
+}
+
+// Writes transaction, error and deferred log sections, oldest first, in
+// the dump format read by Host/MdbLogTool.c. Returns the bytes written.
+uint32_t MDB_ExportLogs(uint8_t* buffer, uint32_t size) {
+    uint32_t offset = 0;
+    MDB_LogFileHeader_t header = {
+        .magic = MDB_LOG_FILE_MAGIC,
+        .version = MDB_LOG_FILE_VERSION
+    };
+    
+    if(buffer == NULL || size < 2 * sizeof(MDB_LogFileHeader_t)) {
+        return 0;
+    }
+    
+    // Transaction section
+    header.section = MDB_LOG_SECTION_TRANSACTION;
+    header.recordSize = sizeof(MDB_TransactionLog_t);
+    header.recordCount = 0;
+    offset += sizeof(header);
+    for(uint8_t i = 0; i < MDB_TRANSACTION_LOG_SIZE; i++) {
+        MDB_TransactionLog_t* entry = &mdb->transactionLog[(mdb->transactionLogIndex + i) % MDB_TRANSACTION_LOG_SIZE];
+        if(entry->timestamp == 0 || offset + sizeof(MDB_TransactionLog_t) > size - sizeof(header)) {
+            continue;
+        }
+        memcpy(buffer + offset, entry, sizeof(MDB_TransactionLog_t));
+        offset += sizeof(MDB_TransactionLog_t);
+        header.recordCount++;
+    }
+    memcpy(buffer, &header, sizeof(header));
+    
+    // Error section
+    uint32_t sectionStart = offset;
+    header.section = MDB_LOG_SECTION_ERROR;
+    header.recordSize = sizeof(MDB_ErrorLog_t);
+    header.recordCount = 0;
+    offset += sizeof(header);
+    for(uint8_t i = 0; i < MDB_ERROR_LOG_SIZE; i++) {
+        MDB_ErrorLog_t* entry = &mdb->errorLog[(mdb->errorLogIndex + i) % MDB_ERROR_LOG_SIZE];
+        if(entry->timestamp == 0 || offset + sizeof(MDB_ErrorLog_t) > size) {
+            continue;
+        }
+        memcpy(buffer + offset, entry, sizeof(MDB_ErrorLog_t));
+        offset += sizeof(MDB_ErrorLog_t);
+        header.recordCount++;
+    }
+    memcpy(buffer + sectionStart, &header, sizeof(header));
+    
+    // Deferred section, only when compiled in
+#if MDB_LOG_DEFERRED
+    offset += MDB_ExportDeferredLog(buffer + offset, size - offset);
+#endif
+    
+    return offset;
+}
+
+#if MDB_PROFILE
+void MDB_ProfileEnd(MDB_ProfScope_t* scope) {
+    uint32_t elapsed = MDB_CYCLES() - scope->start;
+    MDB_ProfStats_t* stats = &mdb->profile[scope->point];
+    if(stats->count == 0 || elapsed < stats->min) {
+        stats->min = elapsed;
+    }
+    if(elapsed > stats->max) {
+        stats->max = elapsed;
+    }
+    stats->total += elapsed;
+    stats->count++;
+}
+#endif
+
+// Cycles spent in point since start or the last MDB_ResetProfile, false
+// when profiling is not compiled in
+bool MDB_GetProfile(MDB_ProfPoint_t point, MDB_ProfStats_t* stats) {
+#if MDB_PROFILE
+    if(point >= MDB_PROF_COUNT || stats == NULL) {
+        return false;
+    }
+    *stats = mdb->profile[point];
+    return true;
+#else
+    (void)point;
+    (void)stats;
+    return false;
+#endif
+}
+
+void MDB_ResetProfile(void) {
+#if MDB_PROFILE
+    memset(mdb->profile, 0, sizeof(mdb->profile));
+#endif
+}
+
+// Counted since start or the last MDB_ResetTimingStats, NULL when the
+// monitor is not compiled in
+const MDB_TimingStats_t* MDB_GetTimingStats(void) {
+#if MDB_TIMING_MONITOR
+    return &mdb->timing;
+#else
+    return NULL;
+#endif
+}
+
+void MDB_ResetTimingStats(void) {
+#if MDB_TIMING_MONITOR
+    memset(&mdb->timing, 0, sizeof(mdb->timing));
+#endif
+}
+
+// Smallest time in microseconds that falls into bucket
+uint32_t MDB_HistogramBucketLow(uint8_t bucket) {
+    if(bucket < (1u << MDB_HISTOGRAM_SUB_BITS)) {
+        return bucket;
+    }
+    uint32_t exponent = (bucket >> MDB_HISTOGRAM_SUB_BITS) + MDB_HISTOGRAM_SUB_BITS - 1;
+    uint32_t mantissa = (1u << MDB_HISTOGRAM_SUB_BITS) | (bucket & ((1u << MDB_HISTOGRAM_SUB_BITS) - 1));
+    return mantissa << (exponent - MDB_HISTOGRAM_SUB_BITS);
+}
+
+// Lower bound of the bucket holding the given per mille of samples, so
+// within 12.5% below the true value; the maximum is kept exact
+uint32_t MDB_HistogramPercentile(const MDB_Histogram_t* histogram, uint16_t permille) {
+    if(histogram == NULL || histogram->samples == 0) {
+        return 0;
+    }
+    if(permille >= 1000) {
+        return histogram->max;
+    }
+    
+    uint64_t rank = (uint64_t)histogram->samples * permille / 1000;
+    uint64_t seen = 0;
+    for(uint8_t i = 0; i < MDB_HISTOGRAM_BUCKETS; i++) {
+        seen += histogram->counts[i];
+        if(seen > rank) {
+            return MDB_HistogramBucketLow(i);
+        }
+    }
+    return histogram->max;
+}
+
+const char* MDB_ProfileName(MDB_ProfPoint_t point) {
+    static const char* const profileName[MDB_PROF_COUNT] = {
+        "SendCommand", "WaitForResponse", "ProcessMessage", "JustReset", "BeginSession",
+        "VendApproved", "VendDenied", "EndSession", "PeripheralId", "HandleError"
+    };
+    return point < MDB_PROF_COUNT ? profileName[point] : "?";
+}
+
+// One line per path that ran, for pulling a profile off a field unit
+void MDB_LogProfile(void) {
+#if MDB_PROFILE
+    for(uint8_t i = 0; i < MDB_PROF_COUNT; i++) {
+        const MDB_ProfStats_t* stats = &mdb->profile[i];
+        if(stats->count != 0) {
+            MDB_LOG_INFO("Profile %s: n=%lu min=%lu max=%lu mean=%lu cycles",
+                         MDB_ProfileName((MDB_ProfPoint_t)i), (unsigned long)stats->count,
+                         (unsigned long)stats->min, (unsigned long)stats->max,
+                         (unsigned long)(stats->total / stats->count));
+        }
+    }
+#endif
+}
+
+#if !defined(MDB_HOST_BUILD) && (MDB_PROFILE || MDB_BUS_TRACE || MDB_TIMING_MONITOR)
+// DWT cycle counter, left running once started; a debugger may own it too
+static void CycleCounterStart(void) {
+    if(!(DWT->CTRL & DWT_CTRL_CYCCNTENA_Msk)) {
+        CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+        DWT->LAR = 0xC5ACCE55;
+        DWT->CYCCNT = 0;
+        DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+    }
+}
+#endif
+
+// Capture can be paused around traffic that is not worth keeping
+void MDB_PauseBusTrace(bool pause) {
+#if MDB_BUS_TRACE
+    mdb->busTracePaused = pause;
+#else
+    (void)pause;
+#endif
+}
+
+// Drains whole frame records, oldest first, into one trace chunk; chunks
+// from successive calls can be appended to the same file. Returns the
+// bytes written, 0 when nothing was captured.
+uint32_t MDB_ExportBusTrace(uint8_t* buffer, uint32_t size) {
+#if MDB_BUS_TRACE
+    if(buffer == NULL || size < sizeof(MDB_TraceFileHeader_t) ||
+       (mdb->busTraceUsed == 0 && mdb->busTraceDropped == 0)) {
+        return 0;
+    }
+    
+    MDB_TraceFileHeader_t header = {
+        .magic = MDB_TRACE_FILE_MAGIC,
+        .version = MDB_TRACE_FILE_VERSION,
+        .startMicros = mdb->busTraceStart,
+        .dropped = mdb->busTraceDropped
+    };
+    uint32_t offset = sizeof(header);
+    while(mdb->busTraceUsed > 0) {
+        uint32_t delta;
+        uint8_t recordSize = TraceRecordAt(mdb->busTraceTail, &delta);
+        if(offset + recordSize > size) {
+            break;
+        }
+        for(uint8_t i = 0; i < recordSize; i++) {
+            buffer[offset++] = mdb->busTrace[(mdb->busTraceTail + i) & (MDB_BUS_TRACE_SIZE - 1)];
+        }
+        mdb->busTraceTail = (mdb->busTraceTail + recordSize) & (MDB_BUS_TRACE_SIZE - 1);
+        mdb->busTraceUsed -= recordSize;
+        if(mdb->busTraceUsed > 0) {
+            TraceRecordAt(mdb->busTraceTail, &delta);
+            mdb->busTraceStart += delta;
+        }
+    }
+    header.length = offset - sizeof(header);
+    mdb->busTraceDropped = 0;
+    memcpy(buffer, &header, sizeof(header));
+    return offset;
+#else
+    (void)buffer;
+    (void)size;
+    return 0;
+#endif
+}
+
+#if MDB_BUS_TRACE || MDB_TIMING_MONITOR
+// The cycle counter wraps every 20 s at 216 MHz, so it only measures the
+// time since the last frame; longer gaps are taken from the tick
+static uint32_t BusMicros(void) {
+#ifdef MDB_HOST_BUILD
+    return (uint32_t)MdbHostMicros();
+#else
+    CycleCounterStart();
+    uint32_t cycles = DWT->CYCCNT;
+    uint32_t tick = HAL_GetTick();
+    if(tick - mdb->busClockTick < 10000) {
+        mdb->busClockMicros += (cycles - mdb->busClockCycles) / (SystemCoreClock / 1000000u);
+    } else {
+        mdb->busClockMicros += (tick - mdb->busClockTick) * 1000u;
+    }
+    mdb->busClockCycles = cycles;
+    mdb->busClockTick = tick;
+    return mdb->busClockMicros;
+#endif
+}
+#endif
+
+#if MDB_TIMING_MONITOR
+// Below 8 us one bucket per microsecond, above that 8 per power of two
+static uint8_t HistogramBucket(uint32_t micros) {
+    if(micros < (1u << MDB_HISTOGRAM_SUB_BITS)) {
+        return (uint8_t)micros;
+    }
+    uint32_t exponent = 31 - __builtin_clz(micros);
+    uint32_t bucket = ((exponent - MDB_HISTOGRAM_SUB_BITS + 1) << MDB_HISTOGRAM_SUB_BITS) +
+                      ((micros >> (exponent - MDB_HISTOGRAM_SUB_BITS)) & ((1u << MDB_HISTOGRAM_SUB_BITS) - 1));
+    return bucket < MDB_HISTOGRAM_BUCKETS ? (uint8_t)bucket : MDB_HISTOGRAM_BUCKETS - 1;
+}
+
+static void HistogramAdd(MDB_Histogram_t* histogram, uint32_t micros) {
+    histogram->counts[HistogramBucket(micros)]++;
+    histogram->samples++;
+    if(micros > histogram->max) {
+        histogram->max = micros;
+    }
+}
+
+// One received word. The gap runs from the end of the previous word on the
+// bus, ours or the reader's, to the start of this one.
+static void TimingSample(uint32_t now, bool firstWord) {
+    MDB_TimingStats_t* timing = &mdb->timing;
+    uint32_t elapsed = now - mdb->busTxDone;
+    uint32_t gap = elapsed > MDB_WORD_TIME_US ? elapsed - MDB_WORD_TIME_US : 0;
+    uint32_t limit = firstWord ? MDB_T_RESPONSE_US : MDB_T_INTERBYTE_US;
+    uint32_t* marginal = firstWord ? &timing->responseMarginal : &timing->interByteMarginal;
+    uint32_t* violations = firstWord ? &timing->responseViolations : &timing->interByteViolations;
+    
+    mdb->busTxDone = now;
+    HistogramAdd(firstWord ? &timing->response : &timing->interByte, gap);
+    if(gap > limit) {
+        (*violations)++;
+    } else if(gap * 100 > limit * MDB_TIMING_MARGIN_PCT) {
+        (*marginal)++;
+    } else {
+        return;
+    }
+    
+    uint32_t samples = timing->response.samples + timing->interByte.samples;
+    uint32_t nearLimit = timing->responseMarginal + timing->interByteMarginal;
+    if(!timing->flagged &&
+       (timing->responseViolations + timing->interByteViolations > 0 ||
+        (samples >= MDB_TIMING_FLAG_MIN && nearLimit * 1000 >= samples * MDB_TIMING_FLAG_PERMILLE))) {
+        timing->flagged = true;
+        MDB_EVENT_WARNING(MDB_MSG_TIMING_MARGINAL, timing->response.max, timing->interByte.max);
+    }
+}
+#endif
+
+#if MDB_BUS_TRACE
+
+// Appends one record, making room by dropping the oldest frames
+static void TraceFrame(uint8_t flags, const uint8_t* data, uint8_t count) {
+    if(mdb->busTracePaused) {
+        return;
+    }
+    
+    uint8_t record[MDB_TRACE_RECORD_MAX];
+    uint8_t size = 0;
+    uint32_t now = BusMicros();
+    uint32_t delta = mdb->busTraceUsed > 0 ? now - mdb->busTraceLast : 0;
+    if(count > MDB_MAX_MESSAGE_LENGTH) {
+        count = MDB_MAX_MESSAGE_LENGTH;
+    }
+    record[size++] = flags | count;
+    do {
+        record[size++] = (uint8_t)(delta & 0x7F) | (delta > 0x7F ? 0x80 : 0);
+        delta >>= 7;
+    } while(delta != 0);
+    memcpy(&record[size], data, count);
+    size += count;
+    
+    while(MDB_BUS_TRACE_SIZE - mdb->busTraceUsed < size) {
+        uint8_t dropped = TraceRecordAt(mdb->busTraceTail, &delta);
+        mdb->busTraceTail = (mdb->busTraceTail + dropped) & (MDB_BUS_TRACE_SIZE - 1);
+        mdb->busTraceUsed -= dropped;
+        mdb->busTraceDropped++;
+        if(mdb->busTraceUsed > 0) {
+            TraceRecordAt(mdb->busTraceTail, &delta);
+            mdb->busTraceStart += delta;
+        }
+    }
+    if(mdb->busTraceUsed == 0) {
+        mdb->busTraceStart = now;
+    }
+    
+    for(uint8_t i = 0; i < size; i++) {
+        mdb->busTrace[(mdb->busTraceHead + i) & (MDB_BUS_TRACE_SIZE - 1)] = record[i];
+    }
+    mdb->busTraceHead = (mdb->busTraceHead + size) & (MDB_BUS_TRACE_SIZE - 1);
+    mdb->busTraceUsed += size;
+    mdb->busTraceLast = now;
+}
+
+// Size of the record at offset, and its time since the previous record
+static uint8_t TraceRecordAt(uint16_t offset, uint32_t* delta) {
+    uint8_t count = mdb->busTrace[offset & (MDB_BUS_TRACE_SIZE - 1)] & MDB_TRACE_LENGTH_MASK;
+    uint8_t size = 1;
+    uint8_t byte;
+    *delta = 0;
+    do {
+        byte = mdb->busTrace[(offset + size) & (MDB_BUS_TRACE_SIZE - 1)];
+        *delta |= (uint32_t)(byte & 0x7F) << (7 * (size - 1));
+        size++;
+    } while((byte & 0x80) && size < 6);
+    return size + count;
+}
+#endif
+
+// A peripheral repeats its last response when our ACK is lost or when we
+// send RET. Such a copy matches the cached frame on length and checksum
+// first, so a fresh response is almost always rejected without memcmp.
+static bool IsDuplicateResponse(uint8_t* msg, uint8_t len) {
+    bool answeringRet = mdb->responseCache.retPending;
+    mdb->responseCache.retPending = false;
+    
+    if(len < 2) {
+        // Bare ACK/NAK closes the retransmission window
+        mdb->responseCache.valid = false;
+        return false;
+    }
+    
+    if(!mdb->responseCache.valid ||
+       mdb->responseCache.length != len ||
+       mdb->responseCache.checksum != msg[len - 1] ||
+       memcmp(mdb->responseCache.data, msg, len - 1) != 0) {
+        return false;
+    }
+    
+    if(answeringRet) {
+        MDB_EVENT_DEBUG(MDB_MSG_RET_DUPLICATE);
+    }
+    return true;
+}
+
+// Vend outcomes are not cached, a repeat of one is caught by its
+// transaction ID in OutcomeApplied
+static void CacheResponse(uint8_t* msg, uint8_t len) {
+    if(len < 2 || msg[0] == MDBRxCashlessVendApproved || msg[0] == MDBRxCashlessVendDenied) {
+        mdb->responseCache.valid = false;
+        return;
+    }
+    memcpy(mdb->responseCache.data, msg, len);
+    mdb->responseCache.length = len;
+    mdb->responseCache.checksum = msg[len - 1];
+    mdb->responseCache.valid = true;
+}
+
+MDB_BreakerState_t MDB_GetBreakerState(void) {
+    return mdb->breaker.state;
+}
+
+// Resets are never issued from inside error handling. They are deferred to
+// the cashless device's own poll slot so recovery cannot crowd out polls for
+// other devices sharing the bus.
+static void RequestRecovery(bool enableAfterReset) {
+    mdb->breaker.resetPending = true;
+    if(enableAfterReset) {
+        mdb->breaker.enableAfterReset = true;
+    }
+}
+
+static void BreakerRecordFailure(uint32_t currentTime) {
+    if(currentTime - mdb->breaker.windowStart > MDB_BREAKER_WINDOW) {
+        mdb->breaker.windowStart = currentTime;
+        mdb->breaker.failureCount = 0;
+    }
+    
+    if(mdb->breaker.failureCount < 0xFF) {
+        mdb->breaker.failureCount++;
+    }
+    
+    if(mdb->breaker.state == MDB_BREAKER_CLOSED &&
+       mdb->breaker.failureCount >= MDB_BREAKER_TRIP_COUNT) {
+        MDB_EVENT_ERROR(MDB_MSG_BREAKER_TRIPPED);
+        BreakerOpen(currentTime);
+    }
+}
+
+static void BreakerOpen(uint32_t currentTime) {
+    // Exponential backoff with equal jitter: half fixed, half random, so a
+    // fleet that browns out together does not reset in lockstep
+    uint32_t backoff = MDB_BREAKER_BACKOFF_MIN;
+    for(uint8_t i = 0; i < mdb->breaker.openCount && backoff < MDB_BREAKER_BACKOFF_MAX; i++) {
+        backoff <<= 1;
+    }
+    if(backoff > MDB_BREAKER_BACKOFF_MAX) {
+        backoff = MDB_BREAKER_BACKOFF_MAX;
+    }
+    uint32_t delay = backoff / 2 + NextJitter() % (backoff / 2 + 1);
+    
+    if(mdb->breaker.openCount < 0xFF) {
+        mdb->breaker.openCount++;
+    }
+    mdb->breaker.state = MDB_BREAKER_OPEN;
+    mdb->breaker.retryTime = currentTime + delay;
+    mdb->breaker.resetPending = true;
+    mdb->breaker.failureCount = 0;
+    mdb->breaker.windowStart = currentTime;
+    
+    MDB_EVENT_WARNING(MDB_MSG_BREAKER_OPEN, delay);
+}
+
+// Returns true when the poll slot is free for normal traffic
+static bool BreakerService(uint32_t currentTime) {
+    if(mdb->breaker.state == MDB_BREAKER_OPEN) {
+        if((int32_t)(currentTime - mdb->breaker.retryTime) < 0) {
+            return false; // Quarantined, leave the bus to other devices
+        }
+        mdb->breaker.state = MDB_BREAKER_HALF_OPEN;
+        MDB_EVENT_INFO(MDB_MSG_BREAKER_HALF_OPEN);
+    }
+    
+    if(!mdb->breaker.resetPending) {
+        return true;
+    }
+    
+    // One reset attempt per poll slot
+    mdb->breaker.resetPending = false;
+    bool recovered = MDB_Reset();
+    if(recovered && mdb->breaker.enableAfterReset) {
+        recovered = SetupReader() && MDB_EnableReader();
+    }
+    
+    if(recovered) {
+        mdb->breaker.enableAfterReset = false;
+        if(mdb->breaker.state == MDB_BREAKER_HALF_OPEN) {
+            MDB_EVENT_INFO(MDB_MSG_BREAKER_CLOSED);
+            mdb->breaker.state = MDB_BREAKER_CLOSED;
+            mdb->breaker.openCount = 0;
+            mdb->breaker.failureCount = 0;
+        }
+    } else if(mdb->breaker.state == MDB_BREAKER_HALF_OPEN) {
+        BreakerOpen(currentTime);
+    } else {
+        mdb->breaker.resetPending = true;
+        BreakerRecordFailure(currentTime);
+    }
+    
+    return false;
+}
+
+// xorshift32, seeded from the device UID so readers on different machines
+// back off on different schedules
+static uint32_t NextJitter(void) {
+    if(mdb->jitterState == 0) {
+        mdb->jitterState = HAL_GetUIDw0() ^ HAL_GetTick() ^ 0x9E3779B9u;
+        if(mdb->jitterState == 0) {
+            mdb->jitterState = 0x9E3779B9u;
+        }
+    }
+    mdb->jitterState ^= mdb->jitterState << 13;
+    mdb->jitterState ^= mdb->jitterState >> 17;
+    mdb->jitterState ^= mdb->jitterState << 5;
+    return mdb->jitterState;
+}
+
+// Yardımcı fonksiyon - Toplu hata bilgisi yazdırma
+void MDB_DumpErrorStats(void) {
+   uint32_t errorCounts[MDB_ERR_HARDWARE + 1] = {0};
+   uint32_t totalErrors = 0;
+   
+   // Hata sayılarını hesapla
+   for(int i = 0; i < MDB_ERROR_LOG_SIZE; i++) {
+       if(mdb->errorLog[i].timestamp != 0) {
+           errorCounts[mdb->errorLog[i].error]++;
+           totalErrors++;
+       }
+   }
+
+   // İstatistikleri yazdır
+   MDB_LOG_INFO("=== Error Statistics ===");
+   MDB_LOG_INFO("Total Errors: %lu", totalErrors);
+   
+   for(int i = 0; i <= MDB_ERR_HARDWARE; i++) {
+       if(errorCounts[i] > 0) {
+           MDB_LOG_INFO("Error %d: Count=%lu (%.1f%%)", i, errorCounts[i],
+                        (float)errorCounts[i] / totalErrors * 100.0f);
+       }
+   }
+}
+
+// Reader capabilities that shape the session, from the negotiated config
+static void UpdateSessionOptions(void) {
+    bool level2 = mdb->config.featureLevel >= 2;
+    mdb->session.multivend = level2 && (mdb->config.miscOptions & MDB_READER_OPT_MULTIVEND) != 0;
+    mdb->session.refundable = level2 && (mdb->config.miscOptions & MDB_READER_OPT_REFUNDS) != 0;
+    mdb->session.alwaysIdle = (mdb->config.optionalFeatures & MDB_FEATURE_ALWAYS_IDLE) != 0;
+}
+
+static bool QueueVend(uint16_t itemNumber, uint32_t amount) {
+    if(mdb->session.pendingCount >= MDB_MULTIVEND_QUEUE) {
+        MDB_LogError(MDB_ERR_STATE);
+        return false;
+    }
+    
+    uint8_t slot = (mdb->session.pendingHead + mdb->session.pendingCount) % MDB_MULTIVEND_QUEUE;
+    mdb->session.pendingVends[slot].itemNumber = itemNumber;
+    mdb->session.pendingVends[slot].amount = amount;
+    mdb->session.pendingCount++;
+    MDB_LOG_DEBUG("Vend queued: item=%u depth=%u", itemNumber, mdb->session.pendingCount);
+    return true;
+}
+
+// VEND SUCCESS or FAILURE, then the next queued request. Requests queued
+// behind an outcome or request the reader never took are dropped, not
+// left waiting in an idle session.
+static bool SendOutcome(uint8_t* vendCmd, uint8_t length) {
+    if(!ExchangeCommand(vendCmd, length)) {
+        if(mdb->session.pendingCount > 0) {
+            MDB_LOG_WARNING("Vend outcome not sent, %u queued vends dropped", mdb->session.pendingCount);
+            mdb->session.pendingCount = 0;
+        }
+        return false;
+    }
+    return IssueQueuedVend();
+}
+
+static bool IssueQueuedVend(void) {
+    if(mdb->session.pendingCount == 0 || mdb->session.state != MDB_STATE_SESSION_IDLE) {
+        return true;
+    }
+    
+    MDB_PendingVend_t next = mdb->session.pendingVends[mdb->session.pendingHead];
+    mdb->session.pendingHead = (mdb->session.pendingHead + 1) % MDB_MULTIVEND_QUEUE;
+    mdb->session.pendingCount--;
+    if(!MDB_VendRequest(next.itemNumber, next.amount)) {
+        mdb->session.pendingCount = 0;
+        return false;
+    }
+    return true;
+}
+
+// Transaction IDs continue across resets from the write-ahead record and
+// the flash journal, whichever is newer
+static void SeedTransactionId(void) {
+    uint32_t last = 0;
+    bool pending = false;
+    MDB_VendJournal_t entry;
+    if(VendJournalLoad(&entry)) {
+        last = entry.transactionId;
+        pending = entry.state == MDB_VEND_JOURNAL_REQUESTED || entry.state == MDB_VEND_JOURNAL_APPROVED;
+    }
+    
+#if MDB_JOURNAL_ENABLE
+    MDB_TransactionLog_t record;
+    if(MDB_JournalRead(MDB_JournalNextSequence() - 1, &record) &&
+       (int32_t)(record.transactionId - last) > 0) {
+        last = record.transactionId;
+        pending = false;
+    }
+#endif
+    
+    mdb->nextTransactionId = last + 1;
+    if(mdb->nextTransactionId == 0) {
+        mdb->nextTransactionId = 1;
+    }
+    
+    // An interrupted vend still gets its one log record from recovery
+    mdb->lastLoggedTransaction = pending ? last - 1 : last;
+}
+
+// Marks the current transaction's outcome as applied, false the first time
+static bool OutcomeApplied(void) {
+    if(mdb->session.outcomeId == mdb->session.transactionId) {
+        MDB_LOG_DEBUG("Duplicate outcome for transaction %lu ignored", (unsigned long)mdb->session.transactionId);
+        return true;
+    }
+    mdb->session.outcomeId = mdb->session.transactionId;
+    return false;
 }
-}
\ No newline at end of file
@@ -0,0 +1,142 @@
+// mdbflash.c
+// Internal flash primitives and the warm-boot configuration cache.
+//
+// The cache keeps the negotiated MDB_Config_t and the reader's Peripheral
+// ID in one small sector. Entries are appended in fixed size slots and the
+// newest valid one wins, so the sector is erased only once every
+// MDB_CONFIG_CACHE_SIZE / MDB_CONFIG_CACHE_SLOT updates.
+
+#include "MDB.h"
+#include <stddef.h>
+
+#if MDB_JOURNAL_ENABLE && MDB_CONFIG_CACHE_ENABLE
+_Static_assert(MDB_CONFIG_CACHE_ADDR + MDB_CONFIG_CACHE_SIZE <= MDB_JOURNAL_BASE_ADDR ||
+               MDB_CONFIG_CACHE_ADDR >= MDB_JOURNAL_BASE_ADDR + MDB_JOURNAL_SECTOR_COUNT * MDB_JOURNAL_SECTOR_SIZE,
+               "Config cache overlaps the journal sectors");
+#endif
+
+#if MDB_JOURNAL_ENABLE || MDB_CONFIG_CACHE_ENABLE
+
+bool MDB_FlashEraseSector(uint32_t sector) {
+    FLASH_EraseInitTypeDef erase = {
+        .TypeErase = FLASH_TYPEERASE_SECTORS,
+        .Sector = sector,
+        .NbSectors = 1,
+        .VoltageRange = FLASH_VOLTAGE_RANGE_3
+    };
+    uint32_t sectorError = 0;
+
+    HAL_FLASH_Unlock();
+    HAL_StatusTypeDef status = HAL_FLASHEx_Erase(&erase, &sectorError);
+    HAL_FLASH_Lock();
+    return status == HAL_OK;
+}
+
+// Programs whole words in ascending address order within one unlock/lock
+// cycle. Address and length must be multiples of 32 bytes so the data
+// cache can be invalidated by line afterwards.
+bool MDB_FlashProgram(uint32_t address, const void* data, uint32_t length) {
+    const uint32_t* words = (const uint32_t*)data;
+    bool ok = true;
+
+    HAL_FLASH_Unlock();
+    for(uint32_t w = 0; w < length / 4; w++) {
+        if(HAL_FLASH_Program(FLASH_TYPEPROGRAM_WORD, address + w * 4, words[w]) != HAL_OK) {
+            ok = false;
+            break;
+        }
+    }
+    HAL_FLASH_Lock();
+
+#if (__DCACHE_PRESENT == 1U)
+    // Flash is read through the cache, drop stale lines
+    SCB_InvalidateDCache_by_Addr((uint32_t*)address, (int32_t)length);
+#endif
+    return ok;
+}
+
+#endif
+
+#if MDB_CONFIG_CACHE_ENABLE
+
+#define CACHE_SLOTS  (MDB_CONFIG_CACHE_SIZE / MDB_CONFIG_CACHE_SLOT)
+
+_Static_assert(sizeof(MDB_ConfigCache_t) <= MDB_CONFIG_CACHE_SLOT, "Config cache entry exceeds its slot");
+
+// Private function declarations
+static const MDB_ConfigCache_t* CacheSlot(uint32_t slot);
+static bool CacheEntryValid(const MDB_ConfigCache_t* entry);
+static uint32_t CacheFirstFree(void);
+
+bool MDB_ConfigCacheLoad(MDB_ConfigCache_t* entry) {
+    // Newest entry sits just before the first erased slot; a torn newest
+    // entry falls back to the one before it
+    for(uint32_t slot = CacheFirstFree(); slot > 0; slot--) {
+        const MDB_ConfigCache_t* candidate = CacheSlot(slot - 1);
+        if(CacheEntryValid(candidate)) {
+            *entry = *candidate;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool MDB_ConfigCacheStore(const MDB_Config_t* config, const MDB_PeripheralId_t* peripheral) {
+    MDB_ConfigCache_t current;
+    bool haveCurrent = MDB_ConfigCacheLoad(&current);
+
+    // Identical data is not rewritten, most boots cost no flash wear at all
+    if(haveCurrent &&
+       memcmp(&current.config, config, sizeof(MDB_Config_t)) == 0 &&
+       memcmp(&current.peripheral, peripheral, sizeof(MDB_PeripheralId_t)) == 0) {
+        return true;
+    }
+
+    uint32_t slot = CacheFirstFree();
+    if(slot >= CACHE_SLOTS) {
+        if(!MDB_FlashEraseSector(MDB_CONFIG_CACHE_SECTOR)) {
+            MDB_LogError(MDB_ERR_HARDWARE);
+            return false;
+        }
+        slot = 0;
+    }
+
+    uint8_t raw[MDB_CONFIG_CACHE_SLOT] __attribute__((aligned(4)));
+    MDB_ConfigCache_t* entry = (MDB_ConfigCache_t*)raw;
+    memset(raw, 0xFF, sizeof(raw));
+    memset(entry, 0, sizeof(MDB_ConfigCache_t));
+    entry->magic = MDB_CONFIG_CACHE_MAGIC;
+    entry->sequence = haveCurrent ? current.sequence + 1 : 1;
+    entry->config = *config;
+    entry->peripheral = *peripheral;
+    entry->crc = MDB_Crc32(entry, offsetof(MDB_ConfigCache_t, crc));
+
+    MDB_LOG_INFO("Caching reader configuration, slot %lu", (unsigned long)slot);
+    return MDB_FlashProgram((uint32_t)CacheSlot(slot), raw, sizeof(raw));
+}
+
+static const MDB_ConfigCache_t* CacheSlot(uint32_t slot) {
+    return (const MDB_ConfigCache_t*)(MDB_CONFIG_CACHE_ADDR + slot * MDB_CONFIG_CACHE_SLOT);
+}
+
+static bool CacheEntryValid(const MDB_ConfigCache_t* entry) {
+    return entry->magic == MDB_CONFIG_CACHE_MAGIC &&
+           entry->crc == MDB_Crc32(entry, offsetof(MDB_ConfigCache_t, crc));
+}
+
+// Slots are written front to back, binary search for the first erased one
+static uint32_t CacheFirstFree(void) {
+    uint32_t low = 0;
+    uint32_t high = CACHE_SLOTS;
+    while(low < high) {
+        uint32_t mid = low + (high - low) / 2;
+        if(CacheSlot(mid)->magic != 0xFFFFFFFFu) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+#endif
@@ -0,0 +1,269 @@
+// mdbjournal.c
+// Append-only transaction journal in internal flash.
+//
+// The journal owns MDB_JOURNAL_SECTOR_COUNT equally sized, consecutive
+// flash sectors used round-robin, so every sector sees the same number of
+// erases. Each sector starts with a header slot carrying a sector sequence
+// number and its erase count, followed by fixed size record slots that are
+// only ever programmed in order.
+//
+// Because slots fill strictly front to back, the write head is recovered
+// at boot by reading the sector headers and binary searching the active
+// sector for its first erased slot: O(sectors + log slots) flash reads
+// instead of a full scan.
+
+#include "MDB.h"
+#include <stddef.h>
+
+#if MDB_JOURNAL_ENABLE
+
+#define JOURNAL_SLOT_SIZE        sizeof(MDB_JournalSlot_t)
+#define JOURNAL_SLOTS_PER_SECTOR (MDB_JOURNAL_SECTOR_SIZE / JOURNAL_SLOT_SIZE)
+#define JOURNAL_ERASED           0xFFFFFFFFu
+
+typedef struct {
+    uint32_t magic;
+    uint32_t sectorSequence;
+    uint32_t eraseCount;
+    uint32_t firstSequence;
+    uint32_t reserved[3];
+    uint32_t crc;
+} MDB_JournalSectorHeader_t;
+
+_Static_assert(MDB_JOURNAL_SECTOR_COUNT >= 2, "Journal needs a sector to keep while the next is erased");
+_Static_assert(sizeof(MDB_JournalSectorHeader_t) == sizeof(MDB_JournalSlot_t),
+               "Sector header must occupy exactly one slot");
+
+// Private variables
+static bool journalMounted = false;
+static uint8_t activeSector = 0;
+static uint32_t activeSectorSequence = 0;
+static uint32_t activeEraseCount = 0;
+static uint32_t writeSlot = 0;             // Next free slot in the active sector
+static uint32_t nextSequence = 0;
+static bool eraseNeeded = false;
+
+static MDB_JournalSlot_t batch[MDB_JOURNAL_BATCH];
+static uint8_t batchCount = 0;
+static uint32_t batchStartTime = 0;
+
+// Private function declarations
+static uint32_t SectorAddress(uint8_t sector);
+static const MDB_JournalSlot_t* SlotAt(uint8_t sector, uint32_t slot);
+static bool ReadSectorHeader(uint8_t sector, MDB_JournalSectorHeader_t* header);
+static bool EraseAndFormat(uint8_t sector, uint32_t sectorSequence, uint32_t eraseCount);
+
+bool MDB_JournalInit(void) {
+    if(journalMounted) {
+        return true;
+    }
+
+    // Active sector is the valid one with the newest sector sequence
+    MDB_JournalSectorHeader_t header;
+    bool found = false;
+    for(uint8_t sector = 0; sector < MDB_JOURNAL_SECTOR_COUNT; sector++) {
+        if(ReadSectorHeader(sector, &header) &&
+           (!found || (int32_t)(header.sectorSequence - activeSectorSequence) > 0)) {
+            found = true;
+            activeSector = sector;
+            activeSectorSequence = header.sectorSequence;
+            activeEraseCount = header.eraseCount;
+            nextSequence = header.firstSequence;
+        }
+    }
+
+    if(!found) {
+        MDB_LOG_INFO("Journal empty, formatting");
+        nextSequence = 1;
+        if(!EraseAndFormat(0, 1, 1)) {
+            return false;
+        }
+        activeSector = 0;
+        activeSectorSequence = 1;
+        activeEraseCount = 1;
+        writeSlot = 1;
+        journalMounted = true;
+        return true;
+    }
+
+    // Binary search for the first erased slot, slot 0 is the header
+    uint32_t low = 1;
+    uint32_t high = JOURNAL_SLOTS_PER_SECTOR;
+    while(low < high) {
+        uint32_t mid = low + (high - low) / 2;
+        if(SlotAt(activeSector, mid)->sequence != JOURNAL_ERASED) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    writeSlot = low;
+
+    // A torn last slot still consumed its sequence number
+    if(writeSlot > 1) {
+        nextSequence += writeSlot - 1;
+    }
+    eraseNeeded = writeSlot >= JOURNAL_SLOTS_PER_SECTOR;
+
+    journalMounted = true;
+    MDB_LOG_INFO("Journal mounted: sector=%u slot=%lu next=%lu",
+                 activeSector, (unsigned long)writeSlot, (unsigned long)nextSequence);
+    return true;
+}
+
+// Records are batched in RAM and programmed together by MDB_JournalFlush
+bool MDB_JournalAppend(const MDB_TransactionLog_t* record) {
+    if(!journalMounted || record == NULL) {
+        return false;
+    }
+
+    if(batchCount >= MDB_JOURNAL_BATCH && !MDB_JournalFlush()) {
+        return false;
+    }
+
+    MDB_JournalSlot_t* slot = &batch[batchCount];
+    memset(slot, 0, sizeof(MDB_JournalSlot_t));
+    slot->record = *record;
+    if(batchCount == 0) {
+        batchStartTime = HAL_GetTick();
+    }
+    batchCount++;
+
+    return batchCount < MDB_JOURNAL_BATCH || MDB_JournalFlush();
+}
+
+bool MDB_JournalFlush(void) {
+    uint8_t written = 0;
+
+    while(written < batchCount) {
+        if(writeSlot >= JOURNAL_SLOTS_PER_SECTOR) {
+            // Rotation needs an erase, which waits for an idle bus
+            eraseNeeded = true;
+            break;
+        }
+
+        uint32_t room = JOURNAL_SLOTS_PER_SECTOR - writeSlot;
+        uint8_t count = batchCount - written;
+        if(count > room) {
+            count = (uint8_t)room;
+        }
+
+        for(uint8_t i = 0; i < count; i++) {
+            MDB_JournalSlot_t* slot = &batch[written + i];
+            slot->sequence = nextSequence + i;
+            slot->crc = MDB_Crc32(slot, offsetof(MDB_JournalSlot_t, crc));
+        }
+
+        // One unlock/lock cycle per batch. Words go out in order, so the
+        // sequence word of a torn slot still reads as used at boot.
+        if(!MDB_FlashProgram((uint32_t)SlotAt(activeSector, writeSlot), &batch[written],
+                             count * JOURNAL_SLOT_SIZE)) {
+            MDB_LogError(MDB_ERR_HARDWARE);
+            break;
+        }
+
+        writeSlot += count;
+        nextSequence += count;
+        written += count;
+    }
+
+    // Keep whatever could not be written for the next flush
+    if(written > 0) {
+        memmove(&batch[0], &batch[written], (batchCount - written) * sizeof(MDB_JournalSlot_t));
+        batchCount -= written;
+    }
+    return batchCount == 0;
+}
+
+// Call from the main loop. Sector erases stall flash reads for a long time
+// on single bank parts, so they only happen while the bus is idle.
+void MDB_JournalService(bool busIdle) {
+    if(!journalMounted) {
+        return;
+    }
+
+    if(batchCount > 0 && HAL_GetTick() - batchStartTime >= MDB_JOURNAL_FLUSH_INTERVAL) {
+        MDB_JournalFlush();
+    }
+
+    if(eraseNeeded && busIdle) {
+        uint8_t sector = (activeSector + 1) % MDB_JOURNAL_SECTOR_COUNT;
+        MDB_JournalSectorHeader_t header;
+        uint32_t eraseCount = ReadSectorHeader(sector, &header) ? header.eraseCount + 1 : activeEraseCount;
+
+        // The oldest sector is recycled, its records are lost
+        if(EraseAndFormat(sector, activeSectorSequence + 1, eraseCount)) {
+            activeSector = sector;
+            activeSectorSequence++;
+            activeEraseCount = eraseCount;
+            writeSlot = 1;
+            eraseNeeded = false;
+            MDB_JournalFlush();
+        }
+    }
+}
+
+// Looks up a record by journal sequence number, O(sectors)
+bool MDB_JournalRead(uint32_t sequence, MDB_TransactionLog_t* record) {
+    if(!journalMounted || record == NULL) {
+        return false;
+    }
+
+    MDB_JournalSectorHeader_t header;
+    for(uint8_t sector = 0; sector < MDB_JOURNAL_SECTOR_COUNT; sector++) {
+        if(!ReadSectorHeader(sector, &header)) {
+            continue;
+        }
+        uint32_t index = sequence - header.firstSequence + 1;
+        if(index < 1 || index >= JOURNAL_SLOTS_PER_SECTOR) {
+            continue;
+        }
+        const MDB_JournalSlot_t* slot = SlotAt(sector, index);
+        if(slot->sequence != sequence ||
+           slot->crc != MDB_Crc32(slot, offsetof(MDB_JournalSlot_t, crc))) {
+            return false; // Torn or not yet written
+        }
+        *record = slot->record;
+        return true;
+    }
+    return false;
+}
+
+// Sequence number the next appended record will get once flushed
+uint32_t MDB_JournalNextSequence(void) {
+    return nextSequence + batchCount;
+}
+
+static uint32_t SectorAddress(uint8_t sector) {
+    return MDB_JOURNAL_BASE_ADDR + (uint32_t)sector * MDB_JOURNAL_SECTOR_SIZE;
+}
+
+static const MDB_JournalSlot_t* SlotAt(uint8_t sector, uint32_t slot) {
+    return (const MDB_JournalSlot_t*)(SectorAddress(sector) + slot * JOURNAL_SLOT_SIZE);
+}
+
+static bool ReadSectorHeader(uint8_t sector, MDB_JournalSectorHeader_t* header) {
+    memcpy(header, (const void*)SectorAddress(sector), sizeof(MDB_JournalSectorHeader_t));
+    return header->magic == MDB_JOURNAL_MAGIC &&
+           header->crc == MDB_Crc32(header, offsetof(MDB_JournalSectorHeader_t, crc));
+}
+
+static bool EraseAndFormat(uint8_t sector, uint32_t sectorSequence, uint32_t eraseCount) {
+    if(!MDB_FlashEraseSector(MDB_JOURNAL_SECTOR_FIRST + sector)) {
+        MDB_LOG_ERROR("Journal erase failed: sector=%u", sector);
+        return false;
+    }
+
+    MDB_JournalSectorHeader_t header = {
+        .magic = MDB_JOURNAL_MAGIC,
+        .sectorSequence = sectorSequence,
+        .eraseCount = eraseCount,
+        .firstSequence = nextSequence
+    };
+    memset(header.reserved, 0xFF, sizeof(header.reserved));
+    header.crc = MDB_Crc32(&header, offsetof(MDB_JournalSectorHeader_t, crc));
+
+    return MDB_FlashProgram(SectorAddress(sector), &header, sizeof(header));
+}
+
+#endif
@@ -0,0 +1,150 @@
+// mdblogsink.c
+// Non-blocking log output. Writers copy into a RAM ring and return at
+// once; the ring is drained in the background over a second UART by DMA,
+// over ITM/SWO, or to stdout on host builds. When the ring is full the
+// message is dropped and counted rather than stalling MDB bus handling.
+
+#include "MDB.h"
+
+#if MDB_LOG_SINK == MDB_LOG_SINK_UART_DMA
+extern UART_HandleTypeDef MDB_LOG_UART;  // Log UART interface
+#endif
+
+// Private variables
+static uint8_t sinkBuffer[MDB_LOG_SINK_SIZE] __attribute__((aligned(32)));
+static volatile uint16_t sinkHead = 0;     // Written by producers
+static volatile uint16_t sinkTail = 0;     // Advanced by the drain
+static volatile uint16_t sinkInFlight = 0; // Bytes owned by the DMA
+static volatile uint32_t sinkDropped = 0;
+static uint32_t sinkDroppedReported = 0;
+
+// Private function declarations
+static uint16_t SinkUsed(void);
+static bool SinkPut(const uint8_t* data, uint16_t length);
+#if MDB_LOG_SINK == MDB_LOG_SINK_UART_DMA
+static void SinkStartTransfer(void);
+#endif
+
+bool MDB_LogSinkWrite(const uint8_t* data, uint16_t length) {
+    // Report drops as soon as there is room again so gaps are visible
+    uint32_t dropped = sinkDropped;
+    if(dropped != sinkDroppedReported) {
+        char note[40];
+        int noteLength = snprintf(note, sizeof(note), "[log] %lu messages dropped\r\n",
+                                  (unsigned long)(dropped - sinkDroppedReported));
+        if(noteLength > 0 && SinkPut((const uint8_t*)note, (uint16_t)noteLength)) {
+            sinkDroppedReported = dropped;
+        }
+    }
+
+    if(!SinkPut(data, length)) {
+        sinkDropped++;
+        return false;
+    }
+
+#if MDB_LOG_SINK == MDB_LOG_SINK_UART_DMA
+    SinkStartTransfer();
+#endif
+    return true;
+}
+
+uint16_t MDB_LogSinkFree(void) {
+    return (uint16_t)(MDB_LOG_SINK_SIZE - 1 - SinkUsed());
+}
+
+uint32_t MDB_LogSinkDropped(void) {
+    return sinkDropped;
+}
+
+// Call from the main loop. Never waits on the output device.
+void MDB_LogSinkService(void) {
+#if MDB_LOG_SINK == MDB_LOG_SINK_UART_DMA
+    SinkStartTransfer();
+#elif MDB_LOG_SINK == MDB_LOG_SINK_ITM
+    // Without a debugger attached ITM is disabled, discard instead of filling up
+    if(!(ITM->TCR & ITM_TCR_ITMENA_Msk) || !(ITM->TER & 1UL)) {
+        sinkTail = sinkHead;
+        return;
+    }
+
+    // Feed stimulus port 0 only while its FIFO has room
+    uint16_t budget = MDB_LOG_ITM_BUDGET;
+    while(budget-- > 0 && sinkTail != sinkHead && ITM->PORT[0].u32 != 0) {
+        ITM->PORT[0].u8 = sinkBuffer[sinkTail];
+        sinkTail = (sinkTail + 1) & (MDB_LOG_SINK_SIZE - 1);
+    }
+#elif MDB_LOG_SINK == MDB_LOG_SINK_STDIO
+    while(sinkTail != sinkHead) {
+        uint16_t head = sinkHead;
+        uint16_t chunk = head > sinkTail ? head - sinkTail : MDB_LOG_SINK_SIZE - sinkTail;
+        fwrite(&sinkBuffer[sinkTail], 1, chunk, stdout);
+        sinkTail = (sinkTail + chunk) & (MDB_LOG_SINK_SIZE - 1);
+    }
+#else
+    sinkTail = sinkHead;
+#endif
+}
+
+// Call from HAL_UART_TxCpltCallback
+void MDB_LogSinkTxComplete(UART_HandleTypeDef* huart) {
+#if MDB_LOG_SINK == MDB_LOG_SINK_UART_DMA
+    if(huart != &MDB_LOG_UART) {
+        return;
+    }
+    sinkTail = (sinkTail + sinkInFlight) & (MDB_LOG_SINK_SIZE - 1);
+    sinkInFlight = 0;
+    SinkStartTransfer();
+#else
+    (void)huart;
+#endif
+}
+
+static uint16_t SinkUsed(void) {
+    return (uint16_t)((sinkHead - sinkTail) & (MDB_LOG_SINK_SIZE - 1));
+}
+
+// All or nothing, partial lines are never queued
+static bool SinkPut(const uint8_t* data, uint16_t length) {
+    if(length > MDB_LogSinkFree()) {
+        return false;
+    }
+
+    uint16_t head = sinkHead;
+    uint16_t first = MDB_LOG_SINK_SIZE - head;
+    if(first > length) {
+        first = length;
+    }
+    memcpy(&sinkBuffer[head], data, first);
+    memcpy(&sinkBuffer[0], data + first, length - first);
+
+    sinkHead = (head + length) & (MDB_LOG_SINK_SIZE - 1);
+    return true;
+}
+
+#if MDB_LOG_SINK == MDB_LOG_SINK_UART_DMA
+static void SinkStartTransfer(void) {
+    // Producers and the completion interrupt both start transfers
+    __disable_irq();
+    if(sinkInFlight != 0 || sinkTail == sinkHead) {
+        __enable_irq();
+        return;
+    }
+
+    // One contiguous chunk per transfer, wrap is handled by the next one
+    uint16_t tail = sinkTail;
+    uint16_t head = sinkHead;
+    uint16_t chunk = head > tail ? head - tail : MDB_LOG_SINK_SIZE - tail;
+    sinkInFlight = chunk;
+    __enable_irq();
+
+#if (__DCACHE_PRESENT == 1U)
+    uint32_t start = (uint32_t)&sinkBuffer[tail] & ~31UL;
+    uint32_t end = (uint32_t)&sinkBuffer[tail] + chunk;
+    SCB_CleanDCache_by_Addr((uint32_t*)start, (int32_t)(end - start));
+#endif
+
+    if(HAL_UART_Transmit_DMA(&MDB_LOG_UART, &sinkBuffer[tail], chunk) != HAL_OK) {
+        sinkInFlight = 0;
+    }
+}
+#endif
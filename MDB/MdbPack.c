@@ -0,0 +1,105 @@
+// mdbpack.c
+// Compact storage encoding for MDB_TransactionLog_t.
+//
+// Layout, all integers LEB128 varints:
+//   timestamp delta to the previous record
+//   flags: bits 0-2 type, bit 3 success, bits 4-7 error
+//   amount
+//   item number
+//   transaction ID
+// A typical vend packs into 7-11 bytes instead of the 24 byte struct.
+
+#include "MDB.h"
+
+_Static_assert(TRANS_NEGATIVE_VEND < 8, "Transaction type must fit in 3 bits");
+_Static_assert(MDB_ERR_HARDWARE < 16, "Error code must fit in 4 bits");
+
+// Private function declarations
+static uint8_t PutVarint(uint8_t* out, uint32_t value);
+static uint8_t GetVarint(const uint8_t* in, uint8_t length, uint32_t* value);
+
+// Returns the encoded length, at most MDB_PACKED_TRANSACTION_MAX bytes
+uint8_t MDB_PackTransaction(const MDB_TransactionLog_t* record, uint32_t previousTimestamp, uint8_t* out) {
+    uint8_t length = 0;
+
+    length += PutVarint(&out[length], record->timestamp - previousTimestamp);
+    out[length++] = (uint8_t)((record->type & 0x07) |
+                              (record->success ? 0x08 : 0x00) |
+                              ((record->error & 0x0F) << 4));
+    length += PutVarint(&out[length], record->amount);
+    length += PutVarint(&out[length], record->itemNumber);
+    length += PutVarint(&out[length], record->transactionId);
+
+    return length;
+}
+
+// Returns the number of bytes consumed, 0 if the input is truncated or corrupt
+uint8_t MDB_UnpackTransaction(const uint8_t* in, uint8_t length, uint32_t previousTimestamp,
+                              MDB_TransactionLog_t* record) {
+    uint32_t delta;
+    uint32_t amount;
+    uint32_t item;
+    uint32_t transactionId;
+    uint8_t used = 0;
+    uint8_t n;
+
+    if((n = GetVarint(&in[used], length - used, &delta)) == 0) {
+        return 0;
+    }
+    used += n;
+
+    if(used >= length) {
+        return 0;
+    }
+    uint8_t flags = in[used++];
+    if((flags & 0x07) > TRANS_NEGATIVE_VEND || (flags >> 4) > MDB_ERR_HARDWARE) {
+        return 0;
+    }
+
+    if((n = GetVarint(&in[used], length - used, &amount)) == 0) {
+        return 0;
+    }
+    used += n;
+
+    if((n = GetVarint(&in[used], length - used, &item)) == 0 || item > 0xFFFF) {
+        return 0;
+    }
+    used += n;
+
+    if((n = GetVarint(&in[used], length - used, &transactionId)) == 0) {
+        return 0;
+    }
+    used += n;
+
+    record->timestamp = previousTimestamp + delta;
+    record->type = (MDB_TransactionType_t)(flags & 0x07);
+    record->success = (flags & 0x08) != 0;
+    record->error = (MDB_Error_t)(flags >> 4);
+    record->amount = amount;
+    record->itemNumber = (uint16_t)item;
+    record->transactionId = transactionId;
+
+    return used;
+}
+
+static uint8_t PutVarint(uint8_t* out, uint32_t value) {
+    uint8_t length = 0;
+    while(value >= 0x80) {
+        out[length++] = (uint8_t)(value | 0x80);
+        value >>= 7;
+    }
+    out[length++] = (uint8_t)value;
+    return length;
+}
+
+static uint8_t GetVarint(const uint8_t* in, uint8_t length, uint32_t* value) {
+    uint32_t result = 0;
+    for(uint8_t i = 0; i < length && i < 5; i++) {
+        result |= (uint32_t)(in[i] & 0x7F) << (7 * i);
+        if(!(in[i] & 0x80)) {
+            *value = result;
+            return i + 1;
+        }
+    }
+    return 0;
+}
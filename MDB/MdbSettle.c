@@ -0,0 +1,232 @@
+// mdbsettle.c
+// Store-and-forward settlement queue.
+//
+// Completed sales are held in a bounded ring that survives reset (backup
+// SRAM on target when the vend journal lives there, .noinit RAM otherwise)
+// and are forwarded to the settlement uplink in packed batches. While the
+// uplink is down records simply accumulate; nothing leaves the queue until
+// the uplink has accepted the batch carrying it. A batch resent after a
+// lost acknowledgement carries the same transaction IDs, so the upstream
+// side can discard the duplicates.
+
+#include "MDB.h"
+#include <stddef.h>
+
+#if MDB_SETTLE_ENABLE
+
+typedef struct {
+    MDB_TransactionLog_t record;
+    uint32_t crc;
+} MDB_SettleSlot_t;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t head;              // Free running, next slot to fill
+    uint32_t tail;              // Free running, oldest unsettled slot
+    uint32_t crc;               // Over magic, head and tail
+    MDB_SettleSlot_t slots[MDB_SETTLE_QUEUE_SIZE];
+} MDB_SettleQueue_t;
+
+_Static_assert((MDB_SETTLE_QUEUE_SIZE & (MDB_SETTLE_QUEUE_SIZE - 1)) == 0, "Settle queue size must be a power of two");
+
+#if MDB_VEND_JOURNAL_BKPSRAM
+_Static_assert(2 * sizeof(MDB_VendJournal_t) <= MDB_SETTLE_BKPSRAM_OFFSET, "Settle queue overlaps the vend journal");
+_Static_assert(MDB_SETTLE_BKPSRAM_OFFSET + sizeof(MDB_SettleQueue_t) <= 0x1000, "Settle queue exceeds backup SRAM");
+static MDB_SettleQueue_t* const settleQueue = (MDB_SettleQueue_t*)(BKPSRAM_BASE + MDB_SETTLE_BKPSRAM_OFFSET);
+#else
+static MDB_SettleQueue_t settleQueueStorage __attribute__((section(".noinit")));
+static MDB_SettleQueue_t* const settleQueue = &settleQueueStorage;
+#endif
+
+// Private variables
+static MDB_SettleUplink_t settleUplink;
+static bool settleReady = false;
+static uint32_t settleDropped = 0;
+static uint32_t oldestQueuedTime = 0;
+static uint32_t lastAttemptTime = 0;
+static uint32_t lastFullWarning = 0;
+static bool fullWarned = false;
+static bool lastAttemptFailed = false;
+static uint8_t batchBuffer[MDB_SETTLE_BATCH_MAX] __attribute__((aligned(4)));
+
+// Private function declarations
+static void CommitIndices(void);
+static bool QueueValid(void);
+static uint16_t BuildBatch(uint16_t* count, uint16_t* span);
+static void ReleaseSlots(uint16_t span, uint16_t count);
+
+// Call after the vend journal is attached, backup SRAM must be accessible
+bool MDB_SettleInit(void) {
+    if(!QueueValid()) {
+        MDB_LOG_WARNING("Settlement queue invalid, starting empty");
+        memset(settleQueue, 0, offsetof(MDB_SettleQueue_t, slots));
+        CommitIndices();
+    } else if(MDB_SettlePending() > 0) {
+        MDB_LOG_INFO("Settlement queue restored: %u pending", MDB_SettlePending());
+    }
+
+    oldestQueuedTime = HAL_GetTick();
+    lastAttemptFailed = false;
+    settleReady = true;
+    return true;
+}
+
+void MDB_SettleSetUplink(const MDB_SettleUplink_t* uplink) {
+    if(uplink == NULL) {
+        memset(&settleUplink, 0, sizeof(settleUplink));
+    } else {
+        settleUplink = *uplink;
+    }
+}
+
+bool MDB_SettleEnqueue(const MDB_TransactionLog_t* record) {
+    if(!settleReady || record == NULL) {
+        return false;
+    }
+
+    // Unsettled sales are never overwritten, the journal keeps the overflow.
+    // Without an uplink nothing drains, so the drop is only counted.
+    if(MDB_SettlePending() >= MDB_SETTLE_QUEUE_SIZE) {
+        uint32_t currentTime = HAL_GetTick();
+        settleDropped++;
+        if(settleUplink.send != NULL &&
+           (!fullWarned || currentTime - lastFullWarning >= MDB_SETTLE_WARN_INTERVAL)) {
+            MDB_LOG_WARNING("Settlement queue full, %lu transactions not queued",
+                            (unsigned long)settleDropped);
+            lastFullWarning = currentTime;
+            fullWarned = true;
+        }
+        return false;
+    }
+    fullWarned = false;
+
+    if(MDB_SettlePending() == 0) {
+        oldestQueuedTime = HAL_GetTick();
+    }
+
+    // Slot first, then the index, so a reset in between loses nothing queued
+    MDB_SettleSlot_t* slot = &settleQueue->slots[settleQueue->head & (MDB_SETTLE_QUEUE_SIZE - 1)];
+    slot->record = *record;
+    slot->crc = MDB_Crc32(&slot->record, sizeof(MDB_TransactionLog_t));
+    settleQueue->head++;
+    CommitIndices();
+    return true;
+}
+
+// Call from the main loop. Uplink sends may take a while, so they only
+// happen while no vend is in progress.
+void MDB_SettleService(bool busIdle) {
+    uint16_t pending = MDB_SettlePending();
+    if(!settleReady || !busIdle || pending == 0 || settleUplink.send == NULL) {
+        return;
+    }
+
+    uint32_t currentTime = HAL_GetTick();
+    if(lastAttemptFailed && currentTime - lastAttemptTime < MDB_SETTLE_RETRY) {
+        return;
+    }
+
+    // Partial batches wait so the per-message uplink overhead is shared
+    if(pending < MDB_SETTLE_BATCH && currentTime - oldestQueuedTime < MDB_SETTLE_INTERVAL) {
+        return;
+    }
+
+    if(settleUplink.isUp != NULL && !settleUplink.isUp(settleUplink.context)) {
+        lastAttemptTime = currentTime;
+        lastAttemptFailed = true;
+        return;
+    }
+
+    uint16_t count;
+    uint16_t span;
+    uint16_t length = BuildBatch(&count, &span);
+    lastAttemptTime = currentTime;
+    if(count == 0) {
+        ReleaseSlots(span, 0);
+        return;
+    }
+
+    lastAttemptFailed = !settleUplink.send(settleUplink.context, batchBuffer, length);
+    if(lastAttemptFailed) {
+        MDB_LOG_WARNING("Settlement uplink failed, %u pending", pending);
+        return;
+    }
+
+    ReleaseSlots(span, count);
+    oldestQueuedTime = currentTime;
+    MDB_LOG_DEBUG("Settled %u transactions, %u pending", count, MDB_SettlePending());
+}
+
+uint16_t MDB_SettlePending(void) {
+    return (uint16_t)(settleQueue->head - settleQueue->tail);
+}
+
+uint32_t MDB_SettleDropped(void) {
+    return settleDropped;
+}
+
+static void CommitIndices(void) {
+    settleQueue->magic = MDB_SETTLE_MAGIC;
+    settleQueue->crc = MDB_Crc32(settleQueue, offsetof(MDB_SettleQueue_t, crc));
+#if MDB_VEND_JOURNAL_BKPSRAM
+    __DSB();
+#endif
+}
+
+static bool QueueValid(void) {
+    return settleQueue->magic == MDB_SETTLE_MAGIC &&
+           settleQueue->crc == MDB_Crc32(settleQueue, offsetof(MDB_SettleQueue_t, crc)) &&
+           settleQueue->head - settleQueue->tail <= MDB_SETTLE_QUEUE_SIZE;
+}
+
+// Slots only leave the queue once the batch covering them was accepted.
+// Corrupt slots inside that range are dropped with it.
+static void ReleaseSlots(uint16_t span, uint16_t count) {
+    if(span == 0) {
+        return;
+    }
+    if(span > count) {
+        MDB_LOG_ERROR("Settlement slots corrupt, %u dropped", span - count);
+        settleDropped += span - count;
+    }
+    settleQueue->tail += span;
+    CommitIndices();
+}
+
+// Packs up to MDB_SETTLE_BATCH records from the tail. A corrupt slot is
+// skipped, it cannot be settled anyway. Span is the number of slots the
+// batch covers, corrupt ones included. The tail is left alone.
+static uint16_t BuildBatch(uint16_t* count, uint16_t* span) {
+    MDB_SettleBatchHeader_t* header = (MDB_SettleBatchHeader_t*)batchBuffer;
+    uint8_t* payload = batchBuffer + sizeof(MDB_SettleBatchHeader_t);
+    uint16_t payloadLength = 0;
+    uint32_t previousTimestamp = 0;
+    uint16_t available = MDB_SettlePending();
+    uint32_t cursor = settleQueue->tail;
+
+    *count = 0;
+    memset(header, 0, sizeof(MDB_SettleBatchHeader_t));
+    while(*count < MDB_SETTLE_BATCH && (uint16_t)(cursor - settleQueue->tail) < available) {
+        const MDB_SettleSlot_t* slot = &settleQueue->slots[cursor & (MDB_SETTLE_QUEUE_SIZE - 1)];
+        cursor++;
+        if(slot->crc != MDB_Crc32(&slot->record, sizeof(MDB_TransactionLog_t))) {
+            continue;
+        }
+
+        if(*count == 0) {
+            header->firstTransactionId = slot->record.transactionId;
+        }
+        payloadLength += MDB_PackTransaction(&slot->record, previousTimestamp, &payload[payloadLength]);
+        previousTimestamp = slot->record.timestamp;
+        (*count)++;
+    }
+
+    *span = (uint16_t)(cursor - settleQueue->tail);
+    header->magic = MDB_SETTLE_MAGIC;
+    header->count = *count;
+    header->payloadLength = payloadLength;
+    header->crc = MDB_Crc32(payload, payloadLength);
+    return (uint16_t)(sizeof(MDB_SettleBatchHeader_t) + payloadLength);
+}
+
+#endif